@@ -8,22 +8,59 @@
  *            of the MIT license.  See the LICENSE file for details.
  */
 
+#include <errno.h>
 #include <time.h>
 
 #include "Common.h"
 
 #ifdef JSCUTILS_OS_WINDOWS
 #include <Windows.h>
+#define JSCUTILS_THREAD_LOCAL __declspec(thread)
+#else
+#define JSCUTILS_THREAD_LOCAL __thread
+#endif
+
+#if defined(JSCUTILS_OS_LINUX) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#include <cpuid.h>
+#define JSCUTILS_HAVE_TSC
 #endif
 
 namespace JsCPPUtils
 {
+	static Common::ClockSource s_clocksource = Common::CLOCKSOURCE_MONOTONIC;
+	static bool s_clocksourceset = false;
+
+#ifdef JSCUTILS_HAVE_TSC
+	// tick count = s_tsc_basems + (rdtsc - s_tsc_base) / s_tsc_perms
+	static uint64_t s_tsc_base = 0;
+	static int64_t s_tsc_basems = 0;
+	static uint64_t s_tsc_perms = 1;
+#endif
+
+	// The wall clock is read again once the tick count has moved a second past the last reading
+	static JSCUTILS_THREAD_LOCAL bool s_cached_valid = false;
+	static JSCUTILS_THREAD_LOCAL int64_t s_cached_tickms = 0;
+	static JSCUTILS_THREAD_LOCAL int64_t s_cached_wallbasems = 0;
+	static JSCUTILS_THREAD_LOCAL int64_t s_cached_wallbasetick = 0;
+
+	static int64_t getWallTimeMs()
+	{
+#if defined(JSCUTILS_OS_WINDOWS)
+		return ((int64_t)time(NULL)) * 1000;
+#elif defined(JSCUTILS_OS_LINUX)
+		struct timespec ts = {0, 0};
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+		return ((int64_t)(ts.tv_sec)) * 1000 + (int64_t)(ts.tv_nsec / 1000000);
+#endif
+	}
+
 	int64_t Common::getTickCount()
 	{
 #if defined(JSCUTILS_OS_WINDOWS)
 		return GetTickCount64();
 #elif defined(JSCUTILS_OS_LINUX)
-		struct timespec ts = {0};
+		struct timespec ts = {0, 0};
 		int64_t ticks = 0;
 		clock_gettime(CLOCK_MONOTONIC, &ts);
 		ticks  = ((int64_t)(ts.tv_nsec / 1000000));
@@ -31,4 +68,141 @@ namespace JsCPPUtils
 		return ticks;
 #endif
 	}
+
+	int64_t Common::getMicroTickCount()
+	{
+#if defined(JSCUTILS_OS_WINDOWS)
+		LARGE_INTEGER freq, counter;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&counter);
+		return (int64_t)(counter.QuadPart / freq.QuadPart) * 1000000 + (int64_t)((counter.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#elif defined(JSCUTILS_OS_LINUX)
+		struct timespec ts = {0, 0};
+		int64_t ticks = 0;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ticks  = ((int64_t)(ts.tv_nsec / 1000));
+		ticks += ((int64_t)(ts.tv_sec)) * 1000000;
+		return ticks;
+#endif
+	}
+
+	int Common::setClockSource(ClockSource source)
+	{
+		// Loops already running on the first source would see their tick count jump
+		if (s_clocksourceset)
+			return (source == s_clocksource) ? 1 : -EBUSY;
+
+		switch (source)
+		{
+		case CLOCKSOURCE_MONOTONIC:
+			break;
+		case CLOCKSOURCE_MONOTONIC_COARSE:
+#if defined(JSCUTILS_OS_LINUX)
+			{
+				struct timespec ts = {0, 0};
+				if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) != 0)
+					return -ENOTSUP;
+			}
+#endif
+			break;
+		case CLOCKSOURCE_TSC:
+#ifdef JSCUTILS_HAVE_TSC
+			{
+				unsigned int eax, ebx, ecx, edx;
+				int64_t startus, endus;
+				uint64_t starttsc, endtsc;
+
+				// CPUID 8000_0007h EDX bit 8: the TSC runs at a constant rate in every P-, C- and T-state
+				if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1U << 8)))
+					return -ENOTSUP;
+
+				startus = getMicroTickCount();
+				starttsc = __rdtsc();
+				do {
+					endus = getMicroTickCount();
+				} while ((endus - startus) < 20000);
+				endtsc = __rdtsc();
+				if (endtsc <= starttsc)
+					return -ENOTSUP;
+
+				s_tsc_perms = (endtsc - starttsc) * 1000 / (uint64_t)(endus - startus);
+				if (s_tsc_perms == 0)
+					return -ENOTSUP;
+				s_tsc_base = endtsc;
+				s_tsc_basems = endus / 1000;
+			}
+			break;
+#else
+			return -ENOTSUP;
+#endif
+		default:
+			return -EINVAL;
+		}
+
+		s_clocksource = source;
+		s_clocksourceset = true;
+		return 1;
+	}
+
+	Common::ClockSource Common::getClockSource()
+	{
+		return s_clocksource;
+	}
+
+	static int64_t readClockSource()
+	{
+		int64_t ticks;
+
+		switch (s_clocksource)
+		{
+#if defined(JSCUTILS_OS_LINUX)
+		case Common::CLOCKSOURCE_MONOTONIC_COARSE:
+			{
+				struct timespec ts = {0, 0};
+				clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+				ticks  = ((int64_t)(ts.tv_nsec / 1000000));
+				ticks += ((int64_t)(ts.tv_sec)) * 1000;
+			}
+			break;
+#endif
+#ifdef JSCUTILS_HAVE_TSC
+		case Common::CLOCKSOURCE_TSC:
+			ticks = s_tsc_basems + (int64_t)((__rdtsc() - s_tsc_base) / s_tsc_perms);
+			break;
+#endif
+		default:
+			ticks = Common::getTickCount();
+			break;
+		}
+
+		return ticks;
+	}
+
+	int64_t Common::refreshCachedClock()
+	{
+		int64_t ticks = readClockSource();
+
+		if (!s_cached_valid || ((ticks - s_cached_wallbasetick) >= 1000))
+		{
+			s_cached_wallbasems = getWallTimeMs();
+			s_cached_wallbasetick = ticks;
+		}
+		s_cached_tickms = ticks;
+		s_cached_valid = true;
+		return ticks;
+	}
+
+	int64_t Common::getCachedTickCount()
+	{
+		if (!s_cached_valid)
+			return readClockSource();
+		return s_cached_tickms;
+	}
+
+	int64_t Common::getCachedTime()
+	{
+		if (!s_cached_valid)
+			return getWallTimeMs() / 1000;
+		return (s_cached_wallbasems + (s_cached_tickms - s_cached_wallbasetick)) / 1000;
+	}
 }
\ No newline at end of file
@@ -72,7 +72,30 @@ namespace JsCPPUtils
 	class Common
 	{
 	public:
+		enum ClockSource {
+			CLOCKSOURCE_MONOTONIC = 0,  // clock_gettime(CLOCK_MONOTONIC)
+			CLOCKSOURCE_MONOTONIC_COARSE, // CLOCK_MONOTONIC_COARSE: no hardware read, jiffy resolution (1-10 ms)
+			CLOCKSOURCE_TSC              // rdtsc scaled by a frequency measured in setClockSource(); needs an invariant TSC
+		};
+
 		static int64_t getTickCount();
+		static int64_t getMicroTickCount();
+
+		/**
+		 * Cached clock: every thread keeps its own copy of the millisecond tick count and
+		 * of the wall-clock time, updated only by refreshCachedClock(). An event loop
+		 * refreshes once per wakeup and everything it runs for that batch reads the copy.
+		 * A thread that never refreshed gets a fresh reading.
+		 */
+		// Process-wide source of refreshCachedClock(), set once: a later call returns 1 for the same
+		// source and -EBUSY for another. CLOCKSOURCE_TSC spins 20 ms to measure the TSC frequency.
+		// Returns 1, or -ENOTSUP if the source is unusable here.
+		static int setClockSource(ClockSource source);
+		static ClockSource getClockSource();
+		static int64_t refreshCachedClock();
+		static int64_t getCachedTickCount();
+		// Seconds since the epoch, as time()
+		static int64_t getCachedTime();
 	};
 }
 
@@ -10,6 +10,7 @@
  */
 
 #include <errno.h>
+#include <time.h>
 
 #include "JsThread.h"
 
@@ -100,15 +101,49 @@ namespace JsCPPUtils
 		return pThreadCtx->reqStop();
 	}
 
-	int JsThread::ThreadContext::reqStop()
+	int JsThread::ThreadContext::reqStop(bool bCancel)
 	{
 		int nrst = pthread_mutex_unlock(&m_run_mutex);
-		pthread_cancel(m_pthread);
+		if(bCancel)
+			pthread_cancel(m_pthread);
 		if(nrst != 0)
 			return -errno;
 		return 1;
 	}
 
+	int JsThread::ThreadContext::cancel()
+	{
+		int nrst = pthread_cancel(m_pthread);
+		if(nrst != 0)
+			return -nrst;
+		return 1;
+	}
+
+	int JsThread::ThreadContext::join(int timeoutms)
+	{
+		int nrst;
+		if(timeoutms < 0)
+		{
+			nrst = pthread_join(m_pthread, NULL);
+		}else{
+			struct timespec ts = {0, 0};
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += timeoutms / 1000;
+			ts.tv_nsec += (timeoutms % 1000) * 1000000L;
+			if(ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			nrst = pthread_timedjoin_np(m_pthread, NULL, &ts);
+		}
+		if(nrst == ETIMEDOUT)
+			return 0;
+		if(nrst != 0)
+			return -nrst;
+		return 1;
+	}
+
 	int JsThread::ThreadContext::_inthread_isRun()
 	{
 		int nrst = pthread_mutex_trylock(&m_run_mutex);
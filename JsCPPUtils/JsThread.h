@@ -55,7 +55,9 @@ namespace JsCPPUtils
 			{
 			}
 		public:
-			int reqStop();
+			int reqStop(bool bCancel = true);
+			int cancel();
+			int join(int timeoutms = -1);
 			int _inthread_isRun();
 			RunningStatus getRunningStatus();
 		};
@@ -11,72 +11,133 @@
 
 #include "LockableEx.h"
 
+#if defined(JSCUTILS_OS_LINUX)
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 namespace JsCPPUtils
 {
+#if defined(JSCUTILS_OS_WINDOWS)
 	LockableEx::LockableEx()
 		: m_lock()
+		, m_owner(0)
+		, m_depth(0)
 	{
-			
 	}
 
 	LockableEx::~LockableEx()
 	{
-			
 	}
 
-#if defined(JSCUTILS_OS_WINDOWS)
 	int LockableEx::lock()
 	{
-		int nrst = 1;
+		int nrst;
 		DWORD dwTid = GetCurrentThreadId();
-		int _locked = m_tinfo.get(dwTid);
-		if (_locked++ == 0)
+		if (m_owner == dwTid)
 		{
-			nrst = m_lock.lock();
+			m_depth++;
+			return 1;
+		}
+		nrst = m_lock.lock();
+		if (nrst > 0)
+		{
+			m_owner = dwTid;
+			m_depth = 1;
 		}
-		m_tinfo.set(dwTid, _locked);
 		return nrst;
 	}
 
-	int LockableEx::unlock(bool earseinmap)
+	int LockableEx::unlock(bool /*earseinmap*/)
 	{
-		int nrst = 1;
-		DWORD dwTid = GetCurrentThreadId();
-		int _locked = m_tinfo.get(dwTid);
-		if (--_locked == 0)
-		{
-			nrst = m_lock.unlock();
-			if (earseinmap)
-				m_tinfo.erase(curthread);
-		}
-		m_tinfo.set(dwTid, _locked);
-		return nrst;
+		if (m_owner != GetCurrentThreadId())
+			return -((int)ERROR_NOT_OWNER);
+		if (--m_depth > 0)
+			return 1;
+		m_owner = 0;
+		return m_lock.unlock();
+	}
+
+	int LockableEx::unlockAll()
+	{
+		if (m_owner != GetCurrentThreadId())
+			return 1;
+		m_depth = 1;
+		return unlock();
 	}
 #elif defined(JSCUTILS_OS_LINUX)
+	static __thread int s_tid = 0;
+
+	static inline int currentTid()
+	{
+		if (s_tid == 0)
+			s_tid = (int)syscall(SYS_gettid);
+		return s_tid;
+	}
+
+	LockableEx::LockableEx()
+		: m_state(0)
+		, m_owner(0)
+		, m_depth(0)
+	{
+	}
+
+	LockableEx::~LockableEx()
+	{
+	}
+
 	int LockableEx::lock()
 	{
-		int nrst;
-		pthread_t curthread = pthread_self();
-		int &_locked = m_tinfo[curthread];
-		if (_locked++ == 0)
+		int tid = currentTid();
+		int state;
+
+		// Only this thread ever stores its own id, so a stale read cannot match
+		if (m_owner == tid)
 		{
-			nrst = m_lock.lock();
+			m_depth++;
+			return 1;
 		}
-		return nrst;
+
+		state = __sync_val_compare_and_swap(&m_state, 0, 1);
+		if (state != 0)
+		{
+			// Contended: mark it so that the holder wakes a waiter when it unlocks
+			if (state != 2)
+				state = __sync_lock_test_and_set(&m_state, 2);
+			while (state != 0)
+			{
+				syscall(SYS_futex, &m_state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+				state = __sync_lock_test_and_set(&m_state, 2);
+			}
+		}
+		m_owner = tid;
+		m_depth = 1;
+		return 1;
 	}
 
-	int LockableEx::unlock(bool earseinmap)
+	int LockableEx::unlock(bool /*earseinmap*/)
 	{
-		int nrst;
-		pthread_t curthread = pthread_self();
-		int& _locked = m_tinfo[curthread];
-		if (--_locked == 0)
+		if (m_owner != currentTid())
+			return -EPERM;
+		if (--m_depth > 0)
+			return 1;
+		m_owner = 0;
+		if (__sync_fetch_and_sub(&m_state, 1) != 1)
 		{
-			nrst = m_lock.unlock();
-			if (earseinmap)
-				m_tinfo.erase(curthread);
+			__sync_lock_release(&m_state);
+			syscall(SYS_futex, &m_state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 		}
-		return nrst;
+		return 1;
+	}
+
+	int LockableEx::unlockAll()
+	{
+		if (m_owner != currentTid())
+			return 1;
+		m_depth = 1;
+		return unlock();
 	}
 #endif
 }
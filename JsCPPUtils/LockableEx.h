@@ -16,25 +16,37 @@
 #define __JSCPPUTILS_LOCKABLEEX_H__
 
 #include "Lockable.h"
-#include "HashMap.h"
 
 namespace JsCPPUtils
 {
+	/**
+	 * Recursive lock: the thread holding it may lock it again.
+	 * On Linux it is a futex word with the owner's thread id and the depth, 12 bytes and
+	 * nothing allocated, so that it can be embedded in every connection.
+	 */
 	class LockableEx
 	{
 	private:
-		Lockable m_lock;
 #if defined(JSCUTILS_OS_WINDOWS)
-		HashMap<DWORD, int, 31, 16, 4> m_tinfo;
+		Lockable m_lock;
+		volatile DWORD m_owner;
 #elif defined(JSCUTILS_OS_LINUX)
-		HashMap<pthread_t, int, 31, 16, 4> m_tinfo;
+		volatile int m_state; // 0: free, 1: held, 2: held and a thread may be waiting
+		volatile int m_owner; // kernel thread id of the holder, 0 when free
 #endif
+		int m_depth;
+
+		LockableEx(const LockableEx&);
+		LockableEx& operator=(const LockableEx&);
 
 	public:
 		LockableEx();
 		~LockableEx();
 		int lock();
+		// earseinmap is kept for the callers of the earlier per-thread map; nothing is kept per thread any more
 		int unlock(bool earseinmap = false);
+		// Releases every level the calling thread holds, for an object torn down while held
+		int unlockAll();
 
 	};
 }
@@ -17,13 +17,24 @@
 #include <time.h>
 
 #include "Logger.h"
+#include "Common.h"
 
 #ifdef HAS_SYSLOG
 #include <syslog.h>
 #endif
 
+#ifdef JSCUTILS_OS_WINDOWS
+#define JSLOGGER_THREAD_LOCAL __declspec(thread)
+#else
+#define JSLOGGER_THREAD_LOCAL __thread
+#endif
+
 namespace JsCPPUtils
 {
+	static JSLOGGER_THREAD_LOCAL bool s_tmcache_valid = false;
+	static JSLOGGER_THREAD_LOCAL time_t s_tmcache_time = 0;
+	static JSLOGGER_THREAD_LOCAL struct tm s_tmcache;
+
 
 	Logger::Logger(OutputType outputType, const char *szFilePath, CallbackFunc_t cbfunc, void *cbuserptr) : 
 		m_pParent(NULL)
@@ -122,12 +133,19 @@ namespace JsCPPUtils
 				break;
 #endif
 			
-			time(&rawtime);
+			// An event loop thread logs with the time of its current batch, and converts it once a second
+			rawtime = (time_t)Common::getCachedTime();
+			if (!s_tmcache_valid || (rawtime != s_tmcache_time))
+			{
 #if defined(JSCUTILS_OS_WINDOWS)
-			localtime_s(&timeinfo, &rawtime);
+				localtime_s(&s_tmcache, &rawtime);
 #elif defined(JSCUTILS_OS_LINUX)
-			localtime_r(&rawtime, &timeinfo);
+				localtime_r(&rawtime, &s_tmcache);
 #endif
+				s_tmcache_time = rawtime;
+				s_tmcache_valid = true;
+			}
+			timeinfo = s_tmcache;
 
 			va_start(args, format);
 #ifdef _JSCUTILS_MSVC_CRT_SECURE
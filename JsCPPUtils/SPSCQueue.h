@@ -0,0 +1,118 @@
+/**
+ * @file	SPSCQueue.h
+ * @class	SPSCQueue
+ * @brief	Bounded lock-free queue for exactly one producer thread and one consumer thread
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+#pragma once
+#endif
+
+#ifndef __JSCPPUTILS_SPSCQUEUE_H__
+#define __JSCPPUTILS_SPSCQUEUE_H__
+
+#include <stdlib.h>
+
+#include "Common.h"
+
+#if defined(JSCUTILS_OS_WINDOWS)
+#include <intrin.h>
+#endif
+
+namespace JsCPPUtils
+{
+
+	template <typename T>
+	class SPSCQueue
+	{
+	private:
+		enum { CACHELINE_SIZE = 64 };
+
+		T *m_items;
+		size_t m_mask;
+
+		// head and tail are free-running counters on separate cache lines
+		char m_pad0[CACHELINE_SIZE];
+		volatile size_t m_head; // written by the consumer only
+		char m_pad1[CACHELINE_SIZE - sizeof(size_t)];
+		volatile size_t m_tail; // written by the producer only
+		char m_pad2[CACHELINE_SIZE - sizeof(size_t)];
+
+		static size_t loadAcquire(const volatile size_t *p)
+		{
+#if defined(JSCUTILS_OS_WINDOWS)
+			size_t value = *p;
+			_ReadWriteBarrier();
+			return value;
+#else
+			return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+		}
+
+		static void storeRelease(volatile size_t *p, size_t value)
+		{
+#if defined(JSCUTILS_OS_WINDOWS)
+			_ReadWriteBarrier();
+			*p = value;
+#else
+			__atomic_store_n(p, value, __ATOMIC_RELEASE);
+#endif
+		}
+
+		SPSCQueue(const SPSCQueue&);
+		SPSCQueue& operator=(const SPSCQueue&);
+
+	public:
+		// std::bad_alloc
+		SPSCQueue(size_t capacity) :
+			m_items(NULL),
+			m_mask(0),
+			m_head(0),
+			m_tail(0)
+		{
+			size_t realcapacity = 1;
+			while (realcapacity < capacity)
+				realcapacity <<= 1;
+			m_items = new T[realcapacity];
+			m_mask = realcapacity - 1;
+		}
+
+		~SPSCQueue()
+		{
+			delete[] m_items;
+			m_items = NULL;
+		}
+
+		size_t capacity() const
+		{
+			return m_mask + 1;
+		}
+
+		// Producer thread only. Returns false if the queue is full.
+		bool push(const T& item)
+		{
+			size_t tail = m_tail;
+			if ((tail - loadAcquire(&m_head)) > m_mask)
+				return false;
+			m_items[tail & m_mask] = item;
+			storeRelease(&m_tail, tail + 1);
+			return true;
+		}
+
+		// Consumer thread only. Returns false if the queue is empty.
+		bool pop(T *pitem)
+		{
+			size_t head = m_head;
+			if (head == loadAcquire(&m_tail))
+				return false;
+			*pitem = m_items[head & m_mask];
+			storeRelease(&m_head, head + 1);
+			return true;
+		}
+	};
+
+}
+
+#endif
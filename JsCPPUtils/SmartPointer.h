@@ -13,23 +13,33 @@
 
 #include <stdio.h>
 
-#include "Lockable.h"
+#include "Common.h"
+
+#if defined(JSCUTILS_OS_WINDOWS)
+#include <intrin.h>
+#endif
 
 namespace JsCPPUtils
 {
 	template <class T>
 	class SmartPointer {
 	private:
-		bool m_isRoot;
 		T *m_ptr;
 		SmartPointer<T> *m_root_smartptr;
+		volatile int m_refCount; // counted atomically, on the root only
+		bool m_isRoot;
 
-		Lockable *pLock;
-		int m_refCount;
+		static int atomicAdd(volatile int *p, int value)
+		{
+#if defined(JSCUTILS_OS_WINDOWS)
+			return _InterlockedExchangeAdd((volatile long*)p, value) + value;
+#else
+			return __sync_add_and_fetch(p, value);
+#endif
+		}
 
 	protected:
 		SmartPointer(T* p, bool isRoot) : 
-			 pLock(NULL),
 			 m_refCount(0)
 		{
 			m_isRoot = isRoot;
@@ -37,7 +47,6 @@ namespace JsCPPUtils
 			{
 				m_ptr = p;
 				m_root_smartptr = NULL;
-				pLock = new Lockable();
 			}else{
 				m_ptr = NULL;
 				m_root_smartptr = new SmartPointer(p);
@@ -49,9 +58,7 @@ namespace JsCPPUtils
 		{
 			if(m_isRoot)
 			{
-				pLock->lock();
-				m_refCount++;
-				pLock->unlock();
+				atomicAdd(&m_refCount, 1);
 			}else{
 				m_root_smartptr->addRef();
 			}
@@ -61,16 +68,12 @@ namespace JsCPPUtils
 		{
 			if(m_isRoot)
 			{
-				pLock->lock();
-				m_refCount--;
-				if(m_refCount <= 0)
+				if(atomicAdd(&m_refCount, -1) <= 0)
 				{
 					if(m_ptr != NULL)
 						delete m_ptr;
 					delete this;
-					return;
 				}
-				pLock->unlock();
 			}else{
 				if(m_root_smartptr != NULL)
 					m_root_smartptr->delRef();
@@ -79,20 +82,18 @@ namespace JsCPPUtils
 
 	public:
 		SmartPointer() :
-			m_isRoot(false),
 			m_ptr(NULL),
 			m_root_smartptr(NULL),
-			pLock(NULL),
-			m_refCount(0)
+			m_refCount(0),
+			m_isRoot(false)
 		{
 		}
 		
 		SmartPointer(T* p) :
-			m_isRoot(false),
 			m_ptr(NULL),
 			m_root_smartptr(NULL),
-			pLock(NULL),
-			m_refCount(0)
+			m_refCount(0),
+			m_isRoot(false)
 		{
 			m_root_smartptr = new SmartPointer(p, true);
 			m_ptr = m_root_smartptr->m_ptr;
@@ -100,11 +101,10 @@ namespace JsCPPUtils
 		}
 
 		SmartPointer(const SmartPointer<T>& refObj) :
-			m_isRoot(false),
 			m_ptr(NULL),
 			m_root_smartptr(NULL),
-			pLock(NULL),
-			m_refCount(0)
+			m_refCount(0),
+			m_isRoot(false)
 		{
 			m_root_smartptr = refObj.m_root_smartptr;
 			if(m_root_smartptr != NULL)
@@ -115,11 +115,10 @@ namespace JsCPPUtils
 		}
 
 		SmartPointer(const SmartPointer<T>* pRefObj) :
-			m_isRoot(false),
 			m_ptr(NULL),
 			m_root_smartptr(NULL),
-			pLock(NULL),
-			m_refCount(0)
+			m_refCount(0),
+			m_isRoot(false)
 		{
 			m_root_smartptr = pRefObj->m_root_smartptr;
 			if(m_root_smartptr != NULL)
@@ -135,11 +134,6 @@ namespace JsCPPUtils
 			{
 				delRef();
 			}
-			if(pLock != NULL)
-			{
-				delete pLock;
-				pLock = NULL;
-			}
 		}
 
 		T* operator->() const
@@ -159,6 +153,14 @@ namespace JsCPPUtils
 			return m_ptr;
 		}
 
+		// SmartPointers sharing the object, this one included; 0 when empty
+		int getRefCount() const
+		{
+			if(m_root_smartptr == NULL)
+				return 0;
+			return m_root_smartptr->m_refCount;
+		}
+
 		SmartPointer<T>& operator=(T* p)
 		{
 			if(m_root_smartptr != NULL)
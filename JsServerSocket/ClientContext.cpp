@@ -11,38 +11,82 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 
 #include "ClientContext.h"
 #include "ServerContext.h"
+#include "OutputQueue.h"
 #include "macros.h"
 
+// Linux 4.14; older C libraries do not name them
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
 #include <iostream>
 
 namespace JsServerSocket {
 
 	ClientContext::ClientContext(ServerContext *pServerCtx, int index, int clientsock, struct sockaddr_in *client_paddr, void *userptr) : 
-		m_pServerCtx(pServerCtx),
-		m_index(index),
-		m_sockfd(clientsock),
-		m_userptr(userptr),
-		m_isUsable(true),
-		m_sslstate(0)
-#ifdef USE_OPENSSL
-		, m_ssl(NULL)
-#endif
+		m_pServerCtx(pServerCtx)
+	{
+		reset(index, clientsock, client_paddr, userptr);
+	}
+
+	void ClientContext::reset(int index, int clientsock, struct sockaddr_in *client_paddr, void *userptr)
 	{
+		m_isUsable = true;
 		m_freed = false;
-		::memcpy(&m_addr, client_paddr, sizeof(struct sockaddr_in));
-		m_last_recvedtime = JsCPPUtils::Common::getTickCount();
+		m_loopidx = 0;
+		m_index = index;
+		m_sockfd = clientsock;
+		if (client_paddr != NULL)
+			::memcpy(&m_addr, client_paddr, sizeof(struct sockaddr_in));
+		else
+			::memset(&m_addr, 0, sizeof(struct sockaddr_in));
+		m_userptr = userptr;
+		m_last_recvedtime = JsCPPUtils::Common::getCachedTickCount();
+		m_idlenode.prev = NULL;
+		m_idlenode.next = NULL;
+		m_idlenode.expiretick = 0;
+		m_idlenode.pdata = this;
+		m_ptimers = NULL;
+		m_poutq = NULL;
+		m_bexported = false;
+		m_boutarmed = false;
+		m_bcorked = false;
+		m_bzerocopy = false;
+		m_bzcpolled = false;
+		m_sslstate = 0;
+#ifdef USE_OPENSSL
+		m_ssl = NULL;
+#endif
 	}
 
 	ClientContext::~ClientContext()
 	{
 		m_freed = true;
+		if (m_poutq != NULL)
+		{
+			delete m_poutq;
+			m_poutq = NULL;
+		}
 	}
 
 	int ClientContext::getIndex()
@@ -95,6 +139,20 @@ namespace JsServerSocket {
 		if (m_sslstate == 1)
 			return 0;
 		
+		{
+			struct iovec iov;
+			iov.iov_base = pbuf;
+			iov.iov_len = size;
+			nrst = corkOutput(&iov, 1);
+			if (nrst > 0)
+				return size;
+			if (nrst < 0)
+			{
+				errno = -nrst;
+				return -1;
+			}
+		}
+		
 		do
 		{
 			if (m_sslstate == 2)
@@ -119,6 +177,8 @@ namespace JsServerSocket {
 #endif
 			} else {
 				nrst = ::send(m_sockfd, pbuf, size, flags);
+				if (nrst < 0)
+					neno = errno;
 			}
 		} while ((nrst < 0) && (neno == EINTR));
 		errno = neno;
@@ -216,7 +276,7 @@ namespace JsServerSocket {
 				// timeout
 				break;
 			}
-		}while(processedLen < size && ((nrst > 0) || ((nrst < 0) && (neno == EINTR))));
+		}while(processedLen < size && ((nrst > 0) || ((nrst < 0) && ((neno == EINTR) || (neno == EAGAIN)))));
 		if(nrst <= 0)
 			return nrst;
 		return 1;
@@ -225,19 +285,563 @@ namespace JsServerSocket {
 	int ClientContext::sendfixedsize(char *pbuf, int size, JSCUTILS_TYPE_FLAG flags)
 	{
 		int nrst = 1;
+		int neno = 0;
 		int processedLen = 0;
 		do {
 			nrst = this->send(&pbuf[processedLen], size - processedLen, flags);
+			neno = errno;
 			if(nrst > 0)
 				processedLen += nrst;
-		}while(processedLen < size && ((nrst > 0) || ((nrst < 0) && (errno == EINTR))));
+			else if((nrst < 0) && (neno == EAGAIN))
+			{
+				// Non-blocking socket: wait for room as a blocking send would
+				if((nrst = waitWritable()) <= 0)
+					break;
+			}
+		}while(processedLen < size && ((nrst > 0) || ((nrst < 0) && (neno == EINTR))));
 		if(nrst <= 0)
 			return nrst;
 		return 1;
 	}
 
+	int ClientContext::sendv(const struct iovec *piov, int iovcnt)
+	{
+		struct iovec window[FLUSH_IOV_MAX];
+		struct msghdr msg;
+		int idx = 0;
+		size_t offset = 0; // already written of piov[idx]
+		int n;
+		int nrst;
+		int neno;
+
+		if (m_sslstate == 1)
+			return 0;
+		if ((nrst = corkOutput(piov, iovcnt)) != 0)
+			return nrst;
+		if (m_sslstate == 2)
+			return sendvTls(piov, iovcnt);
+
+		for (;;)
+		{
+			while ((idx < iovcnt) && (piov[idx].iov_len <= offset))
+			{
+				idx++;
+				offset = 0;
+			}
+			if (idx >= iovcnt)
+				break;
+
+			for (n = 0; (n < FLUSH_IOV_MAX) && (idx + n < iovcnt); n++)
+				window[n] = piov[idx + n];
+			window[0].iov_base = (char*)window[0].iov_base + offset;
+			window[0].iov_len -= offset;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = window;
+			msg.msg_iovlen = n;
+			nrst = ::sendmsg(m_sockfd, &msg, MSG_NOSIGNAL);
+			if (nrst < 0)
+			{
+				neno = errno;
+				if (neno == EINTR)
+					continue;
+				if ((neno == EAGAIN) || (neno == EWOULDBLOCK))
+				{
+					// Non-blocking socket: wait for room as a blocking send would
+					if ((nrst = waitWritable()) <= 0)
+						return nrst;
+					continue;
+				}
+				return -neno;
+			}
+
+			// A short write stops anywhere, also inside a buffer
+			offset += nrst;
+			while ((idx < iovcnt) && (offset >= piov[idx].iov_len))
+			{
+				offset -= piov[idx].iov_len;
+				idx++;
+			}
+		}
+
+		return 1;
+	}
+
+	int ClientContext::sendvTls(const struct iovec *piov, int iovcnt)
+	{
+		// SSL_write() takes one buffer and makes a record of each call, so small buffers
+		// are joined first; the copy is cheaper than a record and a send() apiece.
+		char gather[SENDV_TLS_GATHER];
+		int gathered = 0;
+		int nrst;
+		int i;
+
+		for (i = 0; i < iovcnt; i++)
+		{
+			size_t len = piov[i].iov_len;
+
+			if (gathered + len <= sizeof(gather))
+			{
+				memcpy(&gather[gathered], piov[i].iov_base, len);
+				gathered += (int)len;
+				continue;
+			}
+			if (gathered > 0)
+			{
+				if ((nrst = sendfixedsize(gather, gathered, 0)) <= 0)
+					return nrst;
+				gathered = 0;
+			}
+			if (len <= sizeof(gather))
+			{
+				memcpy(gather, piov[i].iov_base, len);
+				gathered = (int)len;
+			}
+			else if ((nrst = sendfixedsize((char*)piov[i].iov_base, (int)len, 0)) <= 0)
+				return nrst;
+		}
+		if (gathered > 0)
+			return sendfixedsize(gather, gathered, 0);
+
+		return 1;
+	}
+
+	int ClientContext::waitWritable()
+	{
+		int nrst;
+		struct pollfd tmppollfd;
+		struct timeval timeout_tv;
+		socklen_t optlen = sizeof(timeout_tv);
+		int timeoutms = -1;
+
+		// Honour SO_SNDTIMEO the way a blocking send() would
+		memset(&timeout_tv, 0, sizeof(timeout_tv));
+		if ((::getsockopt(m_sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout_tv, &optlen) == 0) && ((timeout_tv.tv_sec > 0) || (timeout_tv.tv_usec > 0)))
+			timeoutms = timeout_tv.tv_sec * 1000 + timeout_tv.tv_usec / 1000;
+
+		memset(&tmppollfd, 0, sizeof(tmppollfd));
+		tmppollfd.fd = m_sockfd;
+		tmppollfd.events = POLLOUT;
+		do {
+			nrst = ::poll(&tmppollfd, 1, timeoutms);
+		} while ((nrst < 0) && (errno == EINTR));
+		if (nrst < 0)
+			return -errno;
+		if (nrst == 0)
+		{
+			errno = EAGAIN;
+			return -EAGAIN;
+		}
+		return 1;
+	}
+
+	int ClientContext::getPendingOutput()
+	{
+		int value = 0;
+		int queued = getQueuedOutput();
+
+		if (::ioctl(m_sockfd, SIOCOUTQ, &value) < 0)
+			return -errno;
+		return (value > INT_MAX - queued) ? INT_MAX : value + queued;
+	}
+
+	int ClientContext::writeNonBlocking(const struct iovec *piov, int iovcnt, int msgflags)
+	{
+		int nrst;
+		int neno;
+
+		if (m_sslstate == 2)
+		{
+#ifdef USE_OPENSSL
+			// SSL_write() has no MSG_DONTWAIT, so a blocking socket is switched for the call
+			int sslerr;
+			int fileflags = ::fcntl(m_sockfd, F_GETFL, 0);
+			bool bblocking = (fileflags >= 0) && !(fileflags & O_NONBLOCK);
+			if (bblocking)
+				::fcntl(m_sockfd, F_SETFL, fileflags | O_NONBLOCK);
+			// SSL_get_error() would report an error left by another connection on this thread
+			ERR_clear_error();
+			nrst = SSL_write(m_ssl, piov[0].iov_base, (int)piov[0].iov_len);
+			neno = errno;
+			if (nrst <= 0)
+			{
+				sslerr = SSL_get_error(m_ssl, nrst);
+				if ((sslerr == SSL_ERROR_WANT_WRITE) || (sslerr == SSL_ERROR_WANT_READ))
+					nrst = 0;
+				else
+					nrst = (neno != 0) ? -neno : -EPIPE;
+			}
+			if (bblocking)
+				::fcntl(m_sockfd, F_SETFL, fileflags);
+			return nrst;
+#else
+			return -ENOTSUP;
+#endif
+		}
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec*)piov;
+		msg.msg_iovlen = iovcnt;
+		do {
+			nrst = ::sendmsg(m_sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | msgflags);
+			neno = errno;
+		} while ((nrst < 0) && (neno == EINTR));
+		if (nrst < 0)
+			return ((neno == EAGAIN) || (neno == EWOULDBLOCK)) ? 0 : -neno;
+		return nrst;
+	}
+
+	int ClientContext::writeFileNonBlocking(int fd, off_t offset, size_t count)
+	{
+		ssize_t nrst;
+		int neno;
+
+		// sendfile() has no MSG_DONTWAIT, so a blocking socket is switched for the call
+		int fileflags = ::fcntl(m_sockfd, F_GETFL, 0);
+		bool bblocking = (fileflags >= 0) && !(fileflags & O_NONBLOCK);
+		if (bblocking)
+			::fcntl(m_sockfd, F_SETFL, fileflags | O_NONBLOCK);
+		do {
+			nrst = ::sendfile(m_sockfd, fd, &offset, count);
+			neno = errno;
+		} while ((nrst < 0) && (neno == EINTR));
+		if (bblocking)
+			::fcntl(m_sockfd, F_SETFL, fileflags);
+
+		if (nrst < 0)
+			return ((neno == EAGAIN) || (neno == EWOULDBLOCK)) ? 0 : -neno;
+		if ((nrst == 0) && (count > 0))
+			return -ENODATA;
+		return (int)nrst;
+	}
+
+	int ClientContext::sendAsync(const char *pbuf, int size)
+	{
+		int nrst;
+		int written = 0;
+		int limit = m_pServerCtx->m_options.outputQueueLimit;
+		struct iovec iov;
+
+		if (size <= 0)
+			return 0;
+		if ((limit > 0) && (getQueuedMemory() + size > limit))
+			return -ENOBUFS;
+
+		iov.iov_base = (void*)pbuf;
+		iov.iov_len = size;
+		if ((nrst = corkOutput(&iov, 1)) != 0)
+			return (nrst > 0) ? size : nrst;
+
+		// Behind queued bytes nothing may be written directly; nor before the TLS handshake is done
+		if (((m_poutq == NULL) || m_poutq->empty()) && (m_sslstate != 1))
+		{
+			nrst = writeNonBlocking(&iov, 1, 0);
+			if (nrst < 0)
+				return nrst;
+			written = nrst;
+			if (written == size)
+				return size;
+		}
+
+		// A TLS write that did not finish is retried with all of its bytes, from the queue
+		try
+		{
+			if (m_poutq == NULL)
+				m_poutq = new OutputQueue();
+			m_poutq->append(&pbuf[written], size - written);
+		}catch (std::bad_alloc& ex){
+			return -ENOMEM;
+		}
+
+		if ((nrst = m_pServerCtx->clientArmOutput(this)) < 0)
+			return nrst;
+		return size;
+	}
+
+	int ClientContext::flushOutput()
+	{
+		struct iovec iov[FLUSH_IOV_MAX];
+		int iovcnt;
+		int nrst;
+		int retval = 1;
+		size_t total;
+		bool bexternal;
+		int filefd;
+		off_t fileoffset;
+		int i;
+
+		if (m_poutq == NULL)
+			return 1;
+		if (m_sslstate == 1)
+			return 0;
+
+		while (!m_poutq->empty())
+		{
+			if (m_poutq->getFile(&filefd, &fileoffset, &total))
+			{
+				if (m_sslstate == 2)
+				{
+					// TLS encrypts in user memory: a chunk of the file is read in front of it
+					if ((nrst = m_poutq->readFile(OutputQueue::CHUNK_SIZE)) < 0)
+						return nrst;
+					continue;
+				}
+				if (total > SENDFILE_MAX)
+					total = SENDFILE_MAX;
+				if ((nrst = writeFileNonBlocking(filefd, fileoffset, total)) < 0)
+					return nrst;
+				m_poutq->consume(nrst, false);
+				if ((size_t)nrst < total)
+				{
+					retval = 0;
+					break;
+				}
+				continue;
+			}
+
+			iovcnt = m_poutq->getIovecs(iov, (m_sslstate == 2) ? 1 : FLUSH_IOV_MAX, &bexternal);
+			for (i = 0, total = 0; i < iovcnt; i++)
+				total += iov[i].iov_len;
+			nrst = writeNonBlocking(iov, iovcnt, bexternal ? MSG_ZEROCOPY : 0);
+			if ((nrst == -ENOBUFS) && bexternal)
+			{
+				// Too many completions unread for the socket's optmem_max: copy this once
+				bexternal = false;
+				nrst = writeNonBlocking(iov, iovcnt, 0);
+			}
+			if (nrst < 0)
+				return nrst;
+			m_poutq->consume(nrst, bexternal && (nrst > 0));
+			if ((size_t)nrst < total)
+			{
+				retval = 0;
+				break;
+			}
+		}
+
+		if (m_poutq->hasZeroCopyInFlight())
+		{
+			// A ring does not report the error queue by itself; close() needs no poll
+			if (m_isUsable && !m_bzcpolled && ((nrst = m_pServerCtx->clientArmZeroCopy(this)) < 0))
+				return nrst;
+		}
+		else if ((retval == 1) && !m_poutq->usedZeroCopy())
+		{
+			// An idle connection keeps no queue
+			delete m_poutq;
+			m_poutq = NULL;
+		}
+		return retval;
+	}
+
+	int ClientContext::sendZeroCopy(const char *pbuf, int size, OutputReleaseHandler_t releasehandler, void *param)
+	{
+		int nrst;
+		int threshold = m_pServerCtx->m_options.zeroCopyThreshold;
+		int limit = m_pServerCtx->m_options.outputQueueLimit;
+		int optval = 1;
+
+		// Setting up the pinning and reading the completion costs more than copying a small
+		// buffer, and TLS encrypts into a buffer of its own anyway
+		if (!m_bzerocopy && (threshold > 0) && (size >= threshold) && (m_sslstate == 0))
+			m_bzerocopy = (::setsockopt(m_sockfd, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(optval)) == 0);
+		if (!m_bzerocopy || (threshold <= 0) || (size < threshold) || (m_sslstate != 0))
+		{
+			nrst = sendAsync(pbuf, size);
+			if (releasehandler != NULL)
+				releasehandler(pbuf, param);
+			return nrst;
+		}
+
+		if ((limit > 0) && (getQueuedMemory() + size > limit))
+		{
+			if (releasehandler != NULL)
+				releasehandler(pbuf, param);
+			return -ENOBUFS;
+		}
+		try
+		{
+			if (m_poutq == NULL)
+				m_poutq = new OutputQueue();
+			m_poutq->appendExternal(pbuf, size, releasehandler, param);
+		}catch (std::bad_alloc& ex){
+			if (releasehandler != NULL)
+				releasehandler(pbuf, param);
+			return -ENOMEM;
+		}
+
+		// From here on the queue releases the buffer. Corked, it goes out with the rest of the batch.
+		if ((nrst = corkOutput(NULL, 0)) != 0)
+			return (nrst > 0) ? size : nrst;
+		if ((nrst = flushOutput()) < 0)
+			return nrst;
+		if ((nrst == 0) && ((nrst = m_pServerCtx->clientArmOutput(this)) < 0))
+			return nrst;
+		return size;
+	}
+
+	int ClientContext::sendFile(int fd, off_t offset, size_t length)
+	{
+		int nrst;
+		int filefd;
+		size_t count;
+		bool bcorked;
+
+		if (length == 0)
+			return 1;
+		if ((nrst = corkOutput(NULL, 0)) < 0)
+			return nrst;
+		bcorked = (nrst > 0);
+
+		// Behind queued bytes nothing may be written directly; TLS always goes through the queue
+		if (!bcorked && ((m_poutq == NULL) || m_poutq->empty()) && (m_sslstate == 0))
+		{
+			while (length > 0)
+			{
+				count = (length > SENDFILE_MAX) ? (size_t)SENDFILE_MAX : length;
+				if ((nrst = writeFileNonBlocking(fd, offset, count)) < 0)
+					return nrst;
+				offset += nrst;
+				length -= nrst;
+				if ((size_t)nrst < count)
+					break;
+			}
+			if (length == 0)
+				return 1;
+		}
+
+		// The queue keeps a descriptor of its own
+		if ((filefd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+			return -errno;
+		try
+		{
+			if (m_poutq == NULL)
+				m_poutq = new OutputQueue();
+			m_poutq->appendFile(filefd, offset, length);
+		}catch (std::bad_alloc& ex){
+			::close(filefd);
+			return -ENOMEM;
+		}
+
+		if (bcorked)
+			return 1;
+		if ((nrst = flushOutput()) < 0)
+			return nrst;
+		if ((nrst == 0) && ((nrst = m_pServerCtx->clientArmOutput(this)) < 0))
+			return nrst;
+		return 1;
+	}
+
+	int ClientContext::reapZeroCopy()
+	{
+		return reapZeroCopy(m_sockfd, m_poutq);
+	}
+
+	int ClientContext::reapZeroCopy(int sockfd, OutputQueue *poutq)
+	{
+		char control[256];
+		struct msghdr msg;
+		struct cmsghdr *pcmsg;
+		struct sock_extended_err *pserr;
+		int count = 0;
+		int nrst;
+
+		for (;;)
+		{
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			nrst = ::recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+			if (nrst < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					break;
+				return -errno;
+			}
+
+			for (pcmsg = CMSG_FIRSTHDR(&msg); pcmsg != NULL; pcmsg = CMSG_NXTHDR(&msg, pcmsg))
+			{
+				if (!(((pcmsg->cmsg_level == SOL_IP) && (pcmsg->cmsg_type == IP_RECVERR)) ||
+					((pcmsg->cmsg_level == SOL_IPV6) && (pcmsg->cmsg_type == IPV6_RECVERR))))
+					continue;
+				pserr = (struct sock_extended_err*)CMSG_DATA(pcmsg);
+				if (pserr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+					continue;
+				// ee_info to ee_data: a range of sends, numbered per socket from 0
+				if (poutq != NULL)
+					poutq->completeZeroCopy(pserr->ee_info, pserr->ee_data);
+				count++;
+			}
+		}
+
+		return count;
+	}
+
+	int ClientContext::corkOutput(const struct iovec *piov, int iovcnt)
+	{
+		ServerContext::WorkerThreadInternalContext *pworker = ServerContext::s_pcurrentworker;
+		size_t total = 0;
+		int limit = m_pServerCtx->m_options.outputQueueLimit;
+		int nrst;
+		int i;
+
+		// Only a worker flushes when its batch is done, and the handshake has to finish first
+		if (!m_pServerCtx->m_options.bCorkSends || (pworker == NULL) || (pworker->pServerCtx != m_pServerCtx) || (m_sslstate == 1))
+			return 0;
+
+		for (i = 0; i < iovcnt; i++)
+			total += piov[i].iov_len;
+		if ((limit > 0) && (getQueuedMemory() + total > (size_t)limit))
+		{
+			// Too much to hold: what is corked goes out first, then the caller writes the rest itself
+			while ((nrst = flushOutput()) == 0)
+			{
+				if ((nrst = waitWritable()) <= 0)
+					return (nrst < 0) ? nrst : -EAGAIN;
+			}
+			return (nrst < 0) ? nrst : 0;
+		}
+
+		try
+		{
+			if (m_poutq == NULL)
+				m_poutq = new OutputQueue();
+			for (i = 0; i < iovcnt; i++)
+				m_poutq->append((const char*)piov[i].iov_base, piov[i].iov_len);
+			if (!m_bcorked)
+			{
+				pworker->corkedclients.push_back(m_index);
+				m_bcorked = true;
+			}
+		}catch (std::bad_alloc& ex){
+			return -ENOMEM;
+		}
+
+		return 1;
+	}
+
+	int ClientContext::getQueuedOutput()
+	{
+		size_t queued = (m_poutq != NULL) ? m_poutq->size() : 0;
+		// A queued file may be larger than an int
+		return (queued > INT_MAX) ? INT_MAX : (int)queued;
+	}
+
+	int ClientContext::getQueuedMemory()
+	{
+		return (m_poutq != NULL) ? (int)m_poutq->memorySize() : 0;
+	}
+
 	int ClientContext::close()
 	{	
+		// Output corked by the handler that is closing the connection gets one last try.
+		// Not usable from here on, so the flush leaves no poll behind on the ring.
+		m_isUsable = false;
+		if ((m_poutq != NULL) && !m_bexported)
+			flushOutput();
 #ifdef USE_OPENSSL
 		if (m_pServerCtx->getUseSSL())
 		{
@@ -245,10 +849,33 @@ namespace JsServerSocket {
 			m_ssl = NULL;
 		}
 #endif
-		::shutdown(m_sockfd, SHUT_RDWR);
-		::closesocket(m_sockfd);
+		// An exported socket lives on in the other process
+		if (!m_bexported)
+			::shutdown(m_sockfd, SHUT_RDWR);
+		// Whatever was still queued is lost with the connection. Buffers sent in place may still be
+		// read by the kernel, which reports them done in this socket's error queue only: the loop
+		// takes the socket and the queue over until then.
+		if ((m_poutq != NULL) && !m_bexported)
+		{
+			m_poutq->discardUnsent();
+			reapZeroCopy();
+			if (m_poutq->hasZeroCopyInFlight() && (m_pServerCtx->lingerZeroCopy(this) > 0))
+			{
+				m_sockfd = INVALID_SOCKET;
+				m_poutq = NULL;
+			}
+		}
+		if (m_sockfd != INVALID_SOCKET)
+			::closesocket(m_sockfd);
 		m_sockfd = INVALID_SOCKET;
-		m_isUsable = false;
+		if (m_poutq != NULL)
+		{
+			delete m_poutq;
+			m_poutq = NULL;
+		}
+		m_boutarmed = false;
+		m_bcorked = false;
+		m_bzcpolled = false;
 		return 1;
 	}
 	
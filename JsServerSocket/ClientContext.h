@@ -20,6 +20,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #ifdef USE_OPENSSL
 #include <openssl/ssl.h>
@@ -29,31 +30,56 @@
 #include "../JsCPPUtils/Common.h"
 #include "../JsCPPUtils/LockableEx.h"
 
+#include "TimerWheel.h"
+#include "OutputQueue.h"
+
 namespace JsServerSocket
 {
 	class ServerContext;
+	struct ClientTimer;
+	/**
+	 * One connection. An idle plaintext connection costs 216 bytes of user memory on x86-64
+	 * Linux: this object (136 with USE_OPENSSL, a 144-byte malloc chunk), the SmartPointer
+	 * root that owns it (24, a 32-byte chunk) and its slot in the client registry (40).
+	 * "rss N" in the test project measures it, registry growth included: 222 at N = 19000.
+	 * Members are ordered by size so that none is padded; keep it so when adding one.
+	 */
 	class ClientContext : public JsCPPUtils::LockableEx
 	{
 	friend class ServerContext;
 
 	public:
-		bool m_isUsable;
-		
-		bool m_freed;
+		enum {
+			FLUSH_IOV_MAX = 64, // queued buffers handed to one sendmsg(), and sendv() buffers per call
+			SENDV_TLS_GATHER = 4096, // sendv() over TLS copies buffers up to this size into one record
+			SENDFILE_MAX = 0x40000000 // bytes asked of one sendfile(); the kernel stops short of 2 GiB anyway
+		};
+
+		int m_sockfd; // packs with the 12-byte lock in front of it
 
 		ServerContext *m_pServerCtx;
-		int m_index;
-		int m_sockfd;
-		struct sockaddr_in m_addr;
 		void *m_userptr;
-
-		int64_t m_last_recvedtime;
-		
-		int m_sslstate;
+		ClientTimer *m_ptimers; // scheduled by ServerContext::timerSchedule, guarded by the loop's timerlock
+		OutputQueue *m_poutq; // what sendAsync() could not write yet; NULL while nothing is queued
 #ifdef USE_OPENSSL
 		SSL *m_ssl;
 #endif
 
+		int64_t m_last_recvedtime;
+		TimerWheelNode m_idlenode; // in its loop's idle wheel while idleTimeoutMs is set
+		struct sockaddr_in m_addr;
+
+		int m_index;
+		int m_loopidx;
+		int m_sslstate;
+		bool m_isUsable;
+		bool m_freed;
+		bool m_bexported; // passed to another process by ServerContext::exportSockets, closed without shutdown()
+		bool m_boutarmed; // the loop waits for the socket to become writable: EPOLLOUT, or a poll on the ring
+		bool m_bcorked; // Options::bCorkSends: queued output a worker writes when its batch is done
+		bool m_bzerocopy; // SO_ZEROCOPY is set on the socket
+		bool m_bzcpolled; // BACKEND_IO_URING: a poll waits for MSG_ZEROCOPY completions in the error queue
+
 	public:
 		ClientContext(ServerContext *pServerContext, int index, int clientsock, struct sockaddr_in *client_paddr, void *userptr);
 		~ClientContext();
@@ -62,11 +88,50 @@ namespace JsServerSocket
 		bool isUsable();
 		int lockandcheck();
 		
+		// recv() and send() block, except with ServerContext::Options::bEdgeTriggered or
+		// BACKEND_IO_URING, whose sockets are non-blocking: then -1 with errno EAGAIN when
+		// nothing can be read or written now. recvfixedsize(), sendfixedsize() and sendv() wait
+		// either way; sendAsync() never does.
 		int recv(char *pbuf, int size, JSCUTILS_TYPE_FLAG flags);
+		// With ServerContext::Options::bCorkSends, send(), sendv() and sendAsync() on a worker
+		// thread only queue; the worker writes the queue when its batch of events is done.
 		int send(char *pbuf, int size, JSCUTILS_TYPE_FLAG flags);
 		int recvfixedsize(char *pbuf, int size, JSCUTILS_TYPE_FLAG flags, struct timeval *ptvtimeout);
 		int sendfixedsize(char *pbuf, int size, JSCUTILS_TYPE_FLAG flags);
+		// Writes all the buffers, in as few sendmsg() calls as the socket allows, as
+		// sendfixedsize() would write them joined. Not to be mixed with sendAsync() either.
+		// 1: all written, 0: TLS handshake not done, <0: error
+		int sendv(const struct iovec *piov, int iovcnt);
 		int close();
+		int waitWritable();
+		// Bytes written but not yet acknowledged by the peer, and those still queued by sendAsync()
+		int getPendingOutput();
+
+		// Never blocks: writes what the socket takes now and queues the rest, which the client's
+		// event loop writes once the socket is writable again. Called with the client locked;
+		// not to be mixed with send() while anything is queued.
+		// Returns size, or a negative errno after which the connection should be closed:
+		// -ENOBUFS when the queue would grow beyond ServerContext::Options::outputQueueLimit.
+		int sendAsync(const char *pbuf, int size);
+		// Writes as much of the queue as the socket takes without blocking.
+		// 1: nothing left, 0: the rest waits for the socket, <0: error
+		int flushOutput();
+		int getQueuedOutput();
+		// Like sendAsync(), but from size ServerContext::Options::zeroCopyThreshold on, plaintext
+		// only, the buffer is sent in place with MSG_ZEROCOPY instead of being copied.
+		// releasehandler(pbuf, param) is called exactly once, when neither the queue nor the kernel
+		// needs the buffer any more: right away for a copied one, otherwise from the worker that
+		// reads the completion. Also when sending fails, and on close() for a part never sent.
+		// A closed connection whose buffers the kernel still holds keeps its socket open until
+		// their completions come in; only ServerContext::close() aborts it and waits a moment.
+		int sendZeroCopy(const char *pbuf, int size, OutputReleaseHandler_t releasehandler, void *param);
+		// Queues length bytes of the file fd from offset behind what sendAsync() queued, without
+		// reading them into user memory: plaintext is written with sendfile(). TLS reads one
+		// OutputQueue::CHUNK_SIZE at a time, as the socket takes it. fd is duplicated, so the
+		// caller may close it right away; the range must stay in the file until it is sent.
+		// Like SSL_write(), sendfile() raises SIGPIPE on a reset connection unless it is ignored.
+		// Returns 1, or a negative errno after which the connection should be closed.
+		int sendFile(int fd, off_t offset, size_t length);
 		
 		void setUserPtr(void *userptr);
 		void *getUserPtr();
@@ -74,6 +139,23 @@ namespace JsServerSocket
 #ifdef USE_OPENSSL
 		SSL *getSSL();
 #endif
+
+	private:
+		// Back to the state of a new client, for a context taken from a worker's pool
+		void reset(int index, int clientsock, struct sockaddr_in *client_paddr, void *userptr);
+		// Bytes written, 0 if the socket is full, or a negative errno. TLS writes the first buffer only.
+		int writeNonBlocking(const struct iovec *piov, int iovcnt, int msgflags);
+		// Same for up to SENDFILE_MAX bytes of a file; -ENODATA if the file ends before them
+		int writeFileNonBlocking(int fd, off_t offset, size_t count);
+		int sendvTls(const struct iovec *piov, int iovcnt);
+		// Options::bCorkSends: 1 if queued for the worker's batch end, 0 if the caller writes it now
+		int corkOutput(const struct iovec *piov, int iovcnt);
+		// What Options::outputQueueLimit applies to: the queue without its file ranges
+		int getQueuedMemory();
+		// Reads MSG_ZEROCOPY completions from the error queue; returns how many
+		int reapZeroCopy();
+		// Same for a socket no client owns any more: its loop's, after close()
+		static int reapZeroCopy(int sockfd, OutputQueue *poutq);
 	};
 }
 
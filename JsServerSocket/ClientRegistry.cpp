@@ -0,0 +1,175 @@
+/**
+ * @file	JsServerSocket/ClientRegistry.cpp
+ * @class	ClientRegistry
+ * @brief	ClientRegistry
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include <new>
+
+#include "ClientRegistry.h"
+#include "ClientContext.h"
+
+namespace JsServerSocket
+{
+	ClientRegistry::ClientRegistry() :
+		m_shards(NULL),
+		m_numOfShards(0),
+		m_shardbits(0)
+	{
+	}
+
+	ClientRegistry::~ClientRegistry()
+	{
+		close();
+	}
+
+	int ClientRegistry::init(int numOfShards)
+	{
+		int shardbits = 0;
+		int i;
+
+		close();
+
+		if (numOfShards <= 0)
+			numOfShards = 1;
+		while (((1 << shardbits) < numOfShards) && (shardbits < 12))
+			shardbits++;
+
+		try
+		{
+			m_shards = new Shard[1 << shardbits];
+		}catch (std::bad_alloc& ex){
+			return -ENOMEM;
+		}
+		m_shardbits = shardbits;
+		m_numOfShards = 1 << shardbits;
+		for (i = 0; i < m_numOfShards; i++)
+			m_shards[i].table.setShard(i, shardbits);
+
+		return 1;
+	}
+
+	void ClientRegistry::close()
+	{
+		if (m_shards != NULL)
+		{
+			delete[] m_shards;
+			m_shards = NULL;
+		}
+		m_numOfShards = 0;
+		m_shardbits = 0;
+	}
+
+	int ClientRegistry::reserve(int shardhint)
+	{
+		int clientidx = -1;
+		int i;
+
+		for (i = 0; (i < m_numOfShards) && (clientidx < 0); i++)
+		{
+			Shard *pshard = &m_shards[(shardhint + i) & (m_numOfShards - 1)];
+			pshard->lock.lock();
+			try
+			{
+				clientidx = pshard->table.reserve();
+			}catch (std::bad_alloc& ex){
+				pshard->lock.unlock();
+				throw;
+			}
+			pshard->lock.unlock();
+		}
+
+		return clientidx;
+	}
+
+	void ClientRegistry::set(int clientidx, const JsCPPUtils::SmartPointer<ClientContext> &spclientctx)
+	{
+		Shard *pshard = &m_shards[getShardOf(clientidx)];
+		pshard->lock.lock();
+		pshard->table.set(clientidx, spclientctx);
+		pshard->lock.unlock();
+	}
+
+	bool ClientRegistry::remove(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx)
+	{
+		Shard *pshard;
+		bool bfound;
+
+		if ((clientidx < 0) || (m_shards == NULL))
+			return false;
+		pshard = &m_shards[getShardOf(clientidx)];
+		pshard->lock.lock();
+		bfound = pshard->table.remove(clientidx, pout_spclientctx);
+		pshard->lock.unlock();
+
+		return bfound;
+	}
+
+	bool ClientRegistry::find(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx)
+	{
+		Shard *pshard;
+		bool bfound;
+
+		if ((clientidx < 0) || (m_shards == NULL))
+			return false;
+		pshard = &m_shards[getShardOf(clientidx)];
+		pshard->lock.lock();
+		bfound = pshard->table.find(clientidx, pout_spclientctx);
+		pshard->lock.unlock();
+
+		return bfound;
+	}
+
+	int ClientRegistry::size()
+	{
+		int count = 0;
+		int i;
+
+		for (i = 0; i < m_numOfShards; i++)
+		{
+			m_shards[i].lock.lock();
+			count += m_shards[i].table.size();
+			m_shards[i].lock.unlock();
+		}
+
+		return count;
+	}
+
+	int ClientRegistry::getNumOfShards() const
+	{
+		return m_numOfShards;
+	}
+
+	int ClientRegistry::getShardClients(int shardidx, std::vector< JsCPPUtils::SmartPointer<ClientContext> > *plist)
+	{
+		Shard *pshard;
+		int entry;
+
+		if ((shardidx < 0) || (shardidx >= m_numOfShards))
+			return -EINVAL;
+
+		pshard = &m_shards[shardidx];
+		pshard->lock.lock();
+		try
+		{
+			plist->reserve(plist->size() + pshard->table.size());
+			for (entry = 0; entry < pshard->table.getSlotCount(); entry++)
+			{
+				JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+				if (pshard->table.getSlot(entry, &spclientctx))
+					plist->push_back(spclientctx);
+			}
+		}catch (std::bad_alloc& ex){
+			pshard->lock.unlock();
+			return -ENOMEM;
+		}
+		pshard->lock.unlock();
+
+		return (int)plist->size();
+	}
+}
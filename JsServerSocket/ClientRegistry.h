@@ -0,0 +1,76 @@
+/**
+ * @file	JsServerSocket/ClientRegistry.h
+ * @class	ClientRegistry
+ * @brief	Lock-striped registry of connected clients
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+#pragma once
+#endif
+
+#ifndef __JSSERVERSOCKET_CLIENTREGISTRY_H__
+#define __JSSERVERSOCKET_CLIENTREGISTRY_H__
+
+#include <vector>
+
+#include "../JsCPPUtils/Common.h"
+#include "../JsCPPUtils/SmartPointer.h"
+#include "../JsCPPUtils/Lockable.h"
+
+#include "ClientTable.h"
+
+namespace JsServerSocket
+{
+	class ClientContext;
+
+	/**
+	 * The clients are split over a power-of-two number of ClientTable shards, each with
+	 * its own lock. The low bits of a client's slot name its shard, so a lookup or delete
+	 * by index takes only that shard's lock.
+	 */
+	class ClientRegistry
+	{
+	private:
+		struct Shard {
+			JsCPPUtils::Lockable lock;
+			ClientTable table;
+			char pad[64]; // keeps neighbouring locks off the same cache line
+		};
+
+		Shard *m_shards;
+		int m_numOfShards;
+		int m_shardbits;
+
+		ClientRegistry(const ClientRegistry&);
+		ClientRegistry& operator=(const ClientRegistry&);
+
+	public:
+		ClientRegistry();
+		~ClientRegistry();
+
+		// numOfShards is rounded up to a power of two
+		int init(int numOfShards);
+		void close();
+
+		// Returns the index for a new client, or -1 when the registry is full. std::bad_alloc
+		// shardhint picks the preferred shard, other shards are tried when it is full.
+		int reserve(int shardhint);
+		void set(int clientidx, const JsCPPUtils::SmartPointer<ClientContext> &spclientctx);
+		bool remove(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx);
+		bool find(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx);
+		int size();
+
+		int getNumOfShards() const;
+		// Copies the clients of one shard, holding only that shard's lock
+		int getShardClients(int shardidx, std::vector< JsCPPUtils::SmartPointer<ClientContext> > *plist);
+
+		int getShardOf(int clientidx) const
+		{
+			return ClientTable::getSlotOf(clientidx) & (m_numOfShards - 1);
+		}
+	};
+}
+
+#endif /* __JSSERVERSOCKET_CLIENTREGISTRY_H__ */
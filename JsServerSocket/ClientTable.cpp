@@ -0,0 +1,145 @@
+/**
+ * @file	JsServerSocket/ClientTable.cpp
+ * @class	ClientTable
+ * @brief	ClientTable
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+
+#include "ClientTable.h"
+#include "ClientContext.h"
+
+namespace JsServerSocket
+{
+	ClientTable::ClientTable() :
+		m_freehead(-1),
+		m_freetail(-1),
+		m_numoffree(0),
+		m_count(0),
+		m_shardidx(0),
+		m_shardbits(0)
+	{
+	}
+
+	ClientTable::~ClientTable()
+	{
+	}
+
+	void ClientTable::setShard(int shardidx, int shardbits)
+	{
+		m_shardidx = shardidx;
+		m_shardbits = shardbits;
+	}
+
+	int ClientTable::reserve()
+	{
+		int entry;
+		int slot;
+		Slot *pslot;
+
+		// The table grows rather than reuse a slot released only a few releases ago
+		if ((m_numoffree > FREE_QUEUE_MIN) || ((m_numoffree > 0) && ((int)m_slots.size() >= (MAX_SLOTS >> m_shardbits))))
+		{
+			entry = m_freehead;
+			pslot = &m_slots[entry];
+			m_freehead = pslot->nextfree;
+			if (m_freehead < 0)
+				m_freetail = -1;
+			m_numoffree--;
+		}
+		else
+		{
+			if ((int)m_slots.size() >= (MAX_SLOTS >> m_shardbits))
+				return -1;
+			entry = (int)m_slots.size();
+			m_slots.resize(m_slots.size() + 1);
+			pslot = &m_slots[entry];
+			pslot->generation = 1;
+		}
+		slot = (entry << m_shardbits) | m_shardidx;
+
+		pslot->nextfree = -1;
+		pslot->inuse = true;
+		pslot->bset = false;
+		m_count++;
+
+		return (pslot->generation << SLOT_BITS) | slot;
+	}
+
+	void ClientTable::set(int clientidx, const JsCPPUtils::SmartPointer<ClientContext> &spclientctx)
+	{
+		Slot *pslot = &m_slots[getSlotOf(clientidx) >> m_shardbits];
+		pslot->spclientctx = spclientctx;
+		pslot->bset = true;
+	}
+
+	bool ClientTable::remove(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx)
+	{
+		int slot = getSlotOf(clientidx);
+		int entry = slot >> m_shardbits;
+		Slot *pslot;
+
+		if ((clientidx < 0) || (entry >= (int)m_slots.size()))
+			return false;
+		pslot = &m_slots[entry];
+		if (!pslot->inuse || (((pslot->generation << SLOT_BITS) | slot) != clientidx))
+			return false;
+
+		if (pout_spclientctx != NULL && pslot->bset)
+			*pout_spclientctx = pslot->spclientctx;
+		pslot->spclientctx = JsCPPUtils::SmartPointer<ClientContext>();
+		pslot->inuse = false;
+		pslot->bset = false;
+		// Generation 0 is skipped so that no index is ever 0
+		pslot->generation = (pslot->generation + 1) & GENERATION_MASK;
+		if (pslot->generation == 0)
+			pslot->generation = 1;
+		pslot->nextfree = -1;
+		if (m_freetail >= 0)
+			m_slots[m_freetail].nextfree = entry;
+		else
+			m_freehead = entry;
+		m_freetail = entry;
+		m_numoffree++;
+		m_count--;
+
+		return true;
+	}
+
+	bool ClientTable::find(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx) const
+	{
+		int slot = getSlotOf(clientidx);
+		int entry = slot >> m_shardbits;
+		const Slot *pslot;
+
+		if ((clientidx < 0) || (entry >= (int)m_slots.size()))
+			return false;
+		pslot = &m_slots[entry];
+		if (!pslot->bset || (((pslot->generation << SLOT_BITS) | slot) != clientidx))
+			return false;
+
+		if (pout_spclientctx != NULL)
+			*pout_spclientctx = pslot->spclientctx;
+		return true;
+	}
+
+	int ClientTable::size() const
+	{
+		return m_count;
+	}
+
+	int ClientTable::getSlotCount() const
+	{
+		return (int)m_slots.size();
+	}
+
+	bool ClientTable::getSlot(int entry, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx) const
+	{
+		if ((entry < 0) || (entry >= (int)m_slots.size()) || !m_slots[entry].bset)
+			return false;
+		*pout_spclientctx = m_slots[entry].spclientctx;
+		return true;
+	}
+}
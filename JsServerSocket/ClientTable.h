@@ -0,0 +1,89 @@
+/**
+ * @file	JsServerSocket/ClientTable.h
+ * @class	ClientTable
+ * @brief	Slot-indexed table of connected clients
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+#pragma once
+#endif
+
+#ifndef __JSSERVERSOCKET_CLIENTTABLE_H__
+#define __JSSERVERSOCKET_CLIENTTABLE_H__
+
+#include <vector>
+
+#include "../JsCPPUtils/Common.h"
+#include "../JsCPPUtils/SmartPointer.h"
+
+namespace JsServerSocket
+{
+	class ClientContext;
+
+	/**
+	 * A client index is (generation << SLOT_BITS) | slot. The generation changes every
+	 * time a slot is released, so an index kept after its client was deleted does not
+	 * find the next client put into the same slot. Released slots are reused in the order
+	 * they were released, and only while FREE_QUEUE_MIN others wait behind them, so an
+	 * index comes back only after some GENERATION_MASK * FREE_QUEUE_MIN releases.
+	 * As one shard of a ClientRegistry, the table only hands out the slots whose low
+	 * shard bits equal its shard index.
+	 * Not thread-safe: the owner locks around every call.
+	 */
+	class ClientTable
+	{
+	public:
+		enum {
+			SLOT_BITS = 22,
+			MAX_SLOTS = (1 << SLOT_BITS),
+			GENERATION_MASK = ((1 << (31 - SLOT_BITS)) - 1),
+			FREE_QUEUE_MIN = 1024
+		};
+
+	private:
+		struct Slot {
+			JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+			int generation;
+			int nextfree;
+			bool inuse;
+			bool bset;
+		};
+
+		std::vector<Slot> m_slots; // m_slots[n] is slot (n << m_shardbits) | m_shardidx
+		int m_freehead; // released slots, oldest first
+		int m_freetail;
+		int m_numoffree;
+		int m_count;
+		int m_shardidx;
+		int m_shardbits;
+
+	public:
+		ClientTable();
+		~ClientTable();
+
+		// Before the first reserve()
+		void setShard(int shardidx, int shardbits);
+
+		// Returns the index for a new client, or -1 when the table is full. std::bad_alloc
+		int reserve();
+		// Fills a reserved slot
+		void set(int clientidx, const JsCPPUtils::SmartPointer<ClientContext> &spclientctx);
+		// Releases the slot, reserved or set
+		bool remove(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx);
+		bool find(int clientidx, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx) const;
+		int size() const;
+
+		// For walking the table: entries 0 .. getSlotCount()-1, each possibly empty
+		int getSlotCount() const;
+		bool getSlot(int entry, JsCPPUtils::SmartPointer<ClientContext> *pout_spclientctx) const;
+
+		static int getSlotOf(int clientidx)
+		{
+			return clientidx & (MAX_SLOTS - 1);
+		}
+	};
+}
+
+#endif /* __JSSERVERSOCKET_CLIENTTABLE_H__ */
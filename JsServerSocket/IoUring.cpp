@@ -0,0 +1,374 @@
+/**
+ * @file	JsServerSocket/IoUring.cpp
+ * @class	IoUring
+ * @brief	IoUring
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "IoUring.h"
+#include "macros.h"
+
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+
+namespace JsServerSocket
+{
+	static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+	{
+		return (int)syscall(__NR_io_uring_setup, entries, p);
+	}
+
+	static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+	}
+
+	static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+	{
+		return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+	}
+
+	IoUring::IoUring() :
+		m_ring_fd(INVALID_FD),
+		m_sq_ptr(MAP_FAILED),
+		m_sq_size(0),
+		m_cq_ptr(MAP_FAILED),
+		m_cq_size(0),
+		m_sqes((struct io_uring_sqe*)MAP_FAILED),
+		m_sqes_size(0),
+		m_sq_head(NULL),
+		m_sq_tail(NULL),
+		m_sq_mask(0),
+		m_sq_array(NULL),
+		m_sq_localtail(0),
+		m_sq_submitted(0),
+		m_cq_head(NULL),
+		m_cq_tail(NULL),
+		m_cq_mask(0),
+		m_cqes(NULL),
+		m_bufring((struct io_uring_buf_ring*)MAP_FAILED),
+		m_bufring_size(0),
+		m_bufring_mask(0),
+		m_bufring_tail(0),
+		m_bufgroup(0),
+		m_bufs(NULL),
+		m_bufsize(0)
+	{
+	}
+
+	IoUring::~IoUring()
+	{
+		close();
+	}
+
+	int IoUring::init(unsigned int entries)
+	{
+		int retval = 0;
+		struct io_uring_params params;
+		char *psq;
+		char *pcq;
+
+		do {
+			memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+			m_ring_fd = sys_io_uring_setup(entries, &params);
+			if ((m_ring_fd < 0) && (errno == EINVAL))
+			{
+				// Kernels before 5.19 reject the newer setup flags
+				memset(&params, 0, sizeof(params));
+				params.flags = IORING_SETUP_CLAMP;
+				m_ring_fd = sys_io_uring_setup(entries, &params);
+			}
+			if (m_ring_fd < 0)
+			{
+				m_ring_fd = INVALID_FD;
+				retval = -errno;
+				break;
+			}
+
+			m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+			m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+			{
+				if (m_cq_size > m_sq_size)
+					m_sq_size = m_cq_size;
+				m_cq_size = m_sq_size;
+			}
+
+			m_sq_ptr = mmap(NULL, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+			if (m_sq_ptr == MAP_FAILED)
+			{
+				retval = -errno;
+				break;
+			}
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+			{
+				m_cq_ptr = m_sq_ptr;
+			}
+			else
+			{
+				m_cq_ptr = mmap(NULL, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+				if (m_cq_ptr == MAP_FAILED)
+				{
+					retval = -errno;
+					break;
+				}
+			}
+
+			m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+			m_sqes = (struct io_uring_sqe*)mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+			if (m_sqes == MAP_FAILED)
+			{
+				retval = -errno;
+				break;
+			}
+
+			psq = (char*)m_sq_ptr;
+			m_sq_head = (unsigned int*)(psq + params.sq_off.head);
+			m_sq_tail = (unsigned int*)(psq + params.sq_off.tail);
+			m_sq_mask = *(unsigned int*)(psq + params.sq_off.ring_mask);
+			m_sq_array = (unsigned int*)(psq + params.sq_off.array);
+			m_sq_localtail = *m_sq_tail;
+			m_sq_submitted = m_sq_localtail;
+
+			pcq = (char*)m_cq_ptr;
+			m_cq_head = (unsigned int*)(pcq + params.cq_off.head);
+			m_cq_tail = (unsigned int*)(pcq + params.cq_off.tail);
+			m_cq_mask = *(unsigned int*)(pcq + params.cq_off.ring_mask);
+			m_cqes = (struct io_uring_cqe*)(pcq + params.cq_off.cqes);
+
+			retval = 1;
+		} while (0);
+
+		if (retval <= 0)
+			close();
+
+		return retval;
+	}
+
+	int IoUring::initBufferRing(unsigned short bgid, unsigned int count, unsigned int bufsize)
+	{
+		struct io_uring_buf_reg reg;
+		unsigned int realcount = 1;
+		unsigned int i;
+
+		// The kernel wants a power of two, at most 32768 entries
+		while ((realcount < count) && (realcount < 32768))
+			realcount <<= 1;
+
+		m_bufring_size = realcount * sizeof(struct io_uring_buf);
+		m_bufring = (struct io_uring_buf_ring*)mmap(NULL, m_bufring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m_bufring == MAP_FAILED)
+			return -errno;
+
+		m_bufs = (char*)malloc((size_t)realcount * bufsize);
+		if (m_bufs == NULL)
+			return -ENOMEM;
+
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)(uintptr_t)m_bufring;
+		reg.ring_entries = realcount;
+		reg.bgid = bgid;
+		if (sys_io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+			return -errno;
+
+		m_bufring_mask = realcount - 1;
+		m_bufring_tail = 0;
+		m_bufgroup = bgid;
+		m_bufsize = bufsize;
+		for (i = 0; i < realcount; i++)
+			addBuffer((unsigned short)i);
+		__atomic_store_n(&m_bufring->tail, m_bufring_tail, __ATOMIC_RELEASE);
+
+		return 1;
+	}
+
+	void IoUring::close()
+	{
+		// Closing the ring cancels whatever is still in flight
+		if (m_ring_fd != INVALID_FD)
+		{
+			::close(m_ring_fd);
+			m_ring_fd = INVALID_FD;
+		}
+		if (m_sqes != MAP_FAILED)
+		{
+			munmap(m_sqes, m_sqes_size);
+			m_sqes = (struct io_uring_sqe*)MAP_FAILED;
+		}
+		if ((m_cq_ptr != MAP_FAILED) && (m_cq_ptr != m_sq_ptr))
+			munmap(m_cq_ptr, m_cq_size);
+		m_cq_ptr = MAP_FAILED;
+		if (m_sq_ptr != MAP_FAILED)
+		{
+			munmap(m_sq_ptr, m_sq_size);
+			m_sq_ptr = MAP_FAILED;
+		}
+		if (m_bufring != MAP_FAILED)
+		{
+			munmap(m_bufring, m_bufring_size);
+			m_bufring = (struct io_uring_buf_ring*)MAP_FAILED;
+		}
+		if (m_bufs != NULL)
+		{
+			free(m_bufs);
+			m_bufs = NULL;
+		}
+	}
+
+	struct io_uring_sqe *IoUring::getSqe()
+	{
+		struct io_uring_sqe *psqe;
+		unsigned int idx;
+
+		if ((m_sq_localtail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE)) > m_sq_mask)
+			return NULL;
+
+		idx = m_sq_localtail & m_sq_mask;
+		psqe = &m_sqes[idx];
+		m_sq_array[idx] = idx;
+		m_sq_localtail++;
+		memset(psqe, 0, sizeof(*psqe));
+		return psqe;
+	}
+
+	void IoUring::prepAccept(int fd, bool bMultishot, uint64_t userdata)
+	{
+		struct io_uring_sqe *psqe;
+		while ((psqe = getSqe()) == NULL)
+			submit();
+		psqe->opcode = IORING_OP_ACCEPT;
+		psqe->fd = fd;
+		psqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		if (bMultishot)
+			psqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		psqe->user_data = userdata;
+	}
+
+	void IoUring::prepRecv(int fd, bool bMultishot, uint64_t userdata)
+	{
+		struct io_uring_sqe *psqe;
+		while ((psqe = getSqe()) == NULL)
+			submit();
+		psqe->opcode = IORING_OP_RECV;
+		psqe->fd = fd;
+		psqe->flags = IOSQE_BUFFER_SELECT;
+		psqe->buf_group = m_bufgroup;
+		if (bMultishot)
+			psqe->ioprio = IORING_RECV_MULTISHOT;
+		psqe->user_data = userdata;
+	}
+
+	void IoUring::prepRead(int fd, void *pbuf, unsigned int len, uint64_t userdata)
+	{
+		struct io_uring_sqe *psqe;
+		while ((psqe = getSqe()) == NULL)
+			submit();
+		psqe->opcode = IORING_OP_READ;
+		psqe->fd = fd;
+		psqe->addr = (uint64_t)(uintptr_t)pbuf;
+		psqe->len = len;
+		psqe->off = (uint64_t)-1;
+		psqe->user_data = userdata;
+	}
+
+	void IoUring::prepPollAdd(int fd, unsigned int pollmask, uint64_t userdata)
+	{
+		struct io_uring_sqe *psqe;
+		while ((psqe = getSqe()) == NULL)
+			submit();
+		psqe->opcode = IORING_OP_POLL_ADD;
+		psqe->fd = fd;
+		psqe->poll32_events = pollmask;
+		psqe->user_data = userdata;
+	}
+
+	void IoUring::prepCancel(uint64_t targetdata, uint64_t userdata)
+	{
+		struct io_uring_sqe *psqe;
+		while ((psqe = getSqe()) == NULL)
+			submit();
+		psqe->opcode = IORING_OP_ASYNC_CANCEL;
+		psqe->fd = -1;
+		psqe->addr = targetdata;
+		psqe->user_data = userdata;
+	}
+
+	int IoUring::enter(unsigned int waitnr, bool bGetEvents)
+	{
+		unsigned int tosubmit = m_sq_localtail - m_sq_submitted;
+		int nrst;
+
+		if (m_bufring != MAP_FAILED)
+			__atomic_store_n(&m_bufring->tail, m_bufring_tail, __ATOMIC_RELEASE);
+		__atomic_store_n(m_sq_tail, m_sq_localtail, __ATOMIC_RELEASE);
+
+		if ((tosubmit == 0) && !bGetEvents)
+			return 0;
+
+		nrst = sys_io_uring_enter(m_ring_fd, tosubmit, waitnr, bGetEvents ? IORING_ENTER_GETEVENTS : 0);
+		if (nrst < 0)
+			return -errno;
+		m_sq_submitted += nrst;
+		return nrst;
+	}
+
+	int IoUring::submit()
+	{
+		return enter(0, false);
+	}
+
+	int IoUring::submitAndWait(unsigned int waitnr)
+	{
+		return enter(waitnr, true);
+	}
+
+	unsigned int IoUring::getCqHead()
+	{
+		return *m_cq_head;
+	}
+
+	struct io_uring_cqe *IoUring::peekCqe(unsigned int head)
+	{
+		if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+			return NULL;
+		return &m_cqes[head & m_cq_mask];
+	}
+
+	void IoUring::advanceCq(unsigned int head)
+	{
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	void IoUring::addBuffer(unsigned short bid)
+	{
+		// Not m_bufring->bufs: in C++ the header's empty placeholder struct shifts that member
+		struct io_uring_buf *pbuf = &((struct io_uring_buf*)m_bufring)[m_bufring_tail & m_bufring_mask];
+		pbuf->addr = (uint64_t)(uintptr_t)(m_bufs + (size_t)bid * m_bufsize);
+		pbuf->len = m_bufsize;
+		pbuf->bid = bid;
+		m_bufring_tail++;
+	}
+
+	char *IoUring::getBuffer(unsigned short bid)
+	{
+		return m_bufs + (size_t)bid * m_bufsize;
+	}
+
+	void IoUring::recycleBuffer(unsigned short bid)
+	{
+		// Handed back to the kernel with the next submit()
+		addBuffer(bid);
+	}
+}
+
+#endif /* JSSERVERSOCKET_HAVE_IO_URING */
@@ -0,0 +1,111 @@
+/**
+ * @file	JsServerSocket/IoUring.h
+ * @class	IoUring
+ * @brief	Minimal io_uring instance on raw system calls (no liburing)
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+#pragma once
+#endif
+
+#ifndef __JSSERVERSOCKET_IOURING_H__
+#define __JSSERVERSOCKET_IOURING_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+#include <linux/io_uring.h>
+#endif
+
+// Multishot recv (6.0) is the newest feature used, provided buffer rings and multishot accept are older
+#if defined(IORING_RECV_MULTISHOT)
+#define JSSERVERSOCKET_HAVE_IO_URING 1
+#endif
+
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+
+namespace JsServerSocket
+{
+	/**
+	 * One submission queue, one completion queue and one provided buffer ring.
+	 * Not thread-safe: only the thread that owns the event loop may touch it.
+	 */
+	class IoUring
+	{
+	private:
+		int m_ring_fd;
+
+		void *m_sq_ptr;
+		size_t m_sq_size;
+		void *m_cq_ptr;
+		size_t m_cq_size;
+		struct io_uring_sqe *m_sqes;
+		size_t m_sqes_size;
+
+		unsigned int *m_sq_head;
+		unsigned int *m_sq_tail;
+		unsigned int m_sq_mask;
+		unsigned int *m_sq_array;
+		unsigned int m_sq_localtail; // prepared, not yet published to the kernel
+		unsigned int m_sq_submitted;
+
+		unsigned int *m_cq_head;
+		unsigned int *m_cq_tail;
+		unsigned int m_cq_mask;
+		struct io_uring_cqe *m_cqes;
+
+		struct io_uring_buf_ring *m_bufring;
+		size_t m_bufring_size;
+		unsigned int m_bufring_mask;
+		unsigned short m_bufring_tail;
+		unsigned short m_bufgroup;
+		char *m_bufs;
+		unsigned int m_bufsize;
+
+		IoUring(const IoUring&);
+		IoUring& operator=(const IoUring&);
+
+		void addBuffer(unsigned short bid);
+		int enter(unsigned int waitnr, bool bGetEvents);
+
+	public:
+		IoUring();
+		~IoUring();
+
+		int init(unsigned int entries);
+		int initBufferRing(unsigned short bgid, unsigned int count, unsigned int bufsize);
+		void close();
+
+		// Returns NULL when the submission queue is full; submit() and retry.
+		struct io_uring_sqe *getSqe();
+		void prepAccept(int fd, bool bMultishot, uint64_t userdata);
+		void prepRecv(int fd, bool bMultishot, uint64_t userdata);
+		void prepRead(int fd, void *pbuf, unsigned int len, uint64_t userdata);
+		// One-shot: completes once fd is ready for pollmask (POLLOUT...)
+		void prepPollAdd(int fd, unsigned int pollmask, uint64_t userdata);
+		// Cancels the request submitted with targetdata; its completion then carries -ECANCELED
+		void prepCancel(uint64_t targetdata, uint64_t userdata);
+
+		// Publishes everything prepared so far and recycled buffers in one io_uring_enter
+		int submit();
+		// Same, and also reaps completions. With waitnr 0 it does not block, but still runs
+		// the deferred work that posts completions (COOP_TASKRUN defers it to the next entry).
+		int submitAndWait(unsigned int waitnr);
+
+		// Completions are walked from getCqHead() and released in one advanceCq()
+		unsigned int getCqHead();
+		struct io_uring_cqe *peekCqe(unsigned int head);
+		void advanceCq(unsigned int head);
+
+		char *getBuffer(unsigned short bid);
+		void recycleBuffer(unsigned short bid);
+	};
+}
+
+#endif /* JSSERVERSOCKET_HAVE_IO_URING */
+
+#endif /* __JSSERVERSOCKET_IOURING_H__ */
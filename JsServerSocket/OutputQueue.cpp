@@ -0,0 +1,355 @@
+/**
+ * @file	JsServerSocket/OutputQueue.cpp
+ * @class	OutputQueue
+ * @brief	OutputQueue
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "OutputQueue.h"
+
+// Sequence numbers wrap around, so they are compared by their distance
+#define ZCSEQ_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+namespace JsServerSocket
+{
+	OutputQueue::OutputQueue() :
+		m_phead(NULL),
+		m_ptail(NULL),
+		m_bytes(0),
+		m_filebytes(0),
+		m_pzchead(NULL),
+		m_pzctail(NULL),
+		m_zcnext(0),
+		m_zcdone(0)
+	{
+	}
+
+	OutputQueue::~OutputQueue()
+	{
+		clear();
+	}
+
+	OutputQueue::Chunk *OutputQueue::newChunk(size_t capacity)
+	{
+		Chunk *pchunk = (Chunk*)malloc(offsetof(Chunk, data) + capacity);
+		if (pchunk == NULL)
+			throw std::bad_alloc();
+		pchunk->pnext = NULL;
+		pchunk->capacity = capacity;
+		pchunk->begin = 0;
+		pchunk->end = 0;
+		pchunk->pexternal = NULL;
+		pchunk->releasehandler = NULL;
+		pchunk->releaseparam = NULL;
+		pchunk->fileoffset = 0;
+		pchunk->filefd = -1;
+		pchunk->zcseq = 0;
+		pchunk->bzcsent = false;
+		return pchunk;
+	}
+
+	void OutputQueue::append(const char *pbuf, size_t len)
+	{
+		size_t room;
+
+		while (len > 0)
+		{
+			if ((m_ptail == NULL) || (m_ptail->end == m_ptail->capacity) || (m_ptail->pexternal != NULL) || (m_ptail->filefd >= 0))
+			{
+				// A large write gets one chunk of its own size instead of many small ones
+				Chunk *pchunk = newChunk((len > CHUNK_SIZE) ? len : (size_t)CHUNK_SIZE);
+				if (m_ptail != NULL)
+					m_ptail->pnext = pchunk;
+				else
+					m_phead = pchunk;
+				m_ptail = pchunk;
+			}
+
+			room = m_ptail->capacity - m_ptail->end;
+			if (room > len)
+				room = len;
+			memcpy(&m_ptail->data[m_ptail->end], pbuf, room);
+			m_ptail->end += room;
+			m_bytes += room;
+			pbuf += room;
+			len -= room;
+		}
+	}
+
+	void OutputQueue::appendExternal(const char *pbuf, size_t len, OutputReleaseHandler_t releasehandler, void *param)
+	{
+		Chunk *pchunk = newChunk(0);
+		pchunk->capacity = len;
+		pchunk->end = len;
+		pchunk->pexternal = pbuf;
+		pchunk->releasehandler = releasehandler;
+		pchunk->releaseparam = param;
+		if (m_ptail != NULL)
+			m_ptail->pnext = pchunk;
+		else
+			m_phead = pchunk;
+		m_ptail = pchunk;
+		m_bytes += len;
+	}
+
+	void OutputQueue::appendFile(int fd, off_t offset, size_t len)
+	{
+		Chunk *pchunk = newChunk(0);
+		pchunk->capacity = len;
+		pchunk->end = len;
+		pchunk->fileoffset = offset;
+		pchunk->filefd = fd;
+		if (m_ptail != NULL)
+			m_ptail->pnext = pchunk;
+		else
+			m_phead = pchunk;
+		m_ptail = pchunk;
+		m_bytes += len;
+		m_filebytes += len;
+	}
+
+	int OutputQueue::getIovecs(struct iovec *piov, int maxiov, bool *pbexternal) const
+	{
+		int count = 0;
+		bool bexternal = false;
+		const Chunk *pchunk;
+
+		for (pchunk = m_phead; (pchunk != NULL) && (count < maxiov); pchunk = pchunk->pnext)
+		{
+			if (pchunk->end == pchunk->begin)
+				continue;
+			if (pchunk->filefd >= 0)
+				break;
+			if (count == 0)
+				bexternal = (pchunk->pexternal != NULL);
+			else if ((pchunk->pexternal != NULL) != bexternal)
+				break;
+			piov[count].iov_base = (void*)(((pchunk->pexternal != NULL) ? pchunk->pexternal : pchunk->data) + pchunk->begin);
+			piov[count].iov_len = pchunk->end - pchunk->begin;
+			count++;
+		}
+
+		*pbexternal = bexternal;
+		return count;
+	}
+
+	bool OutputQueue::getFile(int *pfd, off_t *poffset, size_t *plen) const
+	{
+		if ((m_phead == NULL) || (m_phead->filefd < 0))
+			return false;
+		*pfd = m_phead->filefd;
+		*poffset = m_phead->fileoffset + m_phead->begin;
+		*plen = m_phead->end - m_phead->begin;
+		return true;
+	}
+
+	int OutputQueue::readFile(size_t maxlen)
+	{
+		Chunk *pfile = m_phead;
+		Chunk *pchunk;
+		size_t len;
+		ssize_t nrst;
+
+		if ((pfile == NULL) || (pfile->filefd < 0))
+			return -EINVAL;
+		len = pfile->end - pfile->begin;
+		if (len > maxlen)
+			len = maxlen;
+
+		try
+		{
+			pchunk = newChunk(len);
+		}catch (std::bad_alloc& ex){
+			return -ENOMEM;
+		}
+		do {
+			nrst = ::pread(pfile->filefd, pchunk->data, len, pfile->fileoffset + pfile->begin);
+		} while ((nrst < 0) && (errno == EINTR));
+		if (nrst <= 0)
+		{
+			free(pchunk);
+			// Nothing to read although the range said so: the file was cut short
+			return (nrst < 0) ? -errno : -ENODATA;
+		}
+
+		pchunk->end = nrst;
+		pfile->begin += nrst;
+		m_filebytes -= nrst;
+		pchunk->pnext = pfile;
+		m_phead = pchunk;
+		if (pfile->begin == pfile->end)
+		{
+			pchunk->pnext = pfile->pnext;
+			if (m_ptail == pfile)
+				m_ptail = pchunk;
+			freeChunk(pfile);
+		}
+		return (int)nrst;
+	}
+
+	void OutputQueue::consume(size_t len, bool bzerocopy)
+	{
+		uint32_t seq = 0;
+
+		if (bzerocopy)
+			seq = m_zcnext++;
+
+		while ((len > 0) && (m_phead != NULL))
+		{
+			size_t avail = m_phead->end - m_phead->begin;
+			bool bfile = (m_phead->filefd >= 0);
+			if (bzerocopy)
+			{
+				m_phead->zcseq = seq;
+				m_phead->bzcsent = true;
+			}
+			if (len < avail)
+			{
+				m_phead->begin += len;
+				m_bytes -= len;
+				if (bfile)
+					m_filebytes -= len;
+				return;
+			}
+			m_bytes -= avail;
+			if (bfile)
+				m_filebytes -= avail;
+			len -= avail;
+
+			Chunk *pchunk = m_phead;
+			m_phead = pchunk->pnext;
+			if (m_phead == NULL)
+				m_ptail = NULL;
+			retireChunk(pchunk);
+		}
+	}
+
+	void OutputQueue::retireChunk(Chunk *pchunk)
+	{
+		if (pchunk->bzcsent)
+		{
+			// The kernel still reads the buffer
+			pchunk->pnext = NULL;
+			if (m_pzctail != NULL)
+				m_pzctail->pnext = pchunk;
+			else
+				m_pzchead = pchunk;
+			m_pzctail = pchunk;
+			return;
+		}
+		// Not kept for reuse: an idle connection should hold no buffer
+		freeChunk(pchunk);
+	}
+
+	void OutputQueue::freeChunk(Chunk *pchunk)
+	{
+		if ((pchunk->pexternal != NULL) && (pchunk->releasehandler != NULL))
+			pchunk->releasehandler(pchunk->pexternal, pchunk->releaseparam);
+		if (pchunk->filefd >= 0)
+			::close(pchunk->filefd);
+		free(pchunk);
+	}
+
+	void OutputQueue::completeZeroCopy(uint32_t lo, uint32_t hi)
+	{
+		size_t i;
+
+		if (ZCSEQ_BEFORE(m_zcdone, lo))
+		{
+			// An earlier send is still outstanding
+			m_zcpending.push_back(std::make_pair(lo, hi));
+			return;
+		}
+		if (!ZCSEQ_BEFORE(hi, m_zcdone))
+			m_zcdone = hi + 1;
+
+		for (i = 0; i < m_zcpending.size(); )
+		{
+			if (ZCSEQ_BEFORE(m_zcdone, m_zcpending[i].first))
+			{
+				i++;
+				continue;
+			}
+			if (!ZCSEQ_BEFORE(m_zcpending[i].second, m_zcdone))
+				m_zcdone = m_zcpending[i].second + 1;
+			m_zcpending.erase(m_zcpending.begin() + i);
+			i = 0;
+		}
+
+		while ((m_pzchead != NULL) && ZCSEQ_BEFORE(m_pzchead->zcseq, m_zcdone))
+		{
+			Chunk *pchunk = m_pzchead;
+			m_pzchead = pchunk->pnext;
+			if (m_pzchead == NULL)
+				m_pzctail = NULL;
+			freeChunk(pchunk);
+		}
+	}
+
+	void OutputQueue::discardUnsent()
+	{
+		while (m_phead != NULL)
+		{
+			Chunk *pchunk = m_phead;
+			m_phead = pchunk->pnext;
+			retireChunk(pchunk);
+		}
+		m_ptail = NULL;
+		m_bytes = 0;
+		m_filebytes = 0;
+	}
+
+	void OutputQueue::clear()
+	{
+		while (m_phead != NULL)
+		{
+			Chunk *pnext = m_phead->pnext;
+			freeChunk(m_phead);
+			m_phead = pnext;
+		}
+		m_ptail = NULL;
+		m_bytes = 0;
+		m_filebytes = 0;
+		while (m_pzchead != NULL)
+		{
+			Chunk *pnext = m_pzchead->pnext;
+			freeChunk(m_pzchead);
+			m_pzchead = pnext;
+		}
+		m_pzctail = NULL;
+		m_zcpending.clear();
+	}
+
+	size_t OutputQueue::size() const
+	{
+		return m_bytes;
+	}
+
+	bool OutputQueue::empty() const
+	{
+		return m_bytes == 0;
+	}
+
+	size_t OutputQueue::memorySize() const
+	{
+		return m_bytes - m_filebytes;
+	}
+
+	bool OutputQueue::hasZeroCopyInFlight() const
+	{
+		return m_pzchead != NULL;
+	}
+
+	bool OutputQueue::usedZeroCopy() const
+	{
+		return m_zcnext != 0;
+	}
+}
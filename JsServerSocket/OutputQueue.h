@@ -0,0 +1,126 @@
+/**
+ * @file	JsServerSocket/OutputQueue.h
+ * @class	OutputQueue
+ * @brief	Bytes a connection could not write yet, in a list of fixed chunks
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+#pragma once
+#endif
+
+#ifndef __JSSERVERSOCKET_OUTPUTQUEUE_H__
+#define __JSSERVERSOCKET_OUTPUTQUEUE_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+#include <utility>
+
+namespace JsServerSocket
+{
+	// Gives a buffer passed to ClientContext::sendZeroCopy() back to its owner
+	typedef void(*OutputReleaseHandler_t)(const char *pbuf, void *param);
+
+	/**
+	 * Copies each append into the tail chunk while it has room, so small writes share one.
+	 * A TLS write that would block is retried from here although it began elsewhere, which
+	 * the SSL_CTX allows (SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER). Not thread-safe: the owner
+	 * locks around every call.
+	 *
+	 * A buffer added by appendExternal() is sent from where it is. When a MSG_ZEROCOPY send
+	 * carried part of it, it is kept after it was written until the kernel reports that
+	 * send complete (completeZeroCopy), and only then handed back to its release handler.
+	 *
+	 * A range added by appendFile() stays in the file: its chunk holds a descriptor and an
+	 * offset, and the bytes come in only when readFile() moves some of them in front of it.
+	 */
+	class OutputQueue
+	{
+	public:
+		enum {
+			CHUNK_SIZE = 16384
+		};
+
+	private:
+		struct Chunk {
+			Chunk *pnext;
+			size_t capacity;
+			size_t begin; // written up to here
+			size_t end;   // filled up to here
+			const char *pexternal; // appendExternal(): the caller's buffer instead of data
+			OutputReleaseHandler_t releasehandler;
+			void *releaseparam;
+			off_t fileoffset; // appendFile(): where begin is in filefd
+			int filefd; // appendFile(): the file instead of data; -1 otherwise
+			uint32_t zcseq; // the last MSG_ZEROCOPY send that carried part of it
+			bool bzcsent;
+			char data[1];
+		};
+
+		Chunk *m_phead;
+		Chunk *m_ptail;
+		size_t m_bytes;
+		size_t m_filebytes; // of m_bytes, still in files
+
+		// Written by MSG_ZEROCOPY, waiting for the kernel, in the order they were sent
+		Chunk *m_pzchead;
+		Chunk *m_pzctail;
+		// The kernel numbers every MSG_ZEROCOPY send of a socket from 0; all below m_zcdone are done
+		uint32_t m_zcnext;
+		uint32_t m_zcdone;
+		std::vector< std::pair<uint32_t, uint32_t> > m_zcpending; // reported ahead of m_zcdone
+
+		OutputQueue(const OutputQueue&);
+		OutputQueue& operator=(const OutputQueue&);
+
+		Chunk *newChunk(size_t capacity);
+		void retireChunk(Chunk *pchunk);
+		static void freeChunk(Chunk *pchunk);
+
+	public:
+		OutputQueue();
+		~OutputQueue();
+
+		// std::bad_alloc
+		void append(const char *pbuf, size_t len);
+		// std::bad_alloc, after which releasehandler has not been called
+		void appendExternal(const char *pbuf, size_t len, OutputReleaseHandler_t releasehandler, void *param);
+		// std::bad_alloc, after which fd is still the caller's. Otherwise the queue closes fd
+		// once the range is written.
+		void appendFile(int fd, off_t offset, size_t len);
+		// Fills up to maxiov buffers from the head and returns how many. They are either all
+		// copies or all appendExternal() buffers, as *pbexternal tells. 0 when a file is first.
+		int getIovecs(struct iovec *piov, int maxiov, bool *pbexternal) const;
+		// Whether the head is an appendFile() range, and which part of it is left
+		bool getFile(int *pfd, off_t *poffset, size_t *plen) const;
+		// Reads up to maxlen bytes of the file at the head into a chunk in front of it, for a
+		// write that cannot take a file (TLS). Bytes read, or a negative errno.
+		int readFile(size_t maxlen);
+		// Drops len bytes from the head once they are written; bzerocopy if that was one
+		// MSG_ZEROCOPY send
+		void consume(size_t len, bool bzerocopy);
+		// A completion from the socket's error queue: sends lo to hi (inclusive) are done
+		void completeZeroCopy(uint32_t lo, uint32_t hi);
+		// Drops everything not yet written. What MSG_ZEROCOPY sent stays until completeZeroCopy().
+		void discardUnsent();
+		// Releases every external buffer, also those the kernel may still be sending
+		void clear();
+
+		size_t size() const;
+		bool empty() const;
+		// What the queue holds in memory: size() without the appendFile() ranges
+		size_t memorySize() const;
+		// Buffers written with MSG_ZEROCOPY whose completion has not come yet
+		bool hasZeroCopyInFlight() const;
+		// The send numbering lives here, so such a queue is kept for the connection's lifetime
+		bool usedZeroCopy() const;
+	};
+}
+
+#endif /* __JSSERVERSOCKET_OUTPUTQUEUE_H__ */
@@ -10,35 +10,150 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
 #include <netinet/tcp.h>
 
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "ServerContext.h"
 #include "ClientContext.h"
+#include "IoUring.h"
 #include "macros.h"
 
+// epoll_event.data.ptr of the loop's own descriptors
+#define EPOLL_TAG_LISTENER NULL
+static char s_epoll_tag_wakeup;
+#define EPOLL_TAG_WAKEUP   ((void*)&s_epoll_tag_wakeup)
+static char s_epoll_tag_timer;
+#define EPOLL_TAG_TIMER    ((void*)&s_epoll_tag_timer)
+static char s_epoll_tag_usertimer;
+#define EPOLL_TAG_USERTIMER ((void*)&s_epoll_tag_usertimer)
+static char s_epoll_tag_zclinger;
+#define EPOLL_TAG_ZCLINGER ((void*)&s_epoll_tag_zclinger)
+// epoll_event.data.u64 of a client socket: the top bit, which no tag has, then the socket and
+// the client index. Not the ClientContext*: another worker may delete the client, and its pool
+// hand the context to a new connection, while the event waits in this worker's batch.
+#define EPOLL_CLIENTDATA(fd, idx) (((uint64_t)1 << 63) | ((uint64_t)((fd) & 0x7fffffff) << 32) | (uint64_t)(uint32_t)(idx))
+#define EPOLL_CLIENTDATA_IS(ud)    (((ud) >> 63) != 0)
+#define EPOLL_CLIENTDATA_FD(ud)    ((int)(((ud) >> 32) & 0x7fffffff))
+#define EPOLL_CLIENTDATA_INDEX(ud) ((int)(uint32_t)(ud))
+
+// io_uring user_data: tag in the top 4 bits, then the socket and the client index
+#define URING_TAG_ACCEPT 1
+#define URING_TAG_WAKEUP 2
+#define URING_TAG_RECV   3
+#define URING_TAG_TIMER  4
+#define URING_TAG_USERTIMER 5
+#define URING_TAG_CANCEL 6
+#define URING_TAG_WRITABLE 7
+#define URING_TAG_ERRQUEUE 8
+#define URING_TAG_ZCLINGER 9
+#define URING_USERDATA(tag, fd, idx) (((uint64_t)(tag) << 60) | ((uint64_t)((fd) & 0x0fffffff) << 32) | (uint64_t)(uint32_t)(idx))
+#define URING_USERDATA_TAG(ud)   ((int)((ud) >> 60))
+#define URING_USERDATA_FD(ud)    ((int)(((ud) >> 32) & 0x0fffffff))
+#define URING_USERDATA_INDEX(ud) ((int)(uint32_t)(ud))
+
+// How long close() lets the workers return from their handlers before cancelling them
+#define WORKER_STOP_GRACE_MS 1000
+
+// The idle wheel ticks eight times per timeout, within these bounds
+#define IDLE_TICK_MIN_MS 10
+#define IDLE_TICK_MAX_MS 1000
+#define IDLE_WHEEL_SLOTS 64
+
+// drain(): clients a worker closes per wakeup, and how often the output is checked
+#define DRAIN_BATCH_SIZE 64
+#define DRAIN_POLL_MS    20
+
+// close(): how long the aborted sockets of closed clients get for their last MSG_ZEROCOPY completions
+#define ZCLINGER_ABORT_WAIT_MS 1000
+#define ZCLINGER_EVENTS        16
+
+// exportSockets(): one message per batch of descriptors, well under SCM_MAX_FD
+#define EXPORT_MAGIC         0x4A534B54
+#define EXPORT_MSG_LISTENERS 1
+#define EXPORT_MSG_CLIENTS   2
+#define EXPORT_MSG_END       3
+#define EXPORT_BATCH_SIZE    64
+
 namespace JsServerSocket
 {
+	// One timerSchedule() call. Whoever takes it off both the wheel and its client's list frees it.
+	struct ClientTimer {
+		enum State {
+			STATE_ARMED = 0,
+			STATE_FIRING,   // collected by a worker, its handler is about to run or running
+			STATE_CANCELLED // cancelled while firing; the worker frees it afterwards
+		};
+
+		TimerWheelNode node;
+		ClientTimer *pnext; // in the client's m_ptimers
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+		int id;
+		int periodms;
+		State state;
+		ServerContext::Client_TimerHandler_t handler;
+		void *param;
+
+		ClientTimer()
+			: pnext(NULL)
+			, id(0)
+			, periodms(0)
+			, state(STATE_ARMED)
+			, handler(NULL)
+			, param(NULL)
+		{
+			node.pdata = this;
+		}
+	};
+
+	static void unlinkClientTimer(ClientTimer *ptimer)
+	{
+		ClientTimer **pplink = &ptimer->spclientctx->m_ptimers;
+		while (*pplink != NULL)
+		{
+			if (*pplink == ptimer)
+			{
+				*pplink = ptimer->pnext;
+				break;
+			}
+			pplink = &(*pplink)->pnext;
+		}
+		ptimer->pnext = NULL;
+	}
+
+	__thread ServerContext::WorkerThreadInternalContext *ServerContext::s_pcurrentworker = NULL;
 
 	ServerContext::ServerContext(void *userptr, JsCPPUtils::Logger *plogger)
 		: m_userptr(userptr),
 		m_pParentLogger(plogger),
 		m_plogger(NULL),
-		m_sock_fd(INVALID_SOCKET),
-		m_epoll_fd(INVALID_FD),
 		m_sock_domain(0),
 		m_sock_type(0),
 		m_sock_proto(0),
 		m_conf_numOfMaxClients(0),
 		m_conf_recvdatabufsize(0),
 		m_worker_numofthreads(0),
+		m_acceptor_wakeup_fd(INVALID_FD),
+		m_numofclients(0),
+		m_acceptpaused(0),
+		m_drainphase(DRAIN_NONE),
+		m_drainacceptors(0),
+		m_listenexported(0),
+		m_timerseq(0),
 		m_startworkerposthandler(NULL),
 		m_stopworkerhandler(NULL),
 		m_accepthandler(NULL),
@@ -74,10 +189,12 @@ namespace JsServerSocket
 		int numOfMaxClients, long recvdatabufsize,
 		StartWorkerPostHandler_t startworkerposthandler,
 		StopWorkerHandler_t stopworkerhandler, Client_AcceptHandler_t accepthandler,
-		Client_RecvHandler_t recvhandler, Client_DelHandler_t delhandler
+		Client_RecvHandler_t recvhandler, Client_DelHandler_t delhandler,
+		const Options *poptions
 		)
 	{
 		int retval = 0;
+		EventLoop *ploop;
 		
 		m_sock_domain = sock_domain;
 		m_sock_type = sock_type;
@@ -94,20 +211,54 @@ namespace JsServerSocket
 		m_recvhandler = recvhandler;
 		m_delhandler = delhandler;
 
+		if (poptions != NULL)
+			m_options = *poptions;
+		if (m_options.topology != TOPOLOGY_SHARDED_REUSEPORT)
+			m_options.numOfShards = 1;
+		else if (m_options.numOfShards <= 0)
+			return 0;
+		if (m_options.acceptBatchSize <= 0)
+			m_options.acceptBatchSize = 1;
+		if (m_options.epollBatchSize <= 0)
+			m_options.epollBatchSize = 1;
+		if (!m_options.bAdaptiveBatch || (m_options.epollBatchMax < m_options.epollBatchSize))
+			m_options.epollBatchMax = m_options.epollBatchSize;
+		if (m_options.numOfClientShards <= 0)
+			m_options.numOfClientShards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (m_options.clientPoolSize < 0)
+			m_options.clientPoolSize = 0;
+		// The clock source is set once for the process, by the first context asking for another
+		// than the default; one keeping the default runs on whatever that was. -EBUSY when two differ.
+		if (m_options.clockSource != JsCPPUtils::Common::CLOCKSOURCE_MONOTONIC)
+		{
+			retval = JsCPPUtils::Common::setClockSource(m_options.clockSource);
+			if (retval <= 0)
+				return retval;
+		}
+		if (m_options.backend == BACKEND_IO_URING)
+		{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+			// TLS reads the socket itself, and the acceptors hand off through an epoll doorbell
+			if (bUseSSL || (m_options.topology == TOPOLOGY_ACCEPTOR))
+				return -ENOTSUP;
+			if ((m_options.uringEntries <= 0) || (m_options.uringRecvBuffers <= 0))
+				return 0;
+#else
+			return -ENOTSUP;
+#endif
+		}
+
 		do {
-			m_sock_fd = socket(m_sock_domain, m_sock_type, m_sock_proto);
-			if(m_sock_fd == INVALID_SOCKET)
-			{
-				retval = -errno;
+			retval = m_clients.init(m_options.numOfClientShards);
+			if(retval <= 0)
 				break;
-			}
 
-			m_epoll_fd = epoll_create(128);
-			if(m_sock_fd == INVALID_FD)
-			{
-				retval = -errno;
+			ploop = new EventLoop(0);
+			m_loops.push_back(ploop);
+
+			retval = openLoop(ploop, true);
+			if(retval <= 0)
 				break;
-			}
 			
 #ifdef USE_OPENSSL
 			if (m_bUseSSL)
@@ -119,6 +270,8 @@ namespace JsServerSocket
 					retval = -1;
 					break;
 				}
+				// A write that would block is retried from the output queue, not from the caller's buffer
+				SSL_CTX_set_mode(m_sslCtx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 			}
 #endif
 
@@ -133,442 +286,3084 @@ namespace JsServerSocket
 		return retval;
 	}
 
-	int ServerContext::close()
+	int ServerContext::drain(int timeoutMs)
 	{
-		for(std::list< JsCPPUtils::SmartPointer< JsCPPUtils::JsThread::ThreadContext > >::iterator iter = m_worker_threads.begin(); iter != m_worker_threads.end(); )
+		int retval = 0;
+		int64_t deadline = JsCPPUtils::Common::getTickCount() + timeoutMs;
+
+		if (m_loops.empty())
+			return 0;
+		if (!__sync_bool_compare_and_swap(&m_drainphase, DRAIN_NONE, DRAIN_FLUSH))
+			return -EALREADY;
+
+		// The listeners stay open until close(): shutting one down would reset the connections
+		// queued on it. They are taken off the loops here; the rings cancel their accept and the
+		// acceptors take theirs off when the wakeup below reaches them. Each then accepts what is
+		// already queued once, unless the listeners were exported and the other process serves them.
+		m_drainacceptors = (int)m_acceptor_threads.size();
+		for (std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
+		{
+			EventLoop *ploop = *iter;
+			if ((ploop->accept_fd == INVALID_SOCKET) || (m_options.topology == TOPOLOGY_ACCEPTOR))
+				continue;
+			if (m_options.backend != BACKEND_IO_URING)
+				epoll_ctl(ploop->epoll_fd, EPOLL_CTL_DEL, ploop->listen_fd, NULL);
+			if (!m_listenexported)
+				ploop->drainaccept = 1;
+		}
+		__sync_synchronize();
+		for (std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
+		{
+			wakeupLoop(*iter);
+		}
+		if (m_acceptor_wakeup_fd != INVALID_FD)
 		{
-			(*iter)->reqStop();
-			iter = m_worker_threads.erase(iter);
+			uint64_t value = 1;
+			::write(m_acceptor_wakeup_fd, &value, sizeof(value));
 		}
 
-		m_clients_lock.lock();
-		for(std::map< int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = m_clients.begin(); iter != m_clients.end(); )
+		// Taking each client's lock waits for a handler running on it
+		while (JsCPPUtils::Common::getTickCount() < deadline)
 		{
-			iter->second->close();
-			m_clients.erase(iter++);
+			bool bpending = (m_drainacceptors > 0);
+
+			// The backlog is accepted and handed to the loops before it counts as served
+			for (std::vector<EventLoop*>::iterator iter = m_loops.begin(); (iter != m_loops.end()) && !bpending; iter++)
+			{
+				if (((*iter)->drainaccept != 0) || ((*iter)->numofqueued > 0))
+					bpending = true;
+			}
+			for (int shardidx = 0; (shardidx < m_clients.getNumOfShards()) && !bpending; shardidx++)
+			{
+				std::vector< JsCPPUtils::SmartPointer<ClientContext> > clients;
+				m_clients.getShardClients(shardidx, &clients);
+				for (std::vector< JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = clients.begin(); (iter != clients.end()) && !bpending; iter++)
+				{
+					if ((*iter)->lockandcheck() != 1)
+						continue;
+					if ((*iter)->getPendingOutput() > 0)
+						bpending = true;
+					(*iter)->unlock();
+				}
+			}
+			if (!bpending)
+				break;
+			usleep(DRAIN_POLL_MS * 1000);
 		}
-		m_clients_lock.unlock();
 
-		if(m_sock_fd != INVALID_SOCKET)
+		m_drainphase = DRAIN_TEARDOWN;
+		__sync_synchronize();
+		for (std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
 		{
-			::close(m_sock_fd);
-			m_sock_fd = INVALID_SOCKET;
+			wakeupLoop(*iter);
 		}
-		if(m_epoll_fd != INVALID_SOCKET)
+
+		// A handler that does not return holds its client past the deadline
+		deadline += WORKER_STOP_GRACE_MS;
+		while (m_numofclients > 0)
 		{
-			::close(m_epoll_fd);
-			m_epoll_fd = INVALID_SOCKET;
+			if (JsCPPUtils::Common::getTickCount() >= deadline)
+			{
+				retval = -ETIMEDOUT;
+				break;
+			}
+			usleep(DRAIN_POLL_MS * 1000);
 		}
-		
-#ifdef USE_OPENSSL
-		if (m_bUseSSL)
+		if (m_numofclients <= 0)
+			retval = 1;
+
+		if (m_plogger != NULL)
+			m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[drain] %d clients left", (int)m_numofclients);
+
+		return retval;
+	}
+
+	struct ExportHeader {
+		uint32_t magic;
+		uint32_t type;
+		uint32_t count; // descriptors passed with the message, and the ExportedClient entries that follow
+		uint32_t reserved;
+	};
+
+	struct ExportedClient {
+		struct sockaddr_in addr;
+		int32_t statelen;
+		char state[ServerContext::EXPORT_STATE_MAX];
+	};
+
+	static int sendFds(int unixsock, const void *pdata, size_t len, const int *fds, int numfds)
+	{
+		struct msghdr msg;
+		struct iovec iov;
+		char cmsgbuf[CMSG_SPACE(sizeof(int) * EXPORT_BATCH_SIZE)];
+		ssize_t nrst;
+
+		memset(&msg, 0, sizeof(msg));
+		memset(cmsgbuf, 0, sizeof(cmsgbuf));
+		iov.iov_base = (void*)pdata;
+		iov.iov_len = len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (numfds > 0)
 		{
-			SSL_CTX_free(m_sslCtx);
-			m_sslCtx = NULL;
+			struct cmsghdr *pcmsg;
+			msg.msg_control = cmsgbuf;
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * numfds);
+			pcmsg = CMSG_FIRSTHDR(&msg);
+			pcmsg->cmsg_level = SOL_SOCKET;
+			pcmsg->cmsg_type = SCM_RIGHTS;
+			pcmsg->cmsg_len = CMSG_LEN(sizeof(int) * numfds);
+			memcpy(CMSG_DATA(pcmsg), fds, sizeof(int) * numfds);
 		}
-#endif
 
+		do {
+			nrst = ::sendmsg(unixsock, &msg, MSG_NOSIGNAL);
+		} while ((nrst < 0) && (errno == EINTR));
+		if (nrst < 0)
+			return -errno;
 		return 1;
 	}
 
-	int ServerContext::sslLoadCertificates(const char* szCertFile, const char* szKeyFile)
+	// Returns the length of the message; *pnumfds descriptors were received with it
+	static int recvFds(int unixsock, void *pbuf, size_t size, int *fds, int maxfds, int *pnumfds)
 	{
-		if (m_bUseSSL <= 0)
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *pcmsg;
+		char cmsgbuf[CMSG_SPACE(sizeof(int) * EXPORT_BATCH_SIZE)];
+		ssize_t nrst;
+		int i;
+
+		*pnumfds = 0;
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = pbuf;
+		iov.iov_len = size;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsgbuf;
+		msg.msg_controllen = sizeof(cmsgbuf);
+
+		do {
+			nrst = ::recvmsg(unixsock, &msg, MSG_CMSG_CLOEXEC);
+		} while ((nrst < 0) && (errno == EINTR));
+		if (nrst < 0)
+			return -errno;
+
+		for (pcmsg = CMSG_FIRSTHDR(&msg); pcmsg != NULL; pcmsg = CMSG_NXTHDR(&msg, pcmsg))
+		{
+			if ((pcmsg->cmsg_level == SOL_SOCKET) && (pcmsg->cmsg_type == SCM_RIGHTS))
+			{
+				int count = (int)((pcmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+				for (i = 0; i < count; i++)
+				{
+					int fd;
+					memcpy(&fd, CMSG_DATA(pcmsg) + sizeof(int) * i, sizeof(int));
+					if (*pnumfds < maxfds)
+						fds[(*pnumfds)++] = fd;
+					else
+						::close(fd);
+				}
+			}
+		}
+		if (nrst == 0)
+			return -ECONNRESET;
+		if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		{
+			for (i = 0; i < *pnumfds; i++)
+				::close(fds[i]);
+			*pnumfds = 0;
+			return -EMSGSIZE;
+		}
+		return (int)nrst;
+	}
+
+	// The clients of the batch are locked. Once sent they are deleted here, otherwise unlocked.
+	static int sendExportBatch(ServerContext *pserverctx, int unixsock, char *pmsgbuf, const int *fds, std::vector< JsCPPUtils::SmartPointer<ClientContext> > &batch)
+	{
+		ExportHeader *pheader = (ExportHeader*)pmsgbuf;
+		int retval;
+
+		pheader->magic = EXPORT_MAGIC;
+		pheader->type = EXPORT_MSG_CLIENTS;
+		pheader->count = (uint32_t)batch.size();
+		pheader->reserved = 0;
+		retval = sendFds(unixsock, pmsgbuf, sizeof(ExportHeader) + sizeof(ExportedClient) * batch.size(), fds, (int)batch.size());
+
+		for (std::vector< JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = batch.begin(); iter != batch.end(); iter++)
+		{
+			if (retval > 0)
+			{
+				(*iter)->m_bexported = true;
+				pserverctx->clientDel(iter->getPtr());
+			}
+			else
+			{
+				(*iter)->unlock();
+			}
+		}
+		if (retval > 0)
+			retval = (int)batch.size();
+		batch.clear();
+
+		return retval;
+	}
+
+	int ServerContext::exportSockets(int unixsock, bool bIdleClients, Client_ExportHandler_t exporthandler)
+	{
+		int retval = 0;
+		int nrst;
+		ExportHeader header;
+		int fds[EXPORT_BATCH_SIZE];
+		int numfds = 0;
+		char *pmsgbuf = NULL;
+		std::vector< JsCPPUtils::SmartPointer<ClientContext> > batch;
+
+		if (m_loops.empty())
 			return 0;
-#ifdef USE_OPENSSL
-	    /* set the local certificate from CertFile */
-		if (SSL_CTX_use_certificate_file(m_sslCtx, szCertFile, SSL_FILETYPE_PEM) <= 0)
+
+		for (std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
 		{
-			ERR_print_errors_fp(stderr);
-			return -1;
+			if ((*iter)->listen_fd == INVALID_SOCKET)
+				continue;
+			if (numfds == EXPORT_BATCH_SIZE)
+				return -E2BIG;
+			fds[numfds++] = (*iter)->listen_fd;
 		}
-		/* set the private key from KeyFile (may be the same as CertFile) */
-		if (SSL_CTX_use_PrivateKey_file(m_sslCtx, szKeyFile, SSL_FILETYPE_PEM) <= 0)
+
+		memset(&header, 0, sizeof(header));
+		header.magic = EXPORT_MAGIC;
+		header.type = EXPORT_MSG_LISTENERS;
+		header.count = numfds;
+		nrst = sendFds(unixsock, &header, sizeof(header), fds, numfds);
+		if (nrst < 0)
 		{
-			ERR_print_errors_fp(stderr);
-			return -1;
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[exportSockets] listeners not sent: %d", nrst);
+			return nrst;
 		}
-		/* verify private key */
-		if (!SSL_CTX_check_private_key(m_sslCtx))
+		m_listenexported = 1;
+
+		if (bIdleClients && !m_bUseSSL && (m_options.backend != BACKEND_IO_URING))
 		{
-			fprintf(stderr, "Private key does not match the public certificate\n");
-			return -1;
+			pmsgbuf = (char*)malloc(sizeof(ExportHeader) + sizeof(ExportedClient) * EXPORT_BATCH_SIZE);
+			if (pmsgbuf == NULL)
+				retval = -ENOMEM;
+
+			for (int shardidx = 0; (shardidx < m_clients.getNumOfShards()) && (retval >= 0); shardidx++)
+			{
+				std::vector< JsCPPUtils::SmartPointer<ClientContext> > clients;
+				m_clients.getShardClients(shardidx, &clients);
+				for (std::vector< JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = clients.begin(); (iter != clients.end()) && (retval >= 0); iter++)
+				{
+					ClientContext *pclientctx = iter->getPtr();
+					ExportedClient *pentry = &((ExportedClient*)(pmsgbuf + sizeof(ExportHeader)))[batch.size()];
+					int unread = 0;
+
+					if (pclientctx->lockandcheck() != 1)
+						continue;
+					// Input read here or output not yet acknowledged would be lost in the move
+					if ((::ioctl(pclientctx->m_sockfd, FIONREAD, &unread) < 0) || (unread > 0) || (pclientctx->getPendingOutput() != 0))
+					{
+						pclientctx->unlock();
+						continue;
+					}
+
+					memcpy(&pentry->addr, &pclientctx->m_addr, sizeof(pentry->addr));
+					pentry->statelen = 0;
+					if (exporthandler != NULL)
+					{
+						nrst = exporthandler(this, pclientctx, pentry->state, EXPORT_STATE_MAX);
+						if ((nrst < 0) || (nrst > EXPORT_STATE_MAX))
+						{
+							pclientctx->unlock();
+							continue;
+						}
+						pentry->statelen = nrst;
+					}
+
+					fds[batch.size()] = pclientctx->m_sockfd;
+					batch.push_back(*iter);
+					if ((int)batch.size() == EXPORT_BATCH_SIZE)
+					{
+						nrst = sendExportBatch(this, unixsock, pmsgbuf, fds, batch);
+						if (nrst < 0)
+							retval = nrst;
+						else
+							retval += nrst;
+					}
+				}
+			}
+
+			if ((retval >= 0) && !batch.empty())
+			{
+				nrst = sendExportBatch(this, unixsock, pmsgbuf, fds, batch);
+				if (nrst < 0)
+					retval = nrst;
+				else
+					retval += nrst;
+			}
+			if (pmsgbuf != NULL)
+				free(pmsgbuf);
 		}
-		return 1;
-#else
-		return -1;
-#endif
+
+		if (retval >= 0)
+		{
+			header.type = EXPORT_MSG_END;
+			header.count = 0;
+			nrst = sendFds(unixsock, &header, sizeof(header), NULL, 0);
+			if (nrst < 0)
+				retval = nrst;
+		}
+
+		if (m_plogger != NULL)
+			m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[exportSockets] %d listeners, %d clients: %d", numfds, (retval > 0) ? retval : 0, retval);
+
+		return retval;
 	}
-	
-	int ServerContext::listen(const struct sockaddr *psockaddr, int sockaddrlen, int sizeOfListenQueue)
+
+	int ServerContext::importListeners(int unixsock)
 	{
 		int retval = 0;
 		int nrst;
-		struct epoll_event tmpepevent;
+		ExportHeader header;
+		int fds[EXPORT_BATCH_SIZE];
+		int numfds = 0;
+		int i;
 
-		int nvalue;
+		if (m_loops.empty())
+			return 0;
 
-		nvalue = 1;
-		nrst = setsockopt(m_sock_fd, SOL_SOCKET, SO_REUSEADDR, &nvalue, sizeof(nvalue));
+		nrst = recvFds(unixsock, &header, sizeof(header), fds, EXPORT_BATCH_SIZE, &numfds);
+		if (nrst < 0)
+			return nrst;
 
 		do
 		{
-			nrst = bind(m_sock_fd, psockaddr, sockaddrlen);
-			if (IS_SOCKET_ERROR(nrst))
+			if ((nrst != sizeof(header)) || (header.magic != EXPORT_MAGIC) || (header.type != EXPORT_MSG_LISTENERS) || (numfds == 0) || ((int)header.count != numfds))
 			{
-				retval = -errno;
+				retval = -EPROTO;
 				break;
 			}
-
-			nrst = ::listen(m_sock_fd, sizeOfListenQueue);
-			if (IS_SOCKET_ERROR(nrst))
+			if ((m_options.topology != TOPOLOGY_SHARDED_REUSEPORT) && (numfds != 1))
 			{
-				retval = -errno;
+				retval = -EINVAL;
 				break;
 			}
 
-			memset(&tmpepevent, 0, sizeof(tmpepevent));
-			tmpepevent.events = EPOLLIN | EPOLLONESHOT;
-			tmpepevent.data.ptr = NULL;
-
-			nrst = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_sock_fd, &tmpepevent);
-			if (IS_BSDFUNC_ERROR(nrst))
+			// The listeners take the place of the ones listen() would have bound, one loop each
+			for (i = 0; i < numfds; i++)
 			{
-				retval = -errno;
-				break;
+				EventLoop *ploop;
+				if (i < (int)m_loops.size())
+				{
+					ploop = m_loops[i];
+				}
+				else
+				{
+					ploop = new EventLoop(i);
+					m_loops.push_back(ploop);
+					retval = openLoop(ploop, false);
+					if (retval <= 0)
+						break;
+				}
+				if (ploop->listen_fd != INVALID_SOCKET)
+					::close(ploop->listen_fd);
+				ploop->listen_fd = fds[i];
+				ploop->accept_fd = fds[i];
+				fds[i] = INVALID_SOCKET;
+
+				applySocketOptions(ploop->listen_fd);
+				retval = armListener(ploop);
+				if (retval <= 0)
+					break;
 			}
+			if (retval <= 0)
+				break;
 
+			m_options.numOfShards = numfds;
 			retval = 1;
 		} while (0);
 
-		if (retval <= 1)
+		for (i = 0; i < numfds; i++)
+		{
+			if (fds[i] != INVALID_SOCKET)
+				::close(fds[i]);
+		}
+
+		if (retval <= 0)
 		{
-			// Error handling
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[importListeners] failed: %d", retval);
 		}
 
 		return retval;
 	}
 
-	int ServerContext::startWorkers(int numOfthreads)
+	int ServerContext::importClients(int unixsock, Client_ImportHandler_t importhandler)
 	{
-		int i;
+		int retval = 0;
 		int nrst;
-		size_t n;
-
-		uint64_t ns = 0;
+		int fds[EXPORT_BATCH_SIZE];
+		int numfds = 0;
+		int numofimported = 0;
+		unsigned int rrcounter = 0;
+		size_t bufsize = sizeof(ExportHeader) + sizeof(ExportedClient) * EXPORT_BATCH_SIZE;
+		char *pmsgbuf;
+		int i;
 
-		if((numOfthreads < 0) || (numOfthreads > 64))
+		if (m_loops.empty())
 			return 0;
 
-		m_worker_numofthreads = numOfthreads;
+		pmsgbuf = (char*)malloc(bufsize);
+		if (pmsgbuf == NULL)
+			return -ENOMEM;
 
-		for(i=0; i<numOfthreads; i++)
+		while (1)
 		{
-			JsCPPUtils::SmartPointer< JsCPPUtils::JsThread::ThreadContext > spThreadCtx;
-			nrst = JsCPPUtils::JsThread::start(&spThreadCtx, workerThreadProc, i, this);
-			if(nrst <= 0)
+			ExportHeader *pheader = (ExportHeader*)pmsgbuf;
+			ExportedClient *pentries = (ExportedClient*)(pmsgbuf + sizeof(ExportHeader));
+
+			nrst = recvFds(unixsock, pmsgbuf, bufsize, fds, EXPORT_BATCH_SIZE, &numfds);
+			if (nrst < 0)
 			{
-				// ERROR
-			}else{
-				m_worker_threads.push_back(spThreadCtx);
+				retval = nrst;
+				break;
+			}
+			if ((nrst < (int)sizeof(ExportHeader)) || (pheader->magic != EXPORT_MAGIC) ||
+				(pheader->type != EXPORT_MSG_CLIENTS) || ((int)pheader->count != numfds) || (nrst != (int)(sizeof(ExportHeader) + sizeof(ExportedClient) * numfds)))
+			{
+				bool bend = (nrst >= (int)sizeof(ExportHeader)) && (pheader->magic == EXPORT_MAGIC) && (pheader->type == EXPORT_MSG_END);
+				retval = bend ? numofimported : -EPROTO;
+				for (i = 0; i < numfds; i++)
+					::close(fds[i]);
+				break;
+			}
+
+			// Spread over the loops the way the workers would have accepted them
+			for (i = 0; i < numfds; i++)
+			{
+				JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+				EventLoop *ploop = m_loops[rrcounter++ % m_loops.size()];
+
+				nrst = clientAddOnLoop(ploop, fds[i], &pentries[i].addr, &spclientctx, NULL);
+				if (nrst <= 0)
+				{
+					::closesocket(fds[i]);
+					continue;
+				}
+				numofimported++;
+
+				if ((importhandler != NULL) && (spclientctx->lockandcheck() == 1))
+				{
+					int statelen = pentries[i].statelen;
+					if ((statelen < 0) || (statelen > EXPORT_STATE_MAX))
+						statelen = 0;
+					if (importhandler(this, spclientctx.getPtr(), pentries[i].state, statelen) > 0)
+						spclientctx->unlock();
+					else
+						clientDel(spclientctx.getPtr());
+				}
+			}
+		}
+
+		free(pmsgbuf);
+
+		if (m_plogger != NULL)
+			m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[importClients] %d clients: %d", numofimported, retval);
+
+		return retval;
+	}
+
+	int ServerContext::close()
+	{
+		std::list< JsCPPUtils::SmartPointer< JsCPPUtils::JsThread::ThreadContext > >::iterator iter_thread;
+
+		// Acceptors first, so that nothing is handed to a worker that is going away
+		for(iter_thread = m_acceptor_threads.begin(); iter_thread != m_acceptor_threads.end(); iter_thread++)
+		{
+			(*iter_thread)->reqStop(false);
+		}
+		if(m_acceptor_wakeup_fd != INVALID_FD)
+		{
+			uint64_t value = 1;
+			::write(m_acceptor_wakeup_fd, &value, sizeof(value));
+		}
+		stopThreads(m_acceptor_threads);
+		if(m_acceptor_wakeup_fd != INVALID_FD)
+		{
+			::close(m_acceptor_wakeup_fd);
+			m_acceptor_wakeup_fd = INVALID_FD;
+		}
+
+		for(iter_thread = m_worker_threads.begin(); iter_thread != m_worker_threads.end(); iter_thread++)
+		{
+			(*iter_thread)->reqStop(false);
+		}
+		for(std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
+		{
+			wakeupLoop(*iter);
+		}
+		stopThreads(m_worker_threads);
+
+		for(int shardidx = 0; shardidx < m_clients.getNumOfShards(); shardidx++)
+		{
+			std::vector< JsCPPUtils::SmartPointer<ClientContext> > clients;
+			m_clients.getShardClients(shardidx, &clients);
+			for(std::vector< JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = clients.begin(); iter != clients.end(); iter++)
+			{
+				(*iter)->close();
+				m_clients.remove((*iter)->m_index, NULL);
+			}
+		}
+		m_clients.close();
+
+		for(std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
+		{
+			EventLoop *ploop = *iter;
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+			if(ploop->puring != NULL)
+			{
+				delete ploop->puring;
+				ploop->puring = NULL;
+			}
+#endif
+			for(std::vector< JsCPPUtils::SPSCQueue<AcceptedClient>* >::iterator iter_queue = ploop->handoffqueues.begin(); iter_queue != ploop->handoffqueues.end(); iter_queue++)
+			{
+				AcceptedClient client;
+				while((*iter_queue)->pop(&client))
+					::closesocket(client.sock);
+			}
+			if(ploop->listen_fd != INVALID_SOCKET)
+			{
+				::close(ploop->listen_fd);
+				ploop->listen_fd = INVALID_SOCKET;
+			}
+			if(ploop->wakeup_fd != INVALID_FD)
+			{
+				::close(ploop->wakeup_fd);
+				ploop->wakeup_fd = INVALID_FD;
+			}
+			if(ploop->timer_fd != INVALID_FD)
+			{
+				::close(ploop->timer_fd);
+				ploop->timer_fd = INVALID_FD;
+			}
+			if(ploop->usertimer_fd != INVALID_FD)
+			{
+				::close(ploop->usertimer_fd);
+				ploop->usertimer_fd = INVALID_FD;
+			}
+			closeLinger(ploop);
+			for(TimerWheelNode *pnode = ploop->timerwheel.removeAll(); pnode != NULL; )
+			{
+				TimerWheelNode *pnext = pnode->next;
+				delete (ClientTimer*)pnode->pdata;
+				pnode = pnext;
+			}
+			if(ploop->epoll_fd != INVALID_FD)
+			{
+				::close(ploop->epoll_fd);
+				ploop->epoll_fd = INVALID_FD;
 			}
+			delete ploop;
+		}
+		m_loops.clear();
+		
+#ifdef USE_OPENSSL
+		if (m_bUseSSL)
+		{
+			SSL_CTX_free(m_sslCtx);
+			m_sslCtx = NULL;
+		}
+#endif
+
+		m_drainphase = DRAIN_NONE;
+
+		return 1;
+	}
+
+	void ServerContext::stopThreads(std::list< JsCPPUtils::SmartPointer<JsCPPUtils::JsThread::ThreadContext> > &threads)
+	{
+		for(std::list< JsCPPUtils::SmartPointer< JsCPPUtils::JsThread::ThreadContext > >::iterator iter = threads.begin(); iter != threads.end(); )
+		{
+			// A handler blocked in a socket call without timeout never returns to the loop
+			if((*iter)->join(WORKER_STOP_GRACE_MS) == 0)
+			{
+				(*iter)->cancel();
+				(*iter)->join();
+			}
+			iter = threads.erase(iter);
+		}
+	}
+
+	int ServerContext::sslLoadCertificates(const char* szCertFile, const char* szKeyFile)
+	{
+		if (m_bUseSSL <= 0)
+			return 0;
+#ifdef USE_OPENSSL
+	    /* set the local certificate from CertFile */
+		if (SSL_CTX_use_certificate_file(m_sslCtx, szCertFile, SSL_FILETYPE_PEM) <= 0)
+		{
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		/* set the private key from KeyFile (may be the same as CertFile) */
+		if (SSL_CTX_use_PrivateKey_file(m_sslCtx, szKeyFile, SSL_FILETYPE_PEM) <= 0)
+		{
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		/* verify private key */
+		if (!SSL_CTX_check_private_key(m_sslCtx))
+		{
+			fprintf(stderr, "Private key does not match the public certificate\n");
+			return -1;
+		}
+		return 1;
+#else
+		return -1;
+#endif
+	}
+	
+	int ServerContext::listen(const struct sockaddr *psockaddr, int sockaddrlen, int sizeOfListenQueue)
+	{
+		int retval = 0;
+		int i;
+
+		if (m_loops.empty())
+			return 0;
+
+		do
+		{
+			retval = listenShard(m_loops[0], psockaddr, sockaddrlen, sizeOfListenQueue);
+			if (retval <= 0)
+				break;
+
+			for (i = 1; i < m_options.numOfShards; i++)
+			{
+				EventLoop *ploop = new EventLoop(i);
+				m_loops.push_back(ploop);
+
+				retval = openLoop(ploop, true);
+				if (retval <= 0)
+					break;
+
+				retval = listenShard(ploop, psockaddr, sockaddrlen, sizeOfListenQueue);
+				if (retval <= 0)
+					break;
+			}
+		} while (0);
+
+		if (retval <= 0)
+		{
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[listen] failed: %d", retval);
+		}
+
+		return retval;
+	}
+
+	int ServerContext::openLoop(EventLoop *ploop, bool bListener)
+	{
+		int nrst;
+		struct epoll_event tmpepevent;
+
+		if (bListener)
+		{
+			// Non-blocking, so that a batch of accept4() calls ends on EAGAIN
+			ploop->listen_fd = socket(m_sock_domain, m_sock_type | SOCK_NONBLOCK | SOCK_CLOEXEC, m_sock_proto);
+			if (ploop->listen_fd == INVALID_SOCKET)
+				return -errno;
+			ploop->accept_fd = ploop->listen_fd;
+		}
+
+		ploop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ploop->wakeup_fd == INVALID_FD)
+			return -errno;
+
+		if (m_options.idleTimeoutMs > 0)
+		{
+			struct itimerspec tmpitimer;
+			int64_t tickms = m_options.idleTimeoutMs / 8;
+			if (tickms < IDLE_TICK_MIN_MS)
+				tickms = IDLE_TICK_MIN_MS;
+			else if (tickms > IDLE_TICK_MAX_MS)
+				tickms = IDLE_TICK_MAX_MS;
+
+			try
+			{
+				ploop->idlewheel.init(IDLE_WHEEL_SLOTS, tickms, JsCPPUtils::Common::getTickCount());
+			}catch (std::bad_alloc& ex){
+				return -ENOMEM;
+			}
+
+			ploop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (ploop->timer_fd == INVALID_FD)
+				return -errno;
+			memset(&tmpitimer, 0, sizeof(tmpitimer));
+			tmpitimer.it_interval.tv_sec = tickms / 1000;
+			tmpitimer.it_interval.tv_nsec = (tickms % 1000) * 1000000;
+			tmpitimer.it_value = tmpitimer.it_interval;
+			if (timerfd_settime(ploop->timer_fd, 0, &tmpitimer, NULL) < 0)
+				return -errno;
+		}
+
+		// Armed by the first timerSchedule() on the loop
+		ploop->timerwheel.init((m_options.timerTickMs > 0) ? m_options.timerTickMs : 1, JsCPPUtils::Common::getTickCount());
+		ploop->usertimer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (ploop->usertimer_fd == INVALID_FD)
+			return -errno;
+
+		ploop->zclinger_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (ploop->zclinger_fd == INVALID_FD)
+			return -errno;
+
+		if (m_options.backend == BACKEND_IO_URING)
+		{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+			ploop->puring = new IoUring();
+			nrst = ploop->puring->init(m_options.uringEntries);
+			if (nrst <= 0)
+				return nrst;
+			nrst = ploop->puring->initBufferRing(0, m_options.uringRecvBuffers, m_conf_recvdatabufsize);
+			if (nrst <= 0)
+				return nrst;
+			return 1;
+#else
+			return -ENOTSUP;
+#endif
+		}
+
+		ploop->epoll_fd = epoll_create(128);
+		if (ploop->epoll_fd == INVALID_FD)
+			return -errno;
+
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLIN;
+		tmpepevent.data.ptr = EPOLL_TAG_WAKEUP;
+
+		nrst = epoll_ctl(ploop->epoll_fd, EPOLL_CTL_ADD, ploop->wakeup_fd, &tmpepevent);
+		if (IS_BSDFUNC_ERROR(nrst))
+			return -errno;
+
+		if (ploop->timer_fd != INVALID_FD)
+		{
+			tmpepevent.data.ptr = EPOLL_TAG_TIMER;
+			nrst = epoll_ctl(ploop->epoll_fd, EPOLL_CTL_ADD, ploop->timer_fd, &tmpepevent);
+			if (IS_BSDFUNC_ERROR(nrst))
+				return -errno;
+		}
+
+		tmpepevent.data.ptr = EPOLL_TAG_USERTIMER;
+		nrst = epoll_ctl(ploop->epoll_fd, EPOLL_CTL_ADD, ploop->usertimer_fd, &tmpepevent);
+		if (IS_BSDFUNC_ERROR(nrst))
+			return -errno;
+
+		tmpepevent.data.ptr = EPOLL_TAG_ZCLINGER;
+		nrst = epoll_ctl(ploop->epoll_fd, EPOLL_CTL_ADD, ploop->zclinger_fd, &tmpepevent);
+		if (IS_BSDFUNC_ERROR(nrst))
+			return -errno;
+
+		return 1;
+	}
+
+	int ServerContext::wakeupLoop(EventLoop *ploop)
+	{
+		uint64_t value = 1;
+		if (ploop->wakeup_fd == INVALID_FD)
+			return 0;
+		if (IS_BSDFUNC_ERROR(::write(ploop->wakeup_fd, &value, sizeof(value))))
+			return -errno;
+		return 1;
+	}
+
+	int ServerContext::listenShard(EventLoop *ploop, const struct sockaddr *psockaddr, int sockaddrlen, int sizeOfListenQueue)
+	{
+		int retval = 0;
+		int nrst;
+
+		int nvalue;
+
+		nvalue = 1;
+		nrst = setsockopt(ploop->listen_fd, SOL_SOCKET, SO_REUSEADDR, &nvalue, sizeof(nvalue));
+
+		// Before listen(): the window scale of a connection follows the listener's SO_RCVBUF
+		applySocketOptions(ploop->listen_fd);
+
+		do
+		{
+			if (m_options.topology == TOPOLOGY_SHARDED_REUSEPORT)
+			{
+				nvalue = 1;
+				nrst = setsockopt(ploop->listen_fd, SOL_SOCKET, SO_REUSEPORT, &nvalue, sizeof(nvalue));
+				if (IS_SOCKET_ERROR(nrst))
+				{
+					retval = -errno;
+					break;
+				}
+			}
+
+			nrst = bind(ploop->listen_fd, psockaddr, sockaddrlen);
+			if (IS_SOCKET_ERROR(nrst))
+			{
+				retval = -errno;
+				break;
+			}
+
+			nrst = ::listen(ploop->listen_fd, sizeOfListenQueue);
+			if (IS_SOCKET_ERROR(nrst))
+			{
+				retval = -errno;
+				break;
+			}
+
+			retval = armListener(ploop);
+		} while (0);
+
+		return retval;
+	}
+
+	int ServerContext::armListener(EventLoop *ploop)
+	{
+		struct epoll_event tmpepevent;
+
+		// Served by the acceptor threads or by the workers' rings, not by epoll
+		if ((m_options.topology == TOPOLOGY_ACCEPTOR) || (m_options.backend == BACKEND_IO_URING))
+			return 1;
+
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLIN | EPOLLONESHOT;
+		tmpepevent.data.ptr = EPOLL_TAG_LISTENER;
+
+		if (IS_BSDFUNC_ERROR(epoll_ctl(ploop->epoll_fd, EPOLL_CTL_ADD, ploop->listen_fd, &tmpepevent)))
+			return -errno;
+
+		return 1;
+	}
+
+	static int setSockOptInt(int sock, int level, int optname, int value)
+	{
+		if (setsockopt(sock, level, optname, (char *)&value, sizeof(value)) < 0)
+			return -errno;
+		return 1;
+	}
+
+	int ServerContext::applySocketOptions(int sock)
+	{
+		const SocketOptions &sockopts = m_options.socketOptions;
+		int retval = 1;
+		int nrst;
+		struct timeval timeout_tv;
+
+		memset(&timeout_tv, 0, sizeof(timeout_tv));
+		timeout_tv.tv_sec = sockopts.recvTimeoutMs / 1000;
+		timeout_tv.tv_usec = (sockopts.recvTimeoutMs % 1000) * 1000;
+		if(unlikely((nrst = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_tv, sizeof(timeout_tv))) < 0))
+		{
+			retval = -errno;
+			if(m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_RCVTIMEO) failed: %d", retval);
+		}
+
+		timeout_tv.tv_sec = sockopts.sendTimeoutMs / 1000;
+		timeout_tv.tv_usec = (sockopts.sendTimeoutMs % 1000) * 1000;
+		if(unlikely((nrst = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_tv, sizeof(timeout_tv))) < 0))
+		{
+			retval = -errno;
+			if(m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_SNDTIMEO) failed: %d", retval);
+		}
+
+		if(unlikely((nrst = setSockOptInt(sock, SOL_SOCKET, SO_KEEPALIVE, sockopts.bKeepAlive ? 1 : 0)) < 0))
+		{
+			retval = nrst;
+			if(m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_KEEPALIVE) failed: %d", nrst);
+		}
+
+		if (sockopts.bKeepAlive)
+		{
+			if(unlikely((nrst = setSockOptInt(sock, SOL_TCP, TCP_KEEPIDLE, sockopts.keepIdleSec)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(TCP_KEEPIDLE) failed: %d", nrst);
+			}
+			if(unlikely((nrst = setSockOptInt(sock, SOL_TCP, TCP_KEEPCNT, sockopts.keepCnt)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(TCP_KEEPCNT) failed: %d", nrst);
+			}
+			if(unlikely((nrst = setSockOptInt(sock, SOL_TCP, TCP_KEEPINTVL, sockopts.keepIntvlSec)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(TCP_KEEPINTVL) failed: %d", nrst);
+			}
+		}
+
+		if (sockopts.bNoDelay)
+		{
+			if(unlikely((nrst = setSockOptInt(sock, SOL_TCP, TCP_NODELAY, 1)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(TCP_NODELAY) failed: %d", nrst);
+			}
+		}
+
+		if (sockopts.userTimeoutMs > 0)
+		{
+			if(unlikely((nrst = setSockOptInt(sock, SOL_TCP, TCP_USER_TIMEOUT, sockopts.userTimeoutMs)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(TCP_USER_TIMEOUT) failed: %d", nrst);
+			}
+		}
+
+		if (sockopts.recvBufSize > 0)
+		{
+			if(unlikely((nrst = setSockOptInt(sock, SOL_SOCKET, SO_RCVBUF, sockopts.recvBufSize)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_RCVBUF) failed: %d", nrst);
+			}
+		}
+
+		if (sockopts.sendBufSize > 0)
+		{
+			if(unlikely((nrst = setSockOptInt(sock, SOL_SOCKET, SO_SNDBUF, sockopts.sendBufSize)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_SNDBUF) failed: %d", nrst);
+			}
+		}
+
+#ifdef SO_BUSY_POLL
+		if (m_options.sockBusyPollUs > 0)
+		{
+			if(unlikely((nrst = setSockOptInt(sock, SOL_SOCKET, SO_BUSY_POLL, m_options.sockBusyPollUs)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_BUSY_POLL) failed: %d", nrst);
+			}
+#ifdef SO_PREFER_BUSY_POLL
+			if(unlikely((nrst = setSockOptInt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1)) < 0))
+			{
+				retval = nrst;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[applySocketOptions] setsockopt(SO_PREFER_BUSY_POLL) failed: %d", nrst);
+			}
+#endif
+		}
+#endif
+
+		return retval;
+	}
+
+	static bool readFirstLine(const char *szPath, char *pbuf, int size)
+	{
+		FILE *fp = fopen(szPath, "r");
+		bool bread;
+		if (fp == NULL)
+			return false;
+		bread = (fgets(pbuf, size, fp) != NULL);
+		fclose(fp);
+		return bread;
+	}
+
+	// "0-3,8,10-11" as in /sys/devices/system/node/node*/cpulist
+	static void parseCpuList(const char *str, std::vector<int> &list)
+	{
+		while (*str != '\0')
+		{
+			char *pend;
+			long first = strtol(str, &pend, 10);
+			long last = first;
+			if (pend == str)
+				break;
+			str = pend;
+			if (*str == '-')
+			{
+				last = strtol(str + 1, &pend, 10);
+				str = pend;
+			}
+			for (; first <= last; first++)
+				list.push_back((int)first);
+			if (*str != ',')
+				break;
+			str++;
+		}
+	}
+
+	// The CPUs this process may run on, grouped by NUMA node. One group without NUMA information.
+	static void getNodeCpus(std::vector< std::vector<int> > &nodes)
+	{
+		cpu_set_t allowed;
+		char buf[1024];
+		std::vector<int> nodeids;
+		std::vector<int> cpus;
+		size_t i, j;
+
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return;
+
+		if (readFirstLine("/sys/devices/system/node/online", buf, sizeof(buf)))
+			parseCpuList(buf, nodeids);
+		for (i = 0; i < nodeids.size(); i++)
+		{
+			char path[128];
+			std::vector<int> nodecpus;
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodeids[i]);
+			cpus.clear();
+			if (readFirstLine(path, buf, sizeof(buf)))
+				parseCpuList(buf, cpus);
+			for (j = 0; j < cpus.size(); j++)
+			{
+				if ((cpus[j] < CPU_SETSIZE) && CPU_ISSET(cpus[j], &allowed))
+					nodecpus.push_back(cpus[j]);
+			}
+			// Memory-only nodes have no CPUs
+			if (!nodecpus.empty())
+				nodes.push_back(nodecpus);
+		}
+
+		if (nodes.empty())
+		{
+			std::vector<int> allcpus;
+			for (i = 0; i < CPU_SETSIZE; i++)
+			{
+				if (CPU_ISSET(i, &allowed))
+					allcpus.push_back((int)i);
+			}
+			if (!allcpus.empty())
+				nodes.push_back(allcpus);
+		}
+	}
+
+	int ServerContext::planWorkerPlacement(int numOfthreads, const WorkerPlacement *pplacement)
+	{
+		std::vector< std::vector<int> > nodes;
+		std::vector<int> order;
+		size_t i, n;
+
+		m_worker_cpus.clear();
+		m_worker_cpus.resize(numOfthreads);
+
+		if ((pplacement == NULL) || (pplacement->policy == PLACEMENT_NONE) || (numOfthreads == 0))
+			return 1;
+
+		if (pplacement->policy == PLACEMENT_CPUSET)
+		{
+			if (pplacement->cpus.empty())
+				return 0;
+			for (i = 0; i < (size_t)numOfthreads; i++)
+				m_worker_cpus[i].push_back(pplacement->cpus[i % pplacement->cpus.size()]);
+			return 1;
+		}
+
+		getNodeCpus(nodes);
+		if (nodes.empty())
+			return 0;
+
+		switch (pplacement->policy)
+		{
+		case PLACEMENT_COMPACT:
+			for (n = 0; n < nodes.size(); n++)
+				order.insert(order.end(), nodes[n].begin(), nodes[n].end());
+			break;
+		case PLACEMENT_SPREAD:
+			for (i = 0; order.size() < (size_t)CPU_SETSIZE; i++)
+			{
+				size_t before = order.size();
+				for (n = 0; n < nodes.size(); n++)
+				{
+					if (i < nodes[n].size())
+						order.push_back(nodes[n][i]);
+				}
+				if (order.size() == before)
+					break;
+			}
+			break;
+		case PLACEMENT_NUMA_NODE:
+			for (i = 0; i < (size_t)numOfthreads; i++)
+				m_worker_cpus[i] = nodes[i % nodes.size()];
+			return 1;
+		default:
+			return 0;
+		}
+
+		// More workers than cores wrap around
+		for (i = 0; i < (size_t)numOfthreads; i++)
+			m_worker_cpus[i].push_back(order[i % order.size()]);
+		return 1;
+	}
+
+	int ServerContext::startWorkers(int numOfthreads, const WorkerPlacement *pplacement)
+	{
+		int i;
+		int nrst;
+		size_t n;
+
+		uint64_t ns = 0;
+
+		if(numOfthreads < 0)
+			return 0;
+
+		// In the sharded topology every shard needs at least one worker, otherwise
+		// connections hashed onto its SO_REUSEPORT listener would never be accepted.
+		if(m_loops.empty() || (numOfthreads < (int)m_loops.size()))
+			return 0;
+
+		if((nrst = planWorkerPlacement(numOfthreads, pplacement)) <= 0)
+			return nrst;
+
+		if(m_options.topology == TOPOLOGY_ACCEPTOR)
+		{
+			if((numOfthreads == 0) || (m_options.numOfAcceptors <= 0) || (m_options.handoffQueueSize <= 0))
+				return 0;
+
+			// Every worker owns its epoll instance; loop 0 also holds the listening socket
+			while((int)m_loops.size() < numOfthreads)
+			{
+				EventLoop *ploop = new EventLoop((int)m_loops.size());
+				m_loops.push_back(ploop);
+				nrst = openLoop(ploop, false);
+				if(nrst <= 0)
+					return nrst;
+			}
+
+			try {
+				for(std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
+				{
+					while((int)(*iter)->handoffqueues.size() < m_options.numOfAcceptors)
+						(*iter)->handoffqueues.push_back(new JsCPPUtils::SPSCQueue<AcceptedClient>(m_options.handoffQueueSize));
+				}
+			} catch (std::bad_alloc& e) {
+				return -ENOMEM;
+			}
+		}
+
+		if(m_options.backend == BACKEND_IO_URING)
+		{
+			// A ring takes submissions from one thread only, so every worker gets its
+			// own loop. The extra loops accept from the existing listeners in turn.
+			size_t numoflisteners = m_loops.size();
+			while((int)m_loops.size() < numOfthreads)
+			{
+				EventLoop *ploop = new EventLoop((int)m_loops.size());
+				m_loops.push_back(ploop);
+				nrst = openLoop(ploop, false);
+				if(nrst <= 0)
+					return nrst;
+				ploop->accept_fd = m_loops[ploop->index % numoflisteners]->listen_fd;
+			}
+		}
+
+		m_worker_numofthreads = numOfthreads;
+		m_worker_batchstats.clear();
+		m_worker_batchstats.resize(numOfthreads);
+
+		for(i=0; i<numOfthreads; i++)
+			m_loops[i % m_loops.size()]->numofworkers++;
+
+		for(i=0; i<numOfthreads; i++)
+		{
+			JsCPPUtils::SmartPointer< JsCPPUtils::JsThread::ThreadContext > spThreadCtx;
+			nrst = JsCPPUtils::JsThread::start(&spThreadCtx, workerThreadProc, i, this);
+			if(nrst <= 0)
+			{
+				// ERROR
+			}else{
+				m_worker_threads.push_back(spThreadCtx);
+			}
+		}
+
+		if(m_options.topology == TOPOLOGY_ACCEPTOR)
+		{
+			m_acceptor_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(m_acceptor_wakeup_fd < 0)
+			{
+				m_acceptor_wakeup_fd = INVALID_FD;
+				return -errno;
+			}
+
+			for(i=0; i<m_options.numOfAcceptors; i++)
+			{
+				JsCPPUtils::SmartPointer< JsCPPUtils::JsThread::ThreadContext > spThreadCtx;
+				nrst = JsCPPUtils::JsThread::start(&spThreadCtx, acceptorThreadProc, i, this);
+				if(nrst <= 0)
+				{
+					// ERROR
+				}else{
+					m_acceptor_threads.push_back(spThreadCtx);
+				}
+			}
+		}
+
+		return 1;
+	}
+
+	ServerContext::EventLoop *ServerContext::getCurrentLoop()
+	{
+		if ((s_pcurrentworker != NULL) && (s_pcurrentworker->pServerCtx == this))
+			return s_pcurrentworker->ploop;
+		return m_loops.empty() ? NULL : m_loops[0];
+	}
+
+	void ServerContext::workerThreadProc_CleanUp(void *param)
+	{
+		WorkerThreadInternalContext *pmyctx = (WorkerThreadInternalContext*)param;
+		s_pcurrentworker = NULL;
+		pmyctx->clientreleased.clear();
+		pmyctx->clientpool.clear();
+		if(pmyctx->precvbuf != NULL)
+		{
+			free(pmyctx->precvbuf);
+			pmyctx->precvbuf = NULL;
+		}
+		if(pmyctx->paccepted != NULL)
+		{
+			free(pmyctx->paccepted);
+			pmyctx->paccepted = NULL;
+		}
+		if(pmyctx->pepevents != NULL)
+		{
+			free(pmyctx->pepevents);
+			pmyctx->pepevents = NULL;
+		}
+		if(pmyctx->pServerCtx->m_stopworkerhandler != NULL && pmyctx->inited_userhandler)
+		{
+			pmyctx->pServerCtx->m_stopworkerhandler(pmyctx->pServerCtx, pmyctx->threadidx, pmyctx->pthreaduserctx);
+			pmyctx->inited_userhandler = false;
+		}
+	}
+
+	int ServerContext::workerThreadProc(JsCPPUtils::JsThread::ThreadContext *pThreadCtx, int threadindex, void *threadparam)
+	{
+		ServerContext *pServerCtx = (ServerContext*)threadparam;
+		WorkerThreadInternalContext myctx(pServerCtx, threadindex, threadparam);
+
+		int threadrunrst;
+		int nrst;
+		int neno;
+
+		int epnum;
+		int epi;
+		int batchsize = pServerCtx->m_options.epollBatchSize;
+		int64_t spinuntil = 0;
+		struct epoll_event *epevents;
+
+		myctx.ploop = pServerCtx->m_loops[threadindex % pServerCtx->m_loops.size()];
+		myctx.pbatchstats = &pServerCtx->m_worker_batchstats[threadindex].stats;
+		myctx.pbatchstats->curBatchSize = batchsize;
+		s_pcurrentworker = &myctx;
+
+		if((threadindex < (int)pServerCtx->m_worker_cpus.size()) && !pServerCtx->m_worker_cpus[threadindex].empty())
+		{
+			const std::vector<int> &cpus = pServerCtx->m_worker_cpus[threadindex];
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			for(std::vector<int>::const_iterator iter = cpus.begin(); iter != cpus.end(); iter++)
+			{
+				if((*iter >= 0) && (*iter < CPU_SETSIZE))
+					CPU_SET(*iter, &cpuset);
+			}
+			// Pin before anything is allocated, so that first touch places it on this worker's node
+			if((nrst = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) != 0)
+			{
+				if(pServerCtx->m_plogger != NULL)
+					pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_WARNING, "[server_workerthreadproc] worker %d affinity not applied: %d", threadindex, nrst);
+			}
+		}
+
+		if(pServerCtx->m_options.workerSchedPriority > 0)
+		{
+			struct sched_param schedparam;
+			memset(&schedparam, 0, sizeof(schedparam));
+			schedparam.sched_priority = pServerCtx->m_options.workerSchedPriority;
+			if((nrst = pthread_setschedparam(pthread_self(), SCHED_FIFO, &schedparam)) != 0)
+			{
+				// Without CAP_SYS_NICE the worker keeps running under the default policy
+				if(pServerCtx->m_plogger != NULL)
+					pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_WARNING, "[server_workerthreadproc] SCHED_FIFO priority %d not applied: %d", schedparam.sched_priority, nrst);
+			}
+		}
+
+		if(pServerCtx->m_startworkerposthandler != NULL)
+		{
+			if((nrst = pServerCtx->m_startworkerposthandler(pServerCtx, threadindex, &myctx.pthreaduserctx)) <= 0)
+			{
+				goto EXIT_STARTERR1;
+			}
+			myctx.inited_userhandler = true;
+		}
+
+		pthread_cleanup_push(workerThreadProc_CleanUp, &myctx);
+
+		myctx.precvbuf = (char*)malloc(pServerCtx->m_conf_recvdatabufsize);
+		myctx.paccepted = (AcceptedClient*)malloc(sizeof(AcceptedClient) * pServerCtx->m_options.acceptBatchSize);
+		myctx.pepevents = (struct epoll_event*)malloc(sizeof(struct epoll_event) * pServerCtx->m_options.epollBatchMax);
+		epevents = myctx.pepevents;
+
+		if((myctx.precvbuf == NULL) || (myctx.paccepted == NULL) || (myctx.pepevents == NULL))
+		{
+			goto EXIT_STARTERR2;
+		}
+
+		// Fault the pages in from this thread, on the node it now runs on
+		memset(myctx.precvbuf, 0, pServerCtx->m_conf_recvdatabufsize);
+		memset(myctx.paccepted, 0, sizeof(AcceptedClient) * pServerCtx->m_options.acceptBatchSize);
+		memset(myctx.pepevents, 0, sizeof(struct epoll_event) * pServerCtx->m_options.epollBatchMax);
+
+		if(pServerCtx->workerFillClientPool(&myctx) < 0)
+		{
+			if(pServerCtx->m_plogger != NULL)
+				pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] worker %d client pool allocation failed", threadindex);
+			goto EXIT_STARTERR2;
+		}
+
+		if(myctx.ploop->puring != NULL)
+		{
+			pServerCtx->workerRunUring(&myctx, pThreadCtx);
+			goto EXIT_STARTERR2;
+		}
+
+		while(likely((threadrunrst = pThreadCtx->_inthread_isRun()) == 1))
+		{
+			// While busy-polling, a zero timeout keeps the thread on its core instead of sleeping
+			epnum = epoll_wait(myctx.ploop->epoll_fd, epevents, batchsize, (spinuntil != 0) ? 0 : -1);
+			if (epnum == 0)
+			{
+				if (JsCPPUtils::Common::getMicroTickCount() >= spinuntil)
+					spinuntil = 0;
+			}
+			else if (epnum < 0)
+			{
+				// Error
+				neno = errno;
+				if (neno != EINTR)
+				{
+					if(pServerCtx->m_plogger != NULL)
+						pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] epoll_wait failed: %d", neno);
+					break;
+				}
+			}
+			else
+			{
+				// One clock read for the whole batch: receive stamps, idle checks, timers and log lines use it
+				JsCPPUtils::Common::refreshCachedClock();
+
+				myctx.pbatchstats->numOfWaits++;
+				myctx.pbatchstats->numOfEvents += epnum;
+				if (epnum > myctx.pbatchstats->maxEvents)
+					myctx.pbatchstats->maxEvents = epnum;
+				if (epnum == batchsize)
+					myctx.pbatchstats->numOfSaturated++;
+
+				for (epi = 0; epi < epnum; epi++)
+				{
+					if (epevents[epi].data.ptr == EPOLL_TAG_WAKEUP)
+					{
+						// Leave the counter set while stopping so every worker of a shared loop wakes up
+						if (pThreadCtx->_inthread_isRun() == 1)
+						{
+							uint64_t value;
+							while (::read(myctx.ploop->wakeup_fd, &value, sizeof(value)) > 0);
+							if (!myctx.ploop->handoffqueues.empty())
+								pServerCtx->workerProcessHandoff(&myctx);
+							if (unlikely(myctx.ploop->drainaccept == 1))
+								pServerCtx->workerAcceptBacklog(&myctx);
+							if (unlikely(pServerCtx->m_drainphase == DRAIN_TEARDOWN))
+								pServerCtx->workerDrainBatch(&myctx);
+						}
+					}
+					else if (epevents[epi].data.ptr == EPOLL_TAG_LISTENER)
+					{
+						pServerCtx->workerAcceptBatch(&myctx);
+					}
+					else if (epevents[epi].data.ptr == EPOLL_TAG_TIMER)
+					{
+						// Of the workers sharing the loop, the one whose read succeeds runs the tick
+						uint64_t value;
+						if (::read(myctx.ploop->timer_fd, &value, sizeof(value)) > 0)
+							pServerCtx->workerCheckIdle(&myctx);
+					}
+					else if (epevents[epi].data.ptr == EPOLL_TAG_USERTIMER)
+					{
+						uint64_t value;
+						if (::read(myctx.ploop->usertimer_fd, &value, sizeof(value)) > 0)
+							pServerCtx->workerRunTimers(&myctx);
+					}
+					else if (epevents[epi].data.ptr == EPOLL_TAG_ZCLINGER)
+					{
+						pServerCtx->workerReapLinger(myctx.ploop);
+					}
+					else if (EPOLL_CLIENTDATA_IS(epevents[epi].data.u64))
+					{
+						// A client deleted since the wait is not found, nor is the next one in its slot
+						JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+						if (pServerCtx->m_clients.find(EPOLL_CLIENTDATA_INDEX(epevents[epi].data.u64), &spclientctx) &&
+							(spclientctx->m_sockfd == EPOLL_CLIENTDATA_FD(epevents[epi].data.u64)))
+							pServerCtx->workerProcessClient(&myctx, spclientctx.getPtr(), epevents[epi].events);
+					}
+				}
+
+				if (!myctx.corkedclients.empty())
+					pServerCtx->workerFlushCorked(&myctx);
+				if (!myctx.clientreleased.empty())
+					pServerCtx->workerRecycleClients(&myctx);
+
+				if (pServerCtx->m_options.bAdaptiveBatch)
+				{
+					// A full batch means more was ready. A mostly empty one shrinks the batch back,
+					// so that one worker of a shared loop does not take events the others could serve.
+					if ((epnum == batchsize) && (batchsize < pServerCtx->m_options.epollBatchMax))
+					{
+						batchsize *= 2;
+						if (batchsize > pServerCtx->m_options.epollBatchMax)
+							batchsize = pServerCtx->m_options.epollBatchMax;
+					}
+					else if ((epnum <= batchsize / 4) && (batchsize > pServerCtx->m_options.epollBatchSize))
+					{
+						batchsize /= 2;
+						if (batchsize < pServerCtx->m_options.epollBatchSize)
+							batchsize = pServerCtx->m_options.epollBatchSize;
+					}
+					myctx.pbatchstats->curBatchSize = batchsize;
+				}
+
+				if (pServerCtx->m_options.busyPollUs > 0)
+					spinuntil = JsCPPUtils::Common::getMicroTickCount() + pServerCtx->m_options.busyPollUs;
+			}
+		}
+
+	EXIT_STARTERR2:
+		pthread_cleanup_pop(1);
+
+	EXIT_STARTERR1:
+		s_pcurrentworker = NULL;
+		return 0;
+	}
+
+	bool ServerContext::isOverloaded()
+	{
+		return (m_conf_numOfMaxClients > 0) && (m_numofclients >= m_conf_numOfMaxClients);
+	}
+
+	// ploop: the epoll loop whose listener stays disarmed, NULL from an acceptor thread.
+	// Returns false if clients left in the meantime and accepting goes on.
+	bool ServerContext::pauseAccept(EventLoop *ploop)
+	{
+		if (ploop != NULL)
+			ploop->listenpaused = 1;
+		m_acceptpaused = 1;
+		__sync_synchronize();
+		if (isOverloaded())
+			return true;
+		// A clientDel between the check and the flags did not see them
+		resumeAccept();
+		return false;
+	}
+
+	void ServerContext::resumeAccept()
+	{
+		int neno;
+		struct epoll_event tmpepevent;
+
+		if (m_drainphase != DRAIN_NONE)
+			return;
+		if (!__sync_bool_compare_and_swap(&m_acceptpaused, 1, 0))
+			return;
+
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLIN | EPOLLONESHOT;
+		tmpepevent.data.ptr = EPOLL_TAG_LISTENER;
+		for (std::vector<EventLoop*>::iterator iter = m_loops.begin(); iter != m_loops.end(); iter++)
+		{
+			EventLoop *ploop = *iter;
+			if (!__sync_bool_compare_and_swap(&ploop->listenpaused, 1, 0))
+				continue;
+			if (unlikely(epoll_ctl(ploop->epoll_fd, EPOLL_CTL_MOD, ploop->listen_fd, &tmpepevent) < 0))
+			{
+				neno = errno;
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[resumeAccept] listen socket epoll_ctl_mod failed: %d", neno);
+			}
+		}
+
+		// The acceptors re-add their listener when the doorbell rings
+		if (m_acceptor_wakeup_fd != INVALID_FD)
+		{
+			uint64_t value = 1;
+			::write(m_acceptor_wakeup_fd, &value, sizeof(value));
+		}
+	}
+
+	void ServerContext::releaseAdmission()
+	{
+		__sync_fetch_and_sub(&m_numofclients, 1);
+		if (unlikely(m_acceptpaused) && !isOverloaded())
+			resumeAccept();
+	}
+
+	void ServerContext::idleTrack(EventLoop *ploop, ClientContext *pclientctx)
+	{
+		if (m_options.idleTimeoutMs <= 0)
+			return;
+		ploop->idlelock.lock();
+		ploop->idlewheel.add(&pclientctx->m_idlenode, pclientctx->m_last_recvedtime + m_options.idleTimeoutMs);
+		ploop->idlelock.unlock();
+	}
+
+	void ServerContext::idleUntrack(ClientContext *pclientctx)
+	{
+		EventLoop *ploop;
+		if (m_options.idleTimeoutMs <= 0)
+			return;
+		ploop = m_loops[pclientctx->m_loopidx];
+		ploop->idlelock.lock();
+		ploop->idlewheel.remove(&pclientctx->m_idlenode);
+		ploop->idlelock.unlock();
+	}
+
+	int ServerContext::workerCheckIdle(WorkerThreadInternalContext *pmyctx)
+	{
+		EventLoop *ploop = pmyctx->ploop;
+		int64_t now = JsCPPUtils::Common::getCachedTickCount();
+		TimerWheelNode *pnode;
+		int numofevicted = 0;
+
+		// The receive path only stamps m_last_recvedtime. A client that was heard from since it
+		// was filed goes back in at its new deadline, only the others are collected.
+		ploop->idlelock.lock();
+		pnode = ploop->idlewheel.advance(now);
+		while (pnode != NULL)
+		{
+			TimerWheelNode *pnext = pnode->next;
+			ClientContext *pclientctx = (ClientContext*)pnode->pdata;
+			if ((now - pclientctx->m_last_recvedtime) >= m_options.idleTimeoutMs)
+				pmyctx->idleexpired.push_back(pclientctx->m_index);
+			else
+				ploop->idlewheel.add(pnode, pclientctx->m_last_recvedtime + m_options.idleTimeoutMs);
+			pnode = pnext;
+		}
+		ploop->idlelock.unlock();
+
+		// By index: once the wheel lock is released the client may be deleted by another worker
+		for (std::vector<int>::iterator iter = pmyctx->idleexpired.begin(); iter != pmyctx->idleexpired.end(); iter++)
+		{
+			JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+			if (!m_clients.find(*iter, &spclientctx) || (spclientctx->lockandcheck() != 1))
+				continue;
+			if ((now - spclientctx->m_last_recvedtime) >= m_options.idleTimeoutMs)
+			{
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[workerCheckIdle] Client[%d] idle for %d ms", spclientctx->m_index, (int)(now - spclientctx->m_last_recvedtime));
+				clientDel(spclientctx.getPtr());
+				numofevicted++;
+			}
+			else
+			{
+				idleTrack(ploop, spclientctx.getPtr());
+				spclientctx->unlock();
+			}
+		}
+		pmyctx->idleexpired.clear();
+
+		return numofevicted;
+	}
+
+	// Under the loop's timerlock
+	void ServerContext::armUserTimer(EventLoop *ploop, bool barm)
+	{
+		struct itimerspec tmpitimer;
+		int64_t tickms = ploop->timerwheel.getTickMs();
+
+		if (ploop->busertimerarmed == barm)
+			return;
+		memset(&tmpitimer, 0, sizeof(tmpitimer));
+		if (barm)
+		{
+			tmpitimer.it_interval.tv_sec = tickms / 1000;
+			tmpitimer.it_interval.tv_nsec = (tickms % 1000) * 1000000;
+			tmpitimer.it_value = tmpitimer.it_interval;
+		}
+		if (timerfd_settime(ploop->usertimer_fd, 0, &tmpitimer, NULL) == 0)
+			ploop->busertimerarmed = barm;
+	}
+
+	int ServerContext::timerSchedule(ClientContext *pClientCtx, int delayMs, int periodMs, Client_TimerHandler_t handler, void *param)
+	{
+		EventLoop *ploop;
+		ClientTimer *ptimer;
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+		int timerid;
+
+		if ((pClientCtx == NULL) || (handler == NULL) || (delayMs < 0))
+			return -EINVAL;
+		// The timer keeps the client alive until it is taken off
+		if (!m_clients.find(pClientCtx->m_index, &spclientctx) || (spclientctx.getPtr() != pClientCtx))
+			return -ENOENT;
+
+		try
+		{
+			ptimer = new ClientTimer();
+		}catch (std::bad_alloc& ex){
+			return -ENOMEM;
+		}
+		do {
+			timerid = __sync_add_and_fetch(&m_timerseq, 1) & 0x7fffffff;
+		} while (timerid == 0);
+		ptimer->spclientctx = spclientctx;
+		ptimer->id = timerid;
+		ptimer->periodms = periodMs;
+		ptimer->handler = handler;
+		ptimer->param = param;
+
+		ploop = m_loops[pClientCtx->m_loopidx];
+		ploop->timerlock.lock();
+		if (!pClientCtx->m_isUsable)
+		{
+			ploop->timerlock.unlock();
+			delete ptimer;
+			return -ENOTCONN;
+		}
+		ptimer->pnext = pClientCtx->m_ptimers;
+		pClientCtx->m_ptimers = ptimer;
+		ploop->timerwheel.add(&ptimer->node, JsCPPUtils::Common::getTickCount() + delayMs);
+		armUserTimer(ploop, true);
+		ploop->timerlock.unlock();
+
+		return timerid;
+	}
+
+	int ServerContext::timerCancel(ClientContext *pClientCtx, int timerid)
+	{
+		EventLoop *ploop;
+		ClientTimer *ptimer;
+		ClientTimer *pfree = NULL;
+		int retval = 0;
+
+		if (pClientCtx == NULL)
+			return -EINVAL;
+
+		ploop = m_loops[pClientCtx->m_loopidx];
+		ploop->timerlock.lock();
+		for (ptimer = pClientCtx->m_ptimers; ptimer != NULL; ptimer = ptimer->pnext)
+		{
+			if (ptimer->id == timerid)
+				break;
+		}
+		if (ptimer != NULL)
+		{
+			unlinkClientTimer(ptimer);
+			if (ptimer->state == ClientTimer::STATE_FIRING)
+			{
+				ptimer->state = ClientTimer::STATE_CANCELLED;
+			}
+			else
+			{
+				ploop->timerwheel.remove(&ptimer->node);
+				pfree = ptimer;
+				retval = 1;
+			}
+		}
+		ploop->timerlock.unlock();
+
+		// Outside the lock: it may drop the last reference to the client
+		if (pfree != NULL)
+			delete pfree;
+
+		return retval;
+	}
+
+	void ServerContext::timerCancelAll(ClientContext *pclientctx)
+	{
+		EventLoop *ploop = m_loops[pclientctx->m_loopidx];
+		ClientTimer *ptimer;
+		ClientTimer *pfree = NULL;
+
+		ploop->timerlock.lock();
+		ptimer = pclientctx->m_ptimers;
+		pclientctx->m_ptimers = NULL;
+		while (ptimer != NULL)
+		{
+			ClientTimer *pnext = ptimer->pnext;
+			if (ptimer->state == ClientTimer::STATE_FIRING)
+			{
+				ptimer->state = ClientTimer::STATE_CANCELLED;
+				ptimer->pnext = NULL;
+			}
+			else
+			{
+				ploop->timerwheel.remove(&ptimer->node);
+				ptimer->pnext = pfree;
+				pfree = ptimer;
+			}
+			ptimer = pnext;
+		}
+		ploop->timerlock.unlock();
+
+		while (pfree != NULL)
+		{
+			ptimer = pfree->pnext;
+			delete pfree;
+			pfree = ptimer;
+		}
+	}
+
+	int ServerContext::workerRunTimers(WorkerThreadInternalContext *pmyctx)
+	{
+		EventLoop *ploop = pmyctx->ploop;
+		TimerWheelNode *pnode;
+		int numoffired;
+
+		ploop->timerlock.lock();
+		pnode = ploop->timerwheel.advance(JsCPPUtils::Common::getCachedTickCount());
+		while (pnode != NULL)
+		{
+			ClientTimer *ptimer = (ClientTimer*)pnode->pdata;
+			pnode = pnode->next;
+			ptimer->state = ClientTimer::STATE_FIRING;
+			pmyctx->timersfired.push_back(ptimer);
+		}
+		ploop->timerlock.unlock();
+
+		for (std::vector<ClientTimer*>::iterator iter = pmyctx->timersfired.begin(); iter != pmyctx->timersfired.end(); iter++)
+		{
+			ClientTimer *ptimer = *iter;
+			ClientContext *pclientctx = ptimer->spclientctx.getPtr();
+			bool bfree = false;
+			int procrst = 1;
+
+			// ptimer keeps the context alive. A client another worker deleted meanwhile has
+			// released its lock and is unusable; an event for it elsewhere no longer finds it.
+			if (pclientctx->lockandcheck() == 1)
+			{
+				if (ptimer->state == ClientTimer::STATE_FIRING)
+					procrst = ptimer->handler(this, pmyctx->pthreaduserctx, pclientctx, ptimer->id, ptimer->param);
+				// clientDel cancels the client's timers, this one included, and releases the lock
+				if (procrst >= 1)
+					pclientctx->unlock();
+				else
+					clientDel(pclientctx);
+			}
+
+			ploop->timerlock.lock();
+			// Deleting the client marks it cancelled under this lock; the client itself is not locked here
+			if ((ptimer->state == ClientTimer::STATE_FIRING) && (ptimer->periodms > 0))
+			{
+				ptimer->state = ClientTimer::STATE_ARMED;
+				ploop->timerwheel.add(&ptimer->node, JsCPPUtils::Common::getCachedTickCount() + ptimer->periodms);
+				armUserTimer(ploop, true);
+			}
+			else
+			{
+				if (ptimer->state != ClientTimer::STATE_CANCELLED)
+					unlinkClientTimer(ptimer);
+				bfree = true;
+			}
+			ploop->timerlock.unlock();
+
+			if (bfree)
+				delete ptimer;
+		}
+		numoffired = (int)pmyctx->timersfired.size();
+		pmyctx->timersfired.clear();
+
+		ploop->timerlock.lock();
+		if (ploop->timerwheel.size() == 0)
+			armUserTimer(ploop, false);
+		ploop->timerlock.unlock();
+
+		return numoffired;
+	}
+
+	// Closes the loop's clients DRAIN_BATCH_SIZE at a time through clientDel(): a normal shutdown,
+	// so each peer reads what was already written and then a FIN
+	int ServerContext::workerDrainBatch(WorkerThreadInternalContext *pmyctx)
+	{
+		EventLoop *ploop = pmyctx->ploop;
+		std::vector< JsCPPUtils::SmartPointer<ClientContext> > batch;
+		bool bmore;
+
+		ploop->drainlock.lock();
+		// Refilled while the loop still counts clients, for those added since the last walk
+		if (ploop->drainlist.empty() && (ploop->numofclients > 0))
+		{
+			for (int shardidx = 0; shardidx < m_clients.getNumOfShards(); shardidx++)
+			{
+				std::vector< JsCPPUtils::SmartPointer<ClientContext> > clients;
+				m_clients.getShardClients(shardidx, &clients);
+				for (std::vector< JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = clients.begin(); iter != clients.end(); iter++)
+				{
+					if ((*iter)->m_loopidx == ploop->index)
+						ploop->drainlist.push_back(*iter);
+				}
+			}
+		}
+		while (!ploop->drainlist.empty() && ((int)batch.size() < DRAIN_BATCH_SIZE))
+		{
+			batch.push_back(ploop->drainlist.back());
+			ploop->drainlist.pop_back();
+		}
+		bmore = !ploop->drainlist.empty();
+		ploop->drainlock.unlock();
+
+		for (std::vector< JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = batch.begin(); iter != batch.end(); iter++)
+		{
+			if ((*iter)->lockandcheck() == 1)
+				clientDel(iter->getPtr());
+		}
+
+		// The next batch waits behind the events that are already pending
+		if (bmore || (!batch.empty() && (ploop->numofclients > 0)))
+			wakeupLoop(ploop);
+
+		return (int)batch.size();
+	}
+
+	int ServerContext::workerFillClientPool(WorkerThreadInternalContext *pmyctx)
+	{
+		int i;
+
+		try
+		{
+			// Reserved for the full pool, so that neither list grows later
+			pmyctx->clientpool.reserve(m_options.clientPoolSize);
+			pmyctx->clientreleased.reserve(m_options.clientPoolSize);
+			for (i = 0; i < m_options.clientPoolSize; i++)
+			{
+				JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+				spclientctx = new ClientContext(this, -1, INVALID_SOCKET, NULL, NULL);
+				spclientctx->m_isUsable = false;
+				pmyctx->clientpool.push_back(spclientctx);
+			}
+		}catch (std::bad_alloc& ex){
+			return -ENOMEM;
+		}
+
+		return 1;
+	}
+
+	void ServerContext::workerRecycleClients(WorkerThreadInternalContext *pmyctx)
+	{
+		size_t i;
+		size_t numofkept = 0;
+
+		// clientDel() has let go of the lock, and an event names a client by its index, which the
+		// next client in the slot does not share. One that is referenced elsewhere (a timer being
+		// fired, a thread waiting for its lock) waits until it is let go.
+		for (i = 0; i < pmyctx->clientreleased.size(); i++)
+		{
+			JsCPPUtils::SmartPointer<ClientContext> &spclientctx = pmyctx->clientreleased[i];
+			if (spclientctx.getRefCount() == 1)
+			{
+				pmyctx->clientpool.push_back(spclientctx);
+			}
+			else
+			{
+				pmyctx->clientreleased[numofkept++] = spclientctx;
+			}
+		}
+		pmyctx->clientreleased.resize(numofkept);
+	}
+
+	void ServerContext::workerFlushCorked(WorkerThreadInternalContext *pmyctx)
+	{
+		size_t i;
+		int nrst;
+
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+		ClientContext *pclientctx;
+
+		// A client deleted since it was corked is not found, or its socket is already closed
+		for (i = 0; i < pmyctx->corkedclients.size(); i++)
+		{
+			if (!m_clients.find(pmyctx->corkedclients[i], &spclientctx))
+				continue;
+			pclientctx = spclientctx.getPtr();
+			if (pclientctx->lockandcheck() != 1)
+				continue;
+
+			pclientctx->m_bcorked = false;
+			nrst = pclientctx->flushOutput();
+			if (unlikely(nrst < 0))
+			{
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] output flush failed: %d", pclientctx->m_index, nrst);
+				clientDel(pclientctx);
+				continue;
+			}
+			if (nrst == 0)
+				clientArmOutput(pclientctx);
+			pclientctx->unlock();
+		}
+		pmyctx->corkedclients.clear();
+	}
+
+	void ServerContext::rejectSocket(int sock)
+	{
+		struct linger lingeropt;
+		lingeropt.l_onoff = 1;
+		lingeropt.l_linger = 0;
+		setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&lingeropt, sizeof(lingeropt));
+		::closesocket(sock);
+	}
+
+	int ServerContext::workerAcceptBatch(WorkerThreadInternalContext *pmyctx)
+	{
+		int neno;
+		int i;
+		int numofaccepted = 0;
+		bool bpaused = false;
+		struct epoll_event tmpepevent;
+		AcceptedClient *pclient;
+
+		// drain() took the listener off; workerAcceptBacklog() empties it once
+		if (unlikely(m_drainphase != DRAIN_NONE))
+			return 0;
+
+		// Drain the backlog up to the budget before handing anything off
+		while (numofaccepted < m_options.acceptBatchSize)
+		{
+			socklen_t clientaddrsize;
+			int clientsock;
+
+			if (unlikely(isOverloaded()) && (m_options.overloadPolicy == OVERLOAD_PAUSE_ACCEPT))
+			{
+				bpaused = pauseAccept(pmyctx->ploop);
+				if (bpaused)
+					break;
+			}
+
+			pclient = &pmyctx->paccepted[numofaccepted];
+			clientaddrsize = sizeof(pclient->addr);
+			clientsock = accept4(pmyctx->ploop->listen_fd, (struct sockaddr *)&pclient->addr, &clientaddrsize, getAcceptFlags());
+			if (clientsock == INVALID_SOCKET)
+			{
+				neno = errno;
+				if ((neno == EINTR) || (neno == ECONNABORTED))
+					continue;
+				if ((neno != EAGAIN) && (neno != EWOULDBLOCK))
+				{
+					if (m_plogger != NULL)
+						m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client accept failed: %d", neno);
+				}
+				break;
+			}
+			pclient->sock = clientsock;
+			numofaccepted++;
+		}
+
+		// Re-arm first so that other workers of a shared loop can take the rest of the backlog.
+		// A paused listener is re-armed by resumeAccept() instead.
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLIN | EPOLLONESHOT;
+		tmpepevent.data.ptr = EPOLL_TAG_LISTENER;
+
+		if (!bpaused && (m_drainphase == DRAIN_NONE) && unlikely(epoll_ctl(pmyctx->ploop->epoll_fd, EPOLL_CTL_MOD, pmyctx->ploop->listen_fd, &tmpepevent) < 0))
+		{
+			// Error
+			neno = errno;
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] listen socket epoll_ctl_mod failed: %d", neno);
+		}
+
+		for (i = 0; i < numofaccepted; i++)
+		{
+			workerAcceptClient(pmyctx, &pmyctx->paccepted[i]);
+		}
+
+		return numofaccepted;
+	}
+
+	int ServerContext::workerAcceptClient(WorkerThreadInternalContext *pmyctx, AcceptedClient *pclient)
+	{
+		int procrst;
+
+		// Checked before the accept handler and any TLS work is spent on the connection
+		if (unlikely(isOverloaded()))
+		{
+			rejectSocket(pclient->sock);
+			return 0;
+		}
+
+		if (likely(m_accepthandler != NULL))
+		{
+			procrst = m_accepthandler(this, pmyctx->pthreaduserctx, pclient->sock, &pclient->addr);
+		}
+		else
+		{
+			procrst = clientAdd(pclient->sock, &pclient->addr, NULL, NULL);
+		}
+		if (procrst <= 0)
+		{
+			::closesocket(pclient->sock);
+		}
+
+		return procrst;
+	}
+
+	int ServerContext::workerAcceptBacklog(WorkerThreadInternalContext *pmyctx)
+	{
+		AcceptedClient client;
+		socklen_t clientaddrsize;
+		int numofaccepted = 0;
+		int neno;
+
+		// One worker of the loop, once; the others and a later wakeup find it taken
+		if (!__sync_bool_compare_and_swap(&pmyctx->ploop->drainaccept, 1, 2))
+			return 0;
+
+		while (1)
+		{
+			clientaddrsize = sizeof(client.addr);
+			client.sock = accept4(pmyctx->ploop->accept_fd, (struct sockaddr *)&client.addr, &clientaddrsize, getAcceptFlags());
+			if (client.sock == INVALID_SOCKET)
+			{
+				neno = errno;
+				if ((neno == EINTR) || (neno == ECONNABORTED))
+					continue;
+				if ((neno != EAGAIN) && (neno != EWOULDBLOCK))
+				{
+					if (m_plogger != NULL)
+						m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[drain] client accept failed: %d", neno);
+				}
+				break;
+			}
+			workerAcceptClient(pmyctx, &client);
+			numofaccepted++;
+		}
+
+		__sync_synchronize();
+		pmyctx->ploop->drainaccept = 0;
+		if ((numofaccepted > 0) && (m_plogger != NULL))
+			m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[drain] %d queued connections accepted", numofaccepted);
+		return numofaccepted;
+	}
+
+	int ServerContext::workerProcessHandoff(WorkerThreadInternalContext *pmyctx)
+	{
+		int count = 0;
+		AcceptedClient client;
+
+		for (std::vector< JsCPPUtils::SPSCQueue<AcceptedClient>* >::iterator iter = pmyctx->ploop->handoffqueues.begin(); iter != pmyctx->ploop->handoffqueues.end(); iter++)
+		{
+			while ((*iter)->pop(&client))
+			{
+				__sync_fetch_and_sub(&pmyctx->ploop->numofqueued, 1);
+				workerAcceptClient(pmyctx, &client);
+				count++;
+			}
+		}
+
+		return count;
+	}
+
+	ServerContext::EventLoop *ServerContext::handoffClient(int acceptoridx, const AcceptedClient *pclient, unsigned int *prrcounter)
+	{
+		size_t numofloops = m_loops.size();
+		size_t first;
+		size_t i;
+
+		if (m_options.acceptorBalance == BALANCE_LEAST_CONNECTIONS)
+		{
+			int minload = 0;
+			first = 0;
+			for (i = 0; i < numofloops; i++)
+			{
+				int load = m_loops[i]->numofclients + m_loops[i]->numofqueued;
+				if ((i == 0) || (load < minload))
+				{
+					minload = load;
+					first = i;
+				}
+			}
+		}
+		else
+		{
+			first = (*prrcounter)++ % numofloops;
+		}
+
+		// A full queue means that worker is behind; give the connection to the next one
+		for (i = 0; i < numofloops; i++)
+		{
+			EventLoop *ploop = m_loops[(first + i) % numofloops];
+			__sync_fetch_and_add(&ploop->numofqueued, 1);
+			if (ploop->handoffqueues[acceptoridx]->push(*pclient))
+				return ploop;
+			__sync_fetch_and_sub(&ploop->numofqueued, 1);
+		}
+
+		return NULL;
+	}
+
+	void ServerContext::acceptorThreadProc_CleanUp(void *param)
+	{
+		int *pepfd = (int*)param;
+		if (*pepfd != INVALID_FD)
+		{
+			::close(*pepfd);
+			*pepfd = INVALID_FD;
+		}
+	}
+
+	static int addAcceptorListener(int epfd, int listen_fd)
+	{
+		struct epoll_event tmpepevent;
+		int nrst;
+
+		// EPOLLEXCLUSIVE keeps several acceptors from all waking up for one connection
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLIN | EPOLLEXCLUSIVE;
+		tmpepevent.data.ptr = EPOLL_TAG_LISTENER;
+		nrst = epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &tmpepevent);
+		if ((nrst < 0) && (errno == EINVAL))
+		{
+			tmpepevent.events = EPOLLIN;
+			nrst = epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &tmpepevent);
+		}
+		return nrst;
+	}
+
+	int ServerContext::acceptorThreadProc(JsCPPUtils::JsThread::ThreadContext *pThreadCtx, int acceptoridx, void *threadparam)
+	{
+		ServerContext *pServerCtx = (ServerContext*)threadparam;
+		int listen_fd = pServerCtx->m_loops[0]->listen_fd;
+		int epfd = INVALID_FD;
+		int nrst;
+		int neno;
+		int epnum;
+		unsigned int rrcounter = (unsigned int)acceptoridx;
+		bool bpaused = false;
+		bool bdraining = false;
+		struct epoll_event tmpepevent;
+		struct epoll_event epevents[2];
+		std::vector<bool> touched(pServerCtx->m_loops.size(), false);
+
+		pthread_cleanup_push(acceptorThreadProc_CleanUp, &epfd);
+
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+		{
+			neno = errno;
+			if (pServerCtx->m_plogger != NULL)
+				pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_acceptorthreadproc] epoll_create failed: %d", neno);
+			goto EXIT_STARTERR;
+		}
+
+		nrst = addAcceptorListener(epfd, listen_fd);
+		if (nrst < 0)
+		{
+			neno = errno;
+			if (pServerCtx->m_plogger != NULL)
+				pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_acceptorthreadproc] listen socket epoll_ctl_add failed: %d", neno);
+			goto EXIT_STARTERR;
+		}
+
+		// Edge-triggered: every write reaches every acceptor once, and nobody has to read the counter
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLIN | EPOLLET;
+		tmpepevent.data.ptr = EPOLL_TAG_WAKEUP;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pServerCtx->m_acceptor_wakeup_fd, &tmpepevent) < 0)
+		{
+			neno = errno;
+			if (pServerCtx->m_plogger != NULL)
+				pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_acceptorthreadproc] wakeup epoll_ctl_add failed: %d", neno);
+			goto EXIT_STARTERR;
+		}
+
+		while (likely(pThreadCtx->_inthread_isRun() == 1))
+		{
+			int numofaccepted = 0;
+			size_t i;
+
+			epnum = epoll_wait(epfd, epevents, 2, -1);
+			if (epnum < 0)
+			{
+				neno = errno;
+				if (neno != EINTR)
+				{
+					if (pServerCtx->m_plogger != NULL)
+						pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_acceptorthreadproc] epoll_wait failed: %d", neno);
+					break;
+				}
+				continue;
+			}
+
+			if (unlikely(pServerCtx->m_drainphase != DRAIN_NONE))
+			{
+				// drain(): the listener is taken off and what is queued on it accepted once below;
+				// after that only the doorbell is left to wake this thread
+				if (bdraining)
+					continue;
+				epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+				bdraining = true;
+				bpaused = false;
+				if (pServerCtx->m_listenexported)
+				{
+					__sync_fetch_and_sub(&pServerCtx->m_drainacceptors, 1);
+					continue;
+				}
+			}
+
+			if (bpaused)
+			{
+				if (pServerCtx->isOverloaded())
+					continue;
+				if (addAcceptorListener(epfd, listen_fd) < 0)
+				{
+					neno = errno;
+					if (pServerCtx->m_plogger != NULL)
+						pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_acceptorthreadproc] listen socket epoll_ctl_add failed: %d", neno);
+					continue;
+				}
+				bpaused = false;
+			}
+
+			while (bdraining || (numofaccepted < pServerCtx->m_options.acceptBatchSize))
+			{
+				AcceptedClient client;
+				socklen_t clientaddrsize = sizeof(client.addr);
+				EventLoop *ploop;
+
+				if (!bdraining && unlikely(pServerCtx->isOverloaded()) && (pServerCtx->m_options.overloadPolicy == OVERLOAD_PAUSE_ACCEPT))
+				{
+					// Taken off this acceptor's epoll, put back after the doorbell from resumeAccept()
+					epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+					bpaused = true;
+					pServerCtx->pauseAccept(NULL);
+					break;
+				}
+
+				client.sock = accept4(listen_fd, (struct sockaddr *)&client.addr, &clientaddrsize, pServerCtx->getAcceptFlags());
+				if (client.sock == INVALID_SOCKET)
+				{
+					neno = errno;
+					if ((neno == EINTR) || (neno == ECONNABORTED))
+						continue;
+					if ((neno != EAGAIN) && (neno != EWOULDBLOCK))
+					{
+						if (pServerCtx->m_plogger != NULL)
+							pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_acceptorthreadproc] client accept failed: %d", neno);
+					}
+					break;
+				}
+				numofaccepted++;
+
+				if (unlikely(pServerCtx->isOverloaded()))
+				{
+					rejectSocket(client.sock);
+					continue;
+				}
+
+				ploop = pServerCtx->handoffClient(acceptoridx, &client, &rrcounter);
+				if (ploop == NULL)
+				{
+					if (pServerCtx->m_plogger != NULL)
+						pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_WARNING, "[server_acceptorthreadproc] all handoff queues are full, connection dropped");
+					::closesocket(client.sock);
+					continue;
+				}
+				touched[ploop->index] = true;
+			}
+
+			// One doorbell per worker per batch
+			for (i = 0; i < touched.size(); i++)
+			{
+				if (touched[i])
+				{
+					pServerCtx->wakeupLoop(pServerCtx->m_loops[i]);
+					touched[i] = false;
+				}
+			}
+			if (unlikely(bdraining))
+				__sync_fetch_and_sub(&pServerCtx->m_drainacceptors, 1);
+		}
+
+	EXIT_STARTERR:
+		pthread_cleanup_pop(1);
+		return 0;
+	}
+
+	int ServerContext::workerProcessClient(WorkerThreadInternalContext *pmyctx, ClientContext *pclientctx, uint32_t readyevents)
+	{
+		int nrst;
+		int neno = 0;
+		int ecnt;
+		int recvlen = 0;
+		int procrst = 0;
+		int procpass = 0;
+		uint32_t clientevents;
+		bool bdrain = m_options.bEdgeTriggered;
+		bool bread = true;
+		bool bwantout;
+
+		struct epoll_event tmpepevent;
+
+		if (unlikely((nrst = pclientctx->lockandcheck()) != 1))
+			return nrst;
+
+		clientevents = getClientEpollEvents(pmyctx->ploop);
+		pmyctx->pactiveclient = pclientctx;
+
+		if (readyevents & EPOLLOUT)
+		{
+			if (unlikely((nrst = pclientctx->flushOutput()) < 0))
+			{
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] output flush failed: %d", pclientctx->m_index, nrst);
+				pmyctx->pactiveclient = NULL;
+				clientDel(pclientctx);
+				return nrst;
+			}
+		}
+
+		if (readyevents & EPOLLERR)
+		{
+			// MSG_ZEROCOPY completions; a socket error is left to the read below
+			if ((pclientctx->m_poutq != NULL) && (pclientctx->reapZeroCopy() > 0) && !(readyevents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+				readyevents &= ~EPOLLERR;
+		}
+
+		if ((readyevents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) == 0)
+		{
+			// Only writable, or only completions: re-armed below, nothing to read
+			bread = false;
+			procpass = 1;
+		}
+		else if ((m_bUseSSL > 0) && (pclientctx->m_sslstate == 1))
+		{
+#ifdef USE_OPENSSL
+			ecnt = 5;
+			do
+			{
+				int sslerr = 0;
+			
+				nrst = SSL_accept(pclientctx->m_ssl);
+				if (nrst != 1)
+				{
+					neno = errno;
+					sslerr = SSL_get_error(pclientctx->m_ssl, nrst);
+					switch (sslerr)
+					{
+					case SSL_ERROR_SSL:
+						procpass = -1;
+						break;
+					case SSL_ERROR_WANT_READ:
+					case SSL_ERROR_WANT_WRITE:
+						neno = EAGAIN;
+						procpass = 1;
+						break;
+					case SSL_ERROR_SYSCALL:
+						if (neno == EINTR)
+							break;
+						procpass = -1;
+						break;
+					default:
+						procpass = -1;
+					}
+				}
+				else
+				{
+					pclientctx->m_sslstate = 2;
+					procrst = 1;
+				}
+				ecnt--;
+			} while ((ecnt > 0) && (nrst != 1) && (procpass == 0));
+#endif
+			// A level-triggered socket is reported again if data is already waiting,
+			// an edge-triggered one is not, so read it right after the handshake.
+			bread = bdrain && (procpass == 0) && (procrst == 1);
+		}
+
+		if (bread)
+		{
+			do
+			{
+				ecnt = 5;
+				do
+				{
+					if (m_bUseSSL)
+					{
+						int sslerr = 0;
+#ifdef USE_OPENSSL
+						recvlen = SSL_read(pclientctx->m_ssl, pmyctx->precvbuf, m_conf_recvdatabufsize);
+						if (recvlen < 0)
+						{
+							neno = errno;
+							sslerr = SSL_get_error(pclientctx->m_ssl, recvlen);
+							switch (sslerr)
+							{
+							case SSL_ERROR_SSL:
+								ERR_print_errors_fp(stderr);
+								procpass = -1;
+								break;
+							case SSL_ERROR_WANT_READ:
+							case SSL_ERROR_WANT_WRITE:
+								neno = EAGAIN;
+								procpass = 1;
+								break;
+							case SSL_ERROR_SYSCALL:
+								if (neno == EINTR)
+									break;
+								procpass = -1;
+								break;
+							default:
+								procpass = -1;
+							}
+						}
+#else
+						recvlen = -1;
+						break;
+#endif
+					} else {
+						recvlen = recv(pclientctx->m_sockfd, pmyctx->precvbuf, m_conf_recvdatabufsize, 0);
+						if (IS_BSDFUNC_ERROR(recvlen))
+						{
+							neno = errno;
+							switch (neno)
+							{
+							case EINTR:
+								break;
+							case EAGAIN:
+								procpass = 1;
+								break;
+							default:
+								procpass = -1;
+							}
+						}
+					}
+					ecnt--;
+				} while ((ecnt > 0) && (recvlen < 0) && (procpass == 0));
+				
+				if (procpass == 0)
+				{
+					if (recvlen <= 0)
+					{
+						if (recvlen < 0)
+							if (m_plogger != NULL)
+								m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] recvlen=%d, eno=%d", pclientctx->m_index, recvlen, neno);
+						procrst = recvlen;
+					} else {
+						pclientctx->m_last_recvedtime = JsCPPUtils::Common::getCachedTickCount();
+						if (likely(m_recvhandler != NULL))
+							procrst = m_recvhandler(this, pmyctx->pthreaduserctx, pclientctx, recvlen, pmyctx->precvbuf);
+						else
+							procrst = 1;
+						if (procrst < 0)
+							if (m_plogger != NULL)
+								m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] recvproc=%d", pclientctx->m_index, procrst);
+						// A short plain read means the socket buffer was emptied, and anything
+						// arriving afterwards raises a new edge, so the EAGAIN read can be skipped.
+						// Not after a hangup: a FIN that came with the data raises no edge of its
+						// own, and only the next read returns the 0 that closes the client.
+						if (bdrain && !m_bUseSSL && (recvlen < m_conf_recvdatabufsize) && !(readyevents & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+							procpass = 1;
+					}
+				}
+			} while (bdrain && (procpass == 0) && (procrst >= 1));
+		}
+			
+		pmyctx->pactiveclient = NULL;
+		if ((procpass == 1) || (procrst >= 1))
+		{
+			// Output queued by the handler, or still left, waits for EPOLLOUT
+			bwantout = (pclientctx->getQueuedOutput() > 0) && (pclientctx->m_sslstate != 1);
+			// Corked output is written when the batch is done; what already waited keeps waiting
+			if (pclientctx->m_bcorked)
+				bwantout = pclientctx->m_boutarmed;
+			if ((clientevents & EPOLLONESHOT) || (bwantout != pclientctx->m_boutarmed))
+			{
+				memset(&tmpepevent, 0, sizeof(tmpepevent));
+				tmpepevent.events = clientevents | (bwantout ? (uint32_t)EPOLLOUT : 0);
+				tmpepevent.data.u64 = EPOLL_CLIENTDATA(pclientctx->m_sockfd, pclientctx->m_index);
+
+				if (unlikely(epoll_ctl(pmyctx->ploop->epoll_fd, EPOLL_CTL_MOD, pclientctx->m_sockfd, &tmpepevent) < 0))
+				{
+					// Error
+					neno = -errno;
+					if (m_plogger != NULL)
+						m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] server socket epoll_ctl_mod failed: %d", neno);
+					procrst = neno;
+				}
+				pclientctx->m_boutarmed = bwantout;
+			}
+			
+			pclientctx->unlock();
+		} else {
+			clientDel(pclientctx);
+		}
+
+		return procrst;
+	}
+
+	int ServerContext::workerRunUring(WorkerThreadInternalContext *pmyctx, JsCPPUtils::JsThread::ThreadContext *pThreadCtx)
+	{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+		EventLoop *ploop = pmyctx->ploop;
+		IoUring *pring = ploop->puring;
+		struct io_uring_cqe *pcqe;
+		unsigned int head;
+		int numofcqes;
+		int nrst;
+		int64_t spinuntil = 0;
+		bool bpending = true;
+		bool bacceptcancelled = false;
+
+		if (ploop->accept_fd != INVALID_SOCKET)
+			pring->prepAccept(ploop->accept_fd, true, URING_USERDATA(URING_TAG_ACCEPT, 0, 0));
+		pring->prepRead(ploop->wakeup_fd, &ploop->wakeupvalue, sizeof(ploop->wakeupvalue), URING_USERDATA(URING_TAG_WAKEUP, 0, 0));
+		if (ploop->timer_fd != INVALID_FD)
+			pring->prepRead(ploop->timer_fd, &ploop->timervalue, sizeof(ploop->timervalue), URING_USERDATA(URING_TAG_TIMER, 0, 0));
+		pring->prepRead(ploop->usertimer_fd, &ploop->usertimervalue, sizeof(ploop->usertimervalue), URING_USERDATA(URING_TAG_USERTIMER, 0, 0));
+		pring->prepPollAdd(ploop->zclinger_fd, POLLIN, URING_USERDATA(URING_TAG_ZCLINGER, 0, 0));
+
+		while (likely(pThreadCtx->_inthread_isRun() == 1))
+		{
+			if (bpending)
+			{
+				ploop->pendinglock.lock();
+				for (std::vector<uint64_t>::iterator iter = ploop->pendingrecv.begin(); iter != ploop->pendingrecv.end(); iter++)
+				{
+					if (URING_USERDATA_TAG(*iter) == URING_TAG_WRITABLE)
+						pring->prepPollAdd(URING_USERDATA_FD(*iter), POLLOUT, *iter);
+					else if (URING_USERDATA_TAG(*iter) == URING_TAG_ERRQUEUE)
+						pring->prepPollAdd(URING_USERDATA_FD(*iter), POLLERR, *iter);
+					else
+						pring->prepRecv(URING_USERDATA_FD(*iter), m_options.bUringMultishotRecv, *iter);
+				}
+				ploop->pendingrecv.clear();
+				ploop->pendinglock.unlock();
+				bpending = false;
+			}
+
+			// Everything queued while handling the previous batch goes in with this one call.
+			// While busy-polling it returns at once and the completion queue is checked directly.
+			nrst = pring->submitAndWait((spinuntil != 0) ? 0 : 1);
+			if (nrst < 0)
+			{
+				if ((nrst == -EINTR) || (nrst == -EAGAIN) || (nrst == -EBUSY))
+					continue;
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] io_uring_enter failed: %d", nrst);
+				break;
+			}
+			JsCPPUtils::Common::refreshCachedClock();
+
+			head = pring->getCqHead();
+			numofcqes = 0;
+			while ((pcqe = pring->peekCqe(head)) != NULL)
+			{
+				switch (URING_USERDATA_TAG(pcqe->user_data))
+				{
+				case URING_TAG_ACCEPT:
+					if (pcqe->res >= 0)
+					{
+						AcceptedClient client;
+						socklen_t clientaddrsize = sizeof(client.addr);
+						client.sock = pcqe->res;
+						memset(&client.addr, 0, sizeof(client.addr));
+						getpeername(client.sock, (struct sockaddr *)&client.addr, &clientaddrsize);
+						workerAcceptClient(pmyctx, &client);
+					}
+					else if ((pcqe->res != -ECANCELED) && (pcqe->res != -EINTR) && (pcqe->res != -ECONNABORTED) && (m_drainphase == DRAIN_NONE))
+					{
+						if (m_plogger != NULL)
+							m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client accept failed: %d", -pcqe->res);
+					}
+					if (!(pcqe->flags & IORING_CQE_F_MORE) && (m_drainphase == DRAIN_NONE))
+						pring->prepAccept(ploop->accept_fd, true, URING_USERDATA(URING_TAG_ACCEPT, 0, 0));
+					break;
+				case URING_TAG_WAKEUP:
+					if (pThreadCtx->_inthread_isRun() == 1)
+					{
+						pring->prepRead(ploop->wakeup_fd, &ploop->wakeupvalue, sizeof(ploop->wakeupvalue), URING_USERDATA(URING_TAG_WAKEUP, 0, 0));
+						bpending = true;
+						if (unlikely(m_drainphase != DRAIN_NONE) && !bacceptcancelled && (ploop->accept_fd != INVALID_SOCKET))
+						{
+							pring->prepCancel(URING_USERDATA(URING_TAG_ACCEPT, 0, 0), URING_USERDATA(URING_TAG_CANCEL, 0, 0));
+							bacceptcancelled = true;
+						}
+						if (unlikely(ploop->drainaccept == 1))
+							workerAcceptBacklog(pmyctx);
+						if (unlikely(m_drainphase == DRAIN_TEARDOWN))
+							workerDrainBatch(pmyctx);
+					}
+					break;
+				case URING_TAG_TIMER:
+					if (pThreadCtx->_inthread_isRun() == 1)
+					{
+						workerCheckIdle(pmyctx);
+						pring->prepRead(ploop->timer_fd, &ploop->timervalue, sizeof(ploop->timervalue), URING_USERDATA(URING_TAG_TIMER, 0, 0));
+					}
+					break;
+				case URING_TAG_USERTIMER:
+					if (pThreadCtx->_inthread_isRun() == 1)
+					{
+						workerRunTimers(pmyctx);
+						pring->prepRead(ploop->usertimer_fd, &ploop->usertimervalue, sizeof(ploop->usertimervalue), URING_USERDATA(URING_TAG_USERTIMER, 0, 0));
+					}
+					break;
+				case URING_TAG_CANCEL:
+					break;
+				case URING_TAG_WRITABLE:
+					workerUringWritable(pmyctx, pcqe);
+					break;
+				case URING_TAG_ERRQUEUE:
+					workerUringErrQueue(pmyctx, pcqe);
+					break;
+				case URING_TAG_ZCLINGER:
+					if (pThreadCtx->_inthread_isRun() == 1)
+					{
+						workerReapLinger(ploop);
+						pring->prepPollAdd(ploop->zclinger_fd, POLLIN, URING_USERDATA(URING_TAG_ZCLINGER, 0, 0));
+					}
+					break;
+				default:
+					workerUringRecv(pmyctx, pcqe);
+				}
+				head++;
+				numofcqes++;
+			}
+			pring->advanceCq(head);
+
+			if (!pmyctx->corkedclients.empty())
+				workerFlushCorked(pmyctx);
+			if (!pmyctx->clientreleased.empty())
+				workerRecycleClients(pmyctx);
+
+			if (numofcqes == 0)
+			{
+				if ((spinuntil != 0) && (JsCPPUtils::Common::getMicroTickCount() >= spinuntil))
+					spinuntil = 0;
+			}
+			else
+			{
+				if (m_options.busyPollUs > 0)
+					spinuntil = JsCPPUtils::Common::getMicroTickCount() + m_options.busyPollUs;
+				pmyctx->pbatchstats->numOfWaits++;
+				pmyctx->pbatchstats->numOfEvents += numofcqes;
+				if (numofcqes > pmyctx->pbatchstats->maxEvents)
+					pmyctx->pbatchstats->maxEvents = numofcqes;
+			}
+		}
+
+		return 1;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	int ServerContext::workerUringRecv(WorkerThreadInternalContext *pmyctx, const struct io_uring_cqe *pcqe)
+	{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+		IoUring *pring = pmyctx->ploop->puring;
+		int clientidx = URING_USERDATA_INDEX(pcqe->user_data);
+		int clientsock = URING_USERDATA_FD(pcqe->user_data);
+		bool bbuffer = (pcqe->flags & IORING_CQE_F_BUFFER) != 0;
+		unsigned short bid = (unsigned short)(pcqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		int nrst;
+		int procrst = 0;
+
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+		ClientContext *pclientctx;
+
+		// The client may have been deleted while the receive was in flight
+		if (m_clients.find(clientidx, &spclientctx) && (spclientctx->m_sockfd != clientsock))
+			spclientctx = JsCPPUtils::SmartPointer<ClientContext>();
+
+		pclientctx = spclientctx.getPtr();
+		if ((pclientctx == NULL) || ((nrst = pclientctx->lockandcheck()) != 1))
+		{
+			if (bbuffer)
+				pring->recycleBuffer(bid);
+			return 0;
+		}
+
+		if (pcqe->res > 0)
+		{
+			pclientctx->m_last_recvedtime = JsCPPUtils::Common::getCachedTickCount();
+			pmyctx->pactiveclient = pclientctx;
+			if (likely(m_recvhandler != NULL))
+				procrst = m_recvhandler(this, pmyctx->pthreaduserctx, pclientctx, pcqe->res, pring->getBuffer(bid));
+			else
+				procrst = 1;
+			pmyctx->pactiveclient = NULL;
+			if (procrst < 0)
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] recvproc=%d", pclientctx->m_index, procrst);
+		}
+		else if ((pcqe->res == -ENOBUFS) || (pcqe->res == -EINTR) || (pcqe->res == -EAGAIN))
+		{
+			// Every provided buffer was taken, try again once this batch has returned them
+			procrst = 1;
+		}
+		else
+		{
+			if (pcqe->res < 0)
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] recvlen=%d, eno=%d", pclientctx->m_index, -1, -pcqe->res);
+			procrst = pcqe->res;
+		}
+
+		if (bbuffer)
+			pring->recycleBuffer(bid);
+
+		if (procrst >= 1)
+		{
+			if (!(pcqe->flags & IORING_CQE_F_MORE))
+				pring->prepRecv(pclientctx->m_sockfd, m_options.bUringMultishotRecv, pcqe->user_data);
+			// Output the handler queued waits for the socket to become writable
+			if ((pclientctx->getQueuedOutput() > 0) && !pclientctx->m_boutarmed && !pclientctx->m_bcorked && (pclientctx->m_sslstate != 1))
+			{
+				pclientctx->m_boutarmed = true;
+				pring->prepPollAdd(pclientctx->m_sockfd, POLLOUT, URING_USERDATA(URING_TAG_WRITABLE, pclientctx->m_sockfd, pclientctx->m_index));
+			}
+			pclientctx->unlock();
+		} else {
+			clientDel(pclientctx);
+		}
+
+		return procrst;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	int ServerContext::uringArmRecv(EventLoop *ploop, ClientContext *pclientctx)
+	{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+		uint64_t userdata = URING_USERDATA(URING_TAG_RECV, pclientctx->m_sockfd, pclientctx->m_index);
+
+		if ((s_pcurrentworker != NULL) && (s_pcurrentworker->ploop == ploop))
+		{
+			ploop->puring->prepRecv(pclientctx->m_sockfd, m_options.bUringMultishotRecv, userdata);
+			return 1;
+		}
+
+		// Only the loop's worker may touch the ring
+		ploop->pendinglock.lock();
+		ploop->pendingrecv.push_back(userdata);
+		ploop->pendinglock.unlock();
+		return wakeupLoop(ploop);
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	int ServerContext::workerUringWritable(WorkerThreadInternalContext *pmyctx, const struct io_uring_cqe *pcqe)
+	{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+		int clientidx = URING_USERDATA_INDEX(pcqe->user_data);
+		int clientsock = URING_USERDATA_FD(pcqe->user_data);
+		int nrst;
+
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+		ClientContext *pclientctx;
+
+		// The client may have been deleted while the poll was in flight
+		if (!m_clients.find(clientidx, &spclientctx) || (spclientctx->m_sockfd != clientsock))
+			return 0;
+		pclientctx = spclientctx.getPtr();
+		if ((nrst = pclientctx->lockandcheck()) != 1)
+			return nrst;
+
+		pclientctx->m_boutarmed = false;
+		// A poll also completes on POLLERR, which MSG_ZEROCOPY completions raise until read
+		if (pclientctx->m_poutq != NULL)
+			pclientctx->reapZeroCopy();
+		if (unlikely((nrst = pclientctx->flushOutput()) < 0))
+		{
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] output flush failed: %d", pclientctx->m_index, nrst);
+			clientDel(pclientctx);
+			return nrst;
+		}
+		if (nrst == 0)
+		{
+			pclientctx->m_boutarmed = true;
+			pmyctx->ploop->puring->prepPollAdd(clientsock, POLLOUT, pcqe->user_data);
+		}
+		pclientctx->unlock();
+
+		return 1;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	int ServerContext::workerUringErrQueue(WorkerThreadInternalContext *pmyctx, const struct io_uring_cqe *pcqe)
+	{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+		int clientidx = URING_USERDATA_INDEX(pcqe->user_data);
+		int clientsock = URING_USERDATA_FD(pcqe->user_data);
+		int nrst;
+
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
+		ClientContext *pclientctx;
+
+		if (!m_clients.find(clientidx, &spclientctx) || (spclientctx->m_sockfd != clientsock))
+			return 0;
+		pclientctx = spclientctx.getPtr();
+		if ((nrst = pclientctx->lockandcheck()) != 1)
+			return nrst;
+
+		pclientctx->m_bzcpolled = false;
+		if (pclientctx->m_poutq != NULL)
+			pclientctx->reapZeroCopy();
+		// A hung up socket would complete every new poll at once; its receive ends it soon
+		if ((pclientctx->m_poutq != NULL) && pclientctx->m_poutq->hasZeroCopyInFlight() && !(pcqe->res & (POLLHUP | POLLRDHUP)))
+		{
+			pclientctx->m_bzcpolled = true;
+			pmyctx->ploop->puring->prepPollAdd(clientsock, POLLERR, pcqe->user_data);
+		}
+		pclientctx->unlock();
+
+		return 1;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	int ServerContext::uringArmPoll(EventLoop *ploop, ClientContext *pclientctx, int tag)
+	{
+#ifdef JSSERVERSOCKET_HAVE_IO_URING
+		uint64_t userdata = URING_USERDATA(tag, pclientctx->m_sockfd, pclientctx->m_index);
+
+		if ((s_pcurrentworker != NULL) && (s_pcurrentworker->ploop == ploop))
+		{
+			ploop->puring->prepPollAdd(pclientctx->m_sockfd, (tag == URING_TAG_ERRQUEUE) ? POLLERR : POLLOUT, userdata);
+			return 1;
 		}
 
-		return 1;
+		ploop->pendinglock.lock();
+		ploop->pendingrecv.push_back(userdata);
+		ploop->pendinglock.unlock();
+		return wakeupLoop(ploop);
+#else
+		return -ENOTSUP;
+#endif
 	}
 
-	void ServerContext::workerThreadProc_CleanUp(void *param)
+	int ServerContext::clientArmOutput(ClientContext *pclientctx)
 	{
-		WorkerThreadInternalContext *pmyctx = (WorkerThreadInternalContext*)param;
-		if(pmyctx->precvbuf != NULL)
+		EventLoop *ploop;
+		struct epoll_event tmpepevent;
+		int nrst;
+
+		// Already waiting, or the worker handling this client's event arms it once the handler returns
+		if (pclientctx->m_boutarmed || (pclientctx->m_sslstate == 1))
+			return 1;
+		if ((s_pcurrentworker != NULL) && (s_pcurrentworker->pactiveclient == pclientctx))
+			return 1;
+
+		ploop = m_loops[pclientctx->m_loopidx];
+		pclientctx->m_boutarmed = true;
+		if (ploop->puring != NULL)
 		{
-			free(pmyctx->precvbuf);
-			pmyctx->precvbuf = NULL;
+			if ((nrst = uringArmPoll(ploop, pclientctx, URING_TAG_WRITABLE)) < 0)
+				pclientctx->m_boutarmed = false;
+			return nrst;
 		}
-		if(pmyctx->pServerCtx->m_stopworkerhandler != NULL && pmyctx->inited_userhandler)
+
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = getClientEpollEvents(ploop) | EPOLLOUT;
+		tmpepevent.data.u64 = EPOLL_CLIENTDATA(pclientctx->m_sockfd, pclientctx->m_index);
+		if (epoll_ctl(ploop->epoll_fd, EPOLL_CTL_MOD, pclientctx->m_sockfd, &tmpepevent) < 0)
 		{
-			pmyctx->pServerCtx->m_stopworkerhandler(pmyctx->pServerCtx, pmyctx->threadidx, pmyctx->pthreaduserctx);
-			pmyctx->inited_userhandler = false;
+			nrst = -errno;
+			pclientctx->m_boutarmed = false;
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[clientArmOutput] epoll_ctl_mod failed: %d", nrst);
+			return nrst;
 		}
+		return 1;
 	}
 
-	int ServerContext::workerThreadProc(JsCPPUtils::JsThread::ThreadContext *pThreadCtx, int threadindex, void *threadparam)
+	int ServerContext::clientArmZeroCopy(ClientContext *pclientctx)
 	{
-		ServerContext *pServerCtx = (ServerContext*)threadparam;
-		WorkerThreadInternalContext myctx(pServerCtx, threadindex, threadparam);
-
-		int threadrunrst;
+		EventLoop *ploop = m_loops[pclientctx->m_loopidx];
 		int nrst;
-		int neno;
-
-		int epnum;
-		int epi;
-		struct epoll_event tmpepevent;
-		struct epoll_event epevents[16];
 
-		int procrst = 0;
+		// epoll reports EPOLLERR whether it was asked for or not
+		if (ploop->puring == NULL)
+			return 1;
 
-		int ecnt;
+		pclientctx->m_bzcpolled = true;
+		if ((nrst = uringArmPoll(ploop, pclientctx, URING_TAG_ERRQUEUE)) < 0)
+			pclientctx->m_bzcpolled = false;
+		return nrst;
+	}
 
-		int clientsock;
-		struct sockaddr_in clientaddr;
-		socklen_t clientaddrsize;
+	int ServerContext::lingerZeroCopy(ClientContext *pclientctx)
+	{
+		EventLoop *ploop;
+		struct epoll_event tmpepevent;
+		int neno;
 
-		int recvlen;
-		ClientContext *pclientctx;
+		if ((pclientctx->m_loopidx < 0) || (pclientctx->m_loopidx >= (int)m_loops.size()))
+			return 0;
+		ploop = m_loops[pclientctx->m_loopidx];
+		if (ploop->zclinger_fd == INVALID_FD)
+			return 0;
 
-		if(pServerCtx->m_startworkerposthandler != NULL)
+		ploop->zclingerlock.lock();
+		try
 		{
-			if((nrst = pServerCtx->m_startworkerposthandler(pServerCtx, threadindex, &myctx.pthreaduserctx)) <= 0)
-			{
-				goto EXIT_STARTERR1;
-			}
-			myctx.inited_userhandler = true;
+			ploop->zclinger[pclientctx->m_sockfd] = pclientctx->m_poutq;
+		}catch (std::bad_alloc& ex){
+			ploop->zclingerlock.unlock();
+			return -ENOMEM;
 		}
-
-		pthread_cleanup_push(workerThreadProc_CleanUp, &myctx);
-
-		myctx.precvbuf = (char*)malloc(pServerCtx->m_conf_recvdatabufsize);
-
-		if(myctx.precvbuf == NULL)
+		// The error queue raises EPOLLERR, which needs no asking. After shutdown() EPOLLHUP stays
+		// raised too: edge-triggered, only a new completion or state change reports the socket.
+		memset(&tmpepevent, 0, sizeof(tmpepevent));
+		tmpepevent.events = EPOLLET;
+		tmpepevent.data.fd = pclientctx->m_sockfd;
+		if (epoll_ctl(ploop->zclinger_fd, EPOLL_CTL_ADD, pclientctx->m_sockfd, &tmpepevent) < 0)
 		{
-			goto EXIT_STARTERR2;
+			neno = errno;
+			ploop->zclinger.erase(pclientctx->m_sockfd);
+			ploop->zclingerlock.unlock();
+			if (m_plogger != NULL)
+				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[lingerZeroCopy] epoll_ctl_add failed: %d", neno);
+			return -neno;
 		}
+		ploop->zclingerlock.unlock();
+		return 1;
+	}
 
-		while(likely((threadrunrst = pThreadCtx->_inthread_isRun()) == 1))
-		{
-			epnum = epoll_wait(pServerCtx->m_epoll_fd, epevents, 16, 100);
-			if (epnum == 0)
-			{
+	// Any worker of the loop may run it; zclingerlock keeps a socket from being closed under another
+	int ServerContext::workerReapLinger(EventLoop *ploop)
+	{
+		struct epoll_event events[ZCLINGER_EVENTS];
+		int count = 0;
+		int epnum;
+		int i;
 
-			}
-			else if (epnum < 0)
+		ploop->zclingerlock.lock();
+		do {
+			epnum = epoll_wait(ploop->zclinger_fd, events, ZCLINGER_EVENTS, 0);
+			for (i = 0; i < epnum; i++)
 			{
-				// Error
-				neno = errno;
-				if (neno != EINTR)
-				{
-					if(pServerCtx->m_plogger != NULL)
-						pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] epoll_wait failed: %d", neno);
-					break;
-				}
+				std::map<int, OutputQueue*>::iterator iter = ploop->zclinger.find(events[i].data.fd);
+				if (iter == ploop->zclinger.end())
+					continue;
+				ClientContext::reapZeroCopy(iter->first, iter->second);
+				if (iter->second->hasZeroCopyInFlight())
+					continue;
+				// Closing the socket takes it out of zclinger_fd
+				delete iter->second;
+				::closesocket(iter->first);
+				ploop->zclinger.erase(iter);
+				count++;
 			}
-			else
-			{
-				for (epi = 0; epi < epnum; epi++)
-				{
-					if (epevents[epi].data.ptr == NULL)
-					{
-						ecnt = 5;
-						do
-						{
-							clientaddrsize = sizeof(clientaddr);
-							clientsock = accept(pServerCtx->m_sock_fd, (struct sockaddr *)&clientaddr, &clientaddrsize);
-							neno = errno;
-							ecnt--;
-						} while ((ecnt > 0) && ((clientsock == INVALID_SOCKET) && (neno == EINTR)));
+		} while (epnum == ZCLINGER_EVENTS);
+		ploop->zclingerlock.unlock();
 
-						if (unlikely(clientsock == INVALID_SOCKET))
-						{
-							// Error
-							neno = errno;
-							if(pServerCtx->m_plogger != NULL)
-								pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client accept failed: %d", neno);
-							procrst = -1;
-						}
-						else
-						{
-							if (likely(pServerCtx->m_accepthandler != NULL))
-							{
-								procrst = pServerCtx->m_accepthandler(pServerCtx, myctx.pthreaduserctx, clientsock, &clientaddr);	
-							}
-							else
-							{
-								procrst = pServerCtx->clientAdd(clientsock, &clientaddr, NULL, NULL);
-							}
-							if (procrst <= 0)
-							{
-								::closesocket(clientsock);
-							}
-						}
+		return count;
+	}
 
-						memset(&tmpepevent, 0, sizeof(tmpepevent));
-						tmpepevent.events = EPOLLIN | EPOLLONESHOT;
-						tmpepevent.data.ptr = NULL;
+	// At close(), with the workers stopped: the connections still waiting are reset, which frees
+	// what the kernel queued for them, and their completions get a moment to come in. A buffer
+	// the kernel has not given back by then is released anyway.
+	void ServerContext::closeLinger(EventLoop *ploop)
+	{
+		std::map<int, OutputQueue*>::iterator iter;
+		struct sockaddr unspecaddr;
+		int i;
 
-						if (unlikely(epoll_ctl(pServerCtx->m_epoll_fd, EPOLL_CTL_MOD, pServerCtx->m_sock_fd, &tmpepevent) < 0))
-						{
-							// Error
-							neno = errno;
-						}
-					}
-					else
-					{
-						pclientctx = (ClientContext*)(epevents[epi].data.ptr);
-						procrst = 0;
-						
-						if (likely((nrst = pclientctx->lockandcheck()) == 1))
-						{
-							int procpass = 0;
-							
-							if ((pServerCtx->m_bUseSSL > 0) && (pclientctx->m_sslstate == 1))
-							{
-#ifdef USE_OPENSSL
-								ecnt = 5;
-								do
-								{
-									int sslerr = 0;
-								
-									nrst = SSL_accept(pclientctx->m_ssl);
-									if (nrst != 1)
-									{
-										neno = errno;
-										sslerr = SSL_get_error(pclientctx->m_ssl, recvlen);
-										switch (sslerr)
-										{
-										case SSL_ERROR_SSL:
-											procpass = -1;
-											break;
-										case SSL_ERROR_WANT_READ:
-										case SSL_ERROR_WANT_WRITE:
-											neno = EAGAIN;
-											procpass = 1;
-											break;
-										case SSL_ERROR_SYSCALL:
-											if (neno == EINTR)
-												break;
-											procpass = -1;
-											break;
-										default:
-											procpass = -1;
-										}
-									}
-									else
-									{
-										pclientctx->m_sslstate = 2;
-										procrst = 1;
-									}
-									ecnt--;
-								} while ((ecnt > 0) && (nrst != 1) && (procpass == 0));
-#endif
-							} else {
-								ecnt = 5;
-								do
-								{
-									if (pServerCtx->m_bUseSSL)
-									{
-										int sslerr = 0;
-#ifdef USE_OPENSSL
-										recvlen = SSL_read(pclientctx->m_ssl, myctx.precvbuf, pServerCtx->m_conf_recvdatabufsize);
-										if (recvlen < 0)
-										{
-											neno = errno;
-											sslerr = SSL_get_error(pclientctx->m_ssl, recvlen);
-											switch (sslerr)
-											{
-											case SSL_ERROR_SSL:
-												ERR_print_errors_fp(stderr);
-												procpass = -1;
-												break;
-											case SSL_ERROR_WANT_READ:
-											case SSL_ERROR_WANT_WRITE:
-												neno = EAGAIN;
-												procpass = 1;
-												break;
-											case SSL_ERROR_SYSCALL:
-												if (neno == EINTR)
-													break;
-												procpass = -1;
-												break;
-											default:
-												procpass = -1;
-											}
-										}
-#else
-										recvlen = -1;
-										break;
-#endif
-									} else {
-										recvlen = recv(pclientctx->m_sockfd, myctx.precvbuf, pServerCtx->m_conf_recvdatabufsize, 0);
-										if (IS_BSDFUNC_ERROR(recvlen))
-										{
-											neno = errno;
-											switch (neno)
-											{
-											case EINTR:
-												break;
-											case EAGAIN:
-												procpass = 1;
-												break;
-											default:
-												procpass = -1;
-											}
-										}
-									}
-									ecnt--;
-								} while ((ecnt > 0) && (recvlen < 0) && (procpass == 0));
-								
-								if (procpass == 0)
-								{
-									if (recvlen <= 0)
-									{
-										if (recvlen < 0)
-											if (pServerCtx->m_plogger != NULL)
-												pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] recvlen=%d, eno=%d", pclientctx->m_index, recvlen, neno);
-										procrst = recvlen;
-									} else {
-										pclientctx->m_last_recvedtime = JsCPPUtils::Common::getTickCount();
-										if (likely(pServerCtx->m_recvhandler != NULL))
-											procrst = pServerCtx->m_recvhandler(pServerCtx, myctx.pthreaduserctx, pclientctx, recvlen, myctx.precvbuf);
-										else
-											procrst = 1;
-										if (procrst < 0)
-											if (pServerCtx->m_plogger != NULL)
-												pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_INFO, "[server_workerthreadproc] Client[%d] recvproc=%d", pclientctx->m_index, procrst);
-									}
-								}
-							}
-								
-							if ((procpass == 1) || (procrst >= 1))
-							{
-								memset(&tmpepevent, 0, sizeof(tmpepevent));
-								tmpepevent.events = EPOLLIN | EPOLLONESHOT;
-								tmpepevent.data.ptr = pclientctx;
-
-								if (unlikely(epoll_ctl(pServerCtx->m_epoll_fd, EPOLL_CTL_MOD, pclientctx->m_sockfd, &tmpepevent) < 0))
-								{
-									// Error
-									neno = -errno;
-									if (pServerCtx->m_plogger != NULL)
-										pServerCtx->m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] server socket epoll_ctl_mod failed: %d", neno);
-									procrst = neno;
-								}
-								
-								pclientctx->unlock();
-							} else {
-								pServerCtx->clientDel(pclientctx);
-							}
-						}
-					}
+		ploop->zclingerlock.lock();
+		memset(&unspecaddr, 0, sizeof(unspecaddr));
+		unspecaddr.sa_family = AF_UNSPEC;
+		for (iter = ploop->zclinger.begin(); iter != ploop->zclinger.end(); iter++)
+			::connect(iter->first, &unspecaddr, sizeof(unspecaddr));
+		for (i = 0; (i < ZCLINGER_ABORT_WAIT_MS / 10) && !ploop->zclinger.empty(); i++)
+		{
+			for (iter = ploop->zclinger.begin(); iter != ploop->zclinger.end(); )
+			{
+				ClientContext::reapZeroCopy(iter->first, iter->second);
+				if (iter->second->hasZeroCopyInFlight())
+				{
+					iter++;
+					continue;
 				}
+				delete iter->second;
+				::closesocket(iter->first);
+				ploop->zclinger.erase(iter++);
 			}
-			usleep(1);
+			if (!ploop->zclinger.empty())
+				usleep(10000);
+		}
+		for (iter = ploop->zclinger.begin(); iter != ploop->zclinger.end(); iter++)
+		{
+			delete iter->second;
+			::closesocket(iter->first);
 		}
+		ploop->zclinger.clear();
+		ploop->zclingerlock.unlock();
 
-	EXIT_STARTERR2:
-		pthread_cleanup_pop(1);
+		if (ploop->zclinger_fd != INVALID_FD)
+		{
+			::close(ploop->zclinger_fd);
+			ploop->zclinger_fd = INVALID_FD;
+		}
+	}
 
-	EXIT_STARTERR1:
-		return 0;
+	uint32_t ServerContext::getClientEpollEvents(EventLoop *ploop)
+	{
+		if (m_options.bEdgeTriggered)
+		{
+			// A loop served by a single worker owns its connections outright and needs no
+			// re-arming. Loops shared by several workers keep EPOLLONESHOT so that one socket
+			// is never drained by two workers at once.
+			if (ploop->numofworkers <= 1)
+				return EPOLLIN | EPOLLRDHUP | EPOLLET;
+			return EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+		}
+		return EPOLLIN | EPOLLONESHOT;
+	}
+
+	// For accept4(). A level-triggered epoll loop keeps the blocking sockets ClientContext::send()
+	// and recv() have always had; edge-triggered draining and the ring need non-blocking ones.
+	int ServerContext::getAcceptFlags()
+	{
+		if (m_options.bEdgeTriggered || (m_options.backend == BACKEND_IO_URING))
+			return SOCK_NONBLOCK | SOCK_CLOEXEC;
+		return SOCK_CLOEXEC;
 	}
 
 	int ServerContext::getConnections()
 	{
-		int value;
-		m_clients_lock.lock();
-		value = m_clients.size();
-		m_clients_lock.unlock();
-		return value;
+		return m_numofclients;
+	}
+
+	int ServerContext::getNumOfClientShards()
+	{
+		return m_clients.getNumOfShards();
+	}
+
+	int ServerContext::getShardClients(int shardidx, std::vector< JsCPPUtils::SmartPointer<ClientContext> > *plist)
+	{
+		return m_clients.getShardClients(shardidx, plist);
+	}
+
+	int ServerContext::getBatchStats(int threadidx, BatchStats *pstats)
+	{
+		if ((threadidx < 0) || (threadidx >= (int)m_worker_batchstats.size()))
+			return 0;
+		// Read while the worker writes: each field is current, the set is not a snapshot
+		*pstats = m_worker_batchstats[threadidx].stats;
+		return 1;
 	}
 	
 	bool ServerContext::getUseSSL()
@@ -599,6 +3394,11 @@ namespace JsServerSocket
 	}
 
 	int ServerContext::clientAdd(int clientsock, struct sockaddr_in *client_paddr, JsCPPUtils::SmartPointer< ClientContext > *pout_spclientctx, void *userptr)
+	{
+		return clientAddOnLoop(getCurrentLoop(), clientsock, client_paddr, pout_spclientctx, userptr);
+	}
+
+	int ServerContext::clientAddOnLoop(EventLoop *ploop, int clientsock, struct sockaddr_in *client_paddr, JsCPPUtils::SmartPointer< ClientContext > *pout_spclientctx, void *userptr)
 	{
 		int retval = 0;
 
@@ -610,108 +3410,82 @@ namespace JsServerSocket
 		int i;
 
 		int clientidx = -1;
+		bool badmitted = false;
 		JsCPPUtils::SmartPointer< ClientContext > spclientctx;
 
 		int nval;
-		struct timeval timeout_tv;
-
-		memset(&timeout_tv, 0, sizeof(timeout_tv));
-		timeout_tv.tv_sec = 10;
-		timeout_tv.tv_usec = 0;
-
-		if(unlikely((nrst = setsockopt (clientsock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_tv, sizeof(timeout_tv))) < 0))
-		{
-			neno = -errno;
-			if(m_plogger != NULL)
-				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client socket setsockopt(SO_RCVTIMEO) failed: %d", neno);
-		}
-
-		if(unlikely((nrst = setsockopt(clientsock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_tv, sizeof(timeout_tv))) < 0))
-		{
-			neno = -errno;
-			if(m_plogger != NULL)
-				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client socket setsockopt(SO_SNDTIMEO) failed: %d", neno);
-		}
 
-		nval = 1;
-		if(unlikely((nrst = setsockopt(clientsock, SOL_SOCKET, SO_KEEPALIVE, (char *)&nval, sizeof(nval))) < 0))
-		{
-			neno = -errno;
-			if(m_plogger != NULL)
-				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client socket setsockopt(TCP_USER_TIMEOUT) failed: %d", neno);
-		}
-
-		nval = 600;
-		if(unlikely((nrst = setsockopt(clientsock, SOL_TCP, TCP_KEEPIDLE, (char *)&nval, sizeof(nval))) < 0))
-		{
-			neno = -errno;
-			if(m_plogger != NULL)
-				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client socket setsockopt(TCP_USER_TIMEOUT) failed: %d", neno);
-		}
-
-		nval = 6;
-		if(unlikely((nrst = setsockopt(clientsock, SOL_TCP, TCP_KEEPCNT, (char *)&nval, sizeof(nval))) < 0))
-		{
-			neno = -errno;
-			if(m_plogger != NULL)
-				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client socket setsockopt(TCP_USER_TIMEOUT) failed: %d", neno);
-		}
+		// Inherited from the listening socket
+		if (unlikely(m_options.socketOptions.bSetPerConnection))
+			applySocketOptions(clientsock);
 
-		nval = 5;
-		if(unlikely((nrst = setsockopt(clientsock, SOL_TCP, TCP_KEEPINTVL, (char *)&nval, sizeof(nval))) < 0))
+		if (m_options.bEdgeTriggered)
 		{
-			neno = -errno;
-			if(m_plogger != NULL)
-				m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] client socket setsockopt(TCP_USER_TIMEOUT) failed: %d", neno);
+			// Draining until EAGAIN needs a non-blocking socket
+			// (sockets accepted by the workers already are)
+			nval = fcntl(clientsock, F_GETFL, 0);
+			if(unlikely((nval < 0) || (!(nval & O_NONBLOCK) && ((nrst = fcntl(clientsock, F_SETFL, nval | O_NONBLOCK)) < 0))))
+			{
+				neno = -errno;
+				if(m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[clientAdd] client socket fcntl(O_NONBLOCK) failed: %d", neno);
+				return neno;
+			}
 		}
 
 		do
 		{
-			int failcnt = 0;
-			int powval = 10;
+			if (unlikely(ploop == NULL))
+			{
+				retval = -EINVAL;
+				break;
+			}
+
+			// The accept paths turn clients away before this; the counter makes the limit exact
+			badmitted = true;
+			if (unlikely((__sync_add_and_fetch(&m_numofclients, 1) > m_conf_numOfMaxClients) && (m_conf_numOfMaxClients > 0)))
+			{
+				retval = 0;
+				break;
+			}
 			
-			m_clients_lock.lock();
-			m_random_lock.lock();
-			do {
-				std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter;
+			// A worker keeps to its own shard, so its accepts and closes rarely meet another worker's
+			try
+			{
+				clientidx = m_clients.reserve((s_pcurrentworker != NULL) ? s_pcurrentworker->threadidx : ploop->index);
+			}catch (std::bad_alloc& ex){
+				retval = -ENOMEM;
+			}
+			if (unlikely(clientidx < 0))
+			{
+				if (m_plogger != NULL)
+					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[clientAdd] client table full or out of memory: %d", retval);
+				break;
+			}
 
-				clientidx = m_random.nextInt();
-				if(clientidx < 0)
-					clientidx *= -1;
-				if(likely(failcnt < 8))
-				{
-					clientidx = clientidx % powval;
-					powval *= 10;
-				}
-				if (clientidx > 0)
-				{
-					iter = m_clients.find(clientidx);
-					if(unlikely(iter != m_clients.end()))
-					{
-						clientidx = -1;
-						failcnt++;
-					}
-				}
-			}while(clientidx <= 0 && failcnt < 128);
-			m_random_lock.unlock();
-			if(unlikely(failcnt < 128))
+			if ((s_pcurrentworker != NULL) && (s_pcurrentworker->pServerCtx == this) && !s_pcurrentworker->clientpool.empty())
+			{
+				// The context of a client this worker closed before: nothing to allocate
+				spclientctx = s_pcurrentworker->clientpool.back();
+				s_pcurrentworker->clientpool.pop_back();
+				spclientctx->reset(clientidx, clientsock, client_paddr, userptr);
+				spclientctx->m_loopidx = ploop->index;
+			}
+			else
 			{
 				try
 				{
 					spclientctx = new ClientContext(this, clientidx, clientsock, client_paddr, userptr);
-					m_clients[clientidx] = spclientctx;
+					spclientctx->m_loopidx = ploop->index;
 				}catch (std::bad_alloc& ex){
 					neno = -errno;
 					retval = neno;
 					if (m_plogger != NULL)
 						m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[workerthreadproc] Memory allocation failed(new ClientContext): %d", neno);
+					break;
 				}
 			}
-			m_clients_lock.unlock();
-			if (failcnt >= 128 || spclientctx == NULL)
-			{
-				break;
-			}
+			m_clients.set(clientidx, spclientctx);
 			
 #ifdef USE_OPENSSL
 			if (m_bUseSSL)
@@ -769,34 +3543,52 @@ namespace JsServerSocket
 			}
 #endif
 
-			memset(&tmpepevent, 0, sizeof(tmpepevent));
-			tmpepevent.events = EPOLLIN | EPOLLONESHOT;
-			tmpepevent.data.ptr = spclientctx.getPtr();
+			// Before the socket is armed: from then on another worker may delete the client
+			idleTrack(ploop, spclientctx.getPtr());
 
-			if(unlikely((nrst = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, clientsock, &tmpepevent)) < 0))
+			if (ploop->puring != NULL)
 			{
-				// Error
-				neno = -errno;
-				retval = neno;
-				if (m_plogger != NULL)
-					m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] server socket epoll_ctl_mod failed: %d", neno);
-				break;
+				if(unlikely((nrst = uringArmRecv(ploop, spclientctx.getPtr())) < 0))
+				{
+					retval = nrst;
+					if (m_plogger != NULL)
+						m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[clientAdd] client recv submission failed: %d", nrst);
+					break;
+				}
+			}
+			else
+			{
+				memset(&tmpepevent, 0, sizeof(tmpepevent));
+				tmpepevent.events = getClientEpollEvents(ploop);
+				tmpepevent.data.u64 = EPOLL_CLIENTDATA(clientsock, clientidx);
+
+				if(unlikely((nrst = epoll_ctl(ploop->epoll_fd, EPOLL_CTL_ADD, clientsock, &tmpepevent)) < 0))
+				{
+					// Error
+					neno = -errno;
+					retval = neno;
+					if (m_plogger != NULL)
+						m_plogger->printf(JsCPPUtils::Logger::LOGTYPE_ERR, "[server_workerthreadproc] server socket epoll_ctl_mod failed: %d", neno);
+					break;
+				}
 			}
 
+			__sync_fetch_and_add(&ploop->numofclients, 1);
 			retval = 1;
 		} while (0);
 
 		if (retval <= 0)
 		{
+			if (badmitted)
+				releaseAdmission();
 			if (clientidx != -1)
 			{
-				std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = m_clients.find(clientidx);
-				if (likely(iter != m_clients.end()))
+				JsCPPUtils::SmartPointer<ClientContext> spremoved;
+				m_clients.remove(clientidx, &spremoved);
+				if (spremoved.getPtr() != NULL)
 				{
-					m_clients_lock.lock();
-					m_clients[clientidx]->close();
-					m_clients.erase(iter);
-					m_clients_lock.unlock();
+					idleUntrack(spremoved.getPtr());
+					spremoved->close();
 				}
 			}
 		}
@@ -804,6 +3596,9 @@ namespace JsServerSocket
 		{
 			if (pout_spclientctx)
 				*pout_spclientctx = spclientctx;
+			// Handed off or accepted before drain() stopped the listeners
+			if (unlikely(m_drainphase == DRAIN_TEARDOWN))
+				wakeupLoop(ploop);
 		}
 
 		return retval;
@@ -811,66 +3606,35 @@ namespace JsServerSocket
 
 	int ServerContext::clientDel(JsCPPUtils::SmartPointer<ClientContext> spClientCtx)
 	{
-		int retval = 0;
-		
-		m_clients_lock.lock();
-		for (std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = m_clients.begin(); iter != m_clients.end(); iter++)
-		{
-			if (iter->second == spClientCtx)
-			{
-				retval = clientDel(iter);
-				break;
-			}
-		}
-		m_clients_lock.unlock();
-
-		return retval;
+		if (spClientCtx.getPtr() == NULL)
+			return 0;
+		return clientDel(spClientCtx->m_index);
 	}
 
 	int ServerContext::clientDel(ClientContext *pClientCtx)
 	{
-		int retval = 0;
-		
-		m_clients_lock.lock();
-		for (std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter = m_clients.begin(); iter != m_clients.end(); iter++)
-		{
-			if (iter->second == pClientCtx)
-			{
-				retval = clientDel(iter);
-				break;
-			}
-		}
-		m_clients_lock.unlock();
-
-		return retval;
+		if (pClientCtx == NULL)
+			return 0;
+		return clientDel(pClientCtx->m_index);
 	}
 
 	int ServerContext::clientDel(int clientidx)
 	{
 		int retval = 0;
 
-		std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter;
-
-		m_clients_lock.lock();
-		iter = m_clients.find(clientidx);
-		if(iter != m_clients.end())
-		{
-			retval = clientDel(iter);
-		}
-		m_clients_lock.unlock();
-
-		return retval;
-	}
-	
-	int ServerContext::clientDel(std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter)
-	{
-		int retval = 0;
-
 		int nrst;
 		int neno;
 
-		JsCPPUtils::SmartPointer<ClientContext> spclientctx = iter->second;
+		JsCPPUtils::SmartPointer<ClientContext> spclientctx;
 		struct epoll_event tmpepevent;
+		bool bremoved;
+
+		// Only the shard update is serialized, the teardown runs outside its lock
+		bremoved = m_clients.remove(clientidx, &spclientctx);
+		if (!bremoved || (spclientctx.getPtr() == NULL))
+			return 0;
+		idleUntrack(spclientctx.getPtr());
+		timerCancelAll(spclientctx.getPtr());
 		
 		if (m_delhandler)
 		{
@@ -879,9 +3643,10 @@ namespace JsServerSocket
 		
 		memset(&tmpepevent, 0, sizeof(tmpepevent));
 
+		// A receive still queued on a ring ends with the shutdown() in close()
 		tmpepevent.events = EPOLLIN;
-		tmpepevent.data.ptr = spclientctx.getPtr();
-		if ((nrst = epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, spclientctx->m_sockfd, &tmpepevent)) < 0)
+		tmpepevent.data.u64 = EPOLL_CLIENTDATA(spclientctx->m_sockfd, spclientctx->m_index);
+		if ((m_loops[spclientctx->m_loopidx]->puring == NULL) && ((nrst = epoll_ctl(m_loops[spclientctx->m_loopidx]->epoll_fd, EPOLL_CTL_DEL, spclientctx->m_sockfd, &tmpepevent)) < 0))
 		{
 			neno = -errno;
 			retval = neno;
@@ -890,8 +3655,16 @@ namespace JsServerSocket
 		}
 		
 		spclientctx->close();
-
-		m_clients.erase(iter);
+		// Usable no more: a thread waiting in lockandcheck() gets it next and lets it go. Every
+		// level goes, the caller's included; its later unlock() fails as not the owner.
+		spclientctx->unlockAll();
+		__sync_fetch_and_sub(&m_loops[spclientctx->m_loopidx]->numofclients, 1);
+		releaseAdmission();
+
+		// Back to the pool of the deleting worker once its batch is done
+		if ((s_pcurrentworker != NULL) && (s_pcurrentworker->pServerCtx == this) &&
+			((s_pcurrentworker->clientpool.size() + s_pcurrentworker->clientreleased.size()) < (size_t)m_options.clientPoolSize))
+			s_pcurrentworker->clientreleased.push_back(spclientctx);
 
 		return retval;
 	}
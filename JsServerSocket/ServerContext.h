@@ -18,6 +18,7 @@
 
 #include <list>
 #include <map>
+#include <vector>
 
 #include <stdlib.h>
 
@@ -31,17 +32,26 @@
 #endif
 
 #include "../JsCPPUtils/Common.h"
-#include "../JsCPPUtils/RandomWell512.h"
 #include "../JsCPPUtils/JsThread.h"
 #include "../JsCPPUtils/SmartPointer.h"
 #include "../JsCPPUtils/Logger.h"
+#include "../JsCPPUtils/SPSCQueue.h"
 
 #include "ClientContext.h"
+#include "ClientRegistry.h"
+#include "TimerWheel.h"
+
+struct epoll_event;
+struct io_uring_cqe;
 
 namespace JsServerSocket
 {
 	class ClientContext;
+	class IoUring;
+	struct ClientTimer;
 	class ServerContext {
+	friend class ClientContext;
+
 	public:	
 		typedef int(*StartWorkerPostHandler_t)(ServerContext *pserverctx, int threadidx, void **out_pthreaduserctx);
 		typedef void(*StopWorkerHandler_t)(ServerContext *pserverctx, int threadidx, void *pthreaduserctx);
@@ -49,8 +59,261 @@ namespace JsServerSocket
 		typedef int(*Client_AcceptHandler_t)(ServerContext *pServerCtx, void *pthreaduserctx, int client_sock, struct sockaddr_in *client_paddr);
 		typedef int(*Client_RecvHandler_t)(ServerContext *pServerCtx, void *pthreaduserctx, ClientContext *pClientCtx, int recv_len, char *recv_pbuf);
 		typedef void(*Client_DelHandler_t)(ServerContext *pServerCtx, ClientContext *pClientCtx);
+		typedef int(*Client_TimerHandler_t)(ServerContext *pServerCtx, void *pthreaduserctx, ClientContext *pClientCtx, int timerid, void *param);
+		// exportSockets(): writes up to statesize bytes of the client's state and returns the length, or -1 to keep the client here
+		typedef int(*Client_ExportHandler_t)(ServerContext *pServerCtx, ClientContext *pClientCtx, char *pstate, int statesize);
+		// importClients(): restores the state written by the export handler; 0 or less deletes the client
+		typedef int(*Client_ImportHandler_t)(ServerContext *pServerCtx, ClientContext *pClientCtx, const char *pstate, int statelen);
+
+		enum {
+			EXPORT_STATE_MAX = 256 // per-client state passed from exportSockets() to importClients()
+		};
+
+		enum WorkerTopology {
+			TOPOLOGY_SHARED = 0,        // every worker waits on one epoll instance and one listening socket
+			TOPOLOGY_SHARDED_REUSEPORT, // each shard owns an epoll instance and a SO_REUSEPORT listening socket
+			TOPOLOGY_ACCEPTOR           // acceptor threads own the listening socket and hand connections to per-worker epoll instances
+		};
+
+		enum EventBackend {
+			BACKEND_EPOLL = 0,  // readiness: epoll_wait, then recv, then re-arm
+			BACKEND_IO_URING    // completion: accept and recv are queued on a per-worker io_uring
+		};
+
+		// What happens to new connections once numOfMaxClients clients are connected
+		enum OverloadPolicy {
+			OVERLOAD_REJECT = 0,  // accept and reset at once, so the peer fails fast instead of waiting in the backlog
+			OVERLOAD_PAUSE_ACCEPT // stop accepting until a client leaves; the kernel backlog absorbs the rest
+		};
+
+		enum AcceptorBalance {
+			BALANCE_ROUND_ROBIN = 0,
+			BALANCE_LEAST_CONNECTIONS
+		};
+
+		/**
+		 * Options of the client sockets. Linux copies every one of them from the listening
+		 * socket to the sockets it accepts, so listen() sets them once on the listener and
+		 * clientAdd() sets nothing per connection.
+		 */
+		class SocketOptions {
+		public:
+			int recvTimeoutMs; // SO_RCVTIMEO of blocking reads (recvfixedsize); 0: wait forever
+			int sendTimeoutMs; // SO_SNDTIMEO of blocking writes; 0: wait forever
+			bool bKeepAlive; // SO_KEEPALIVE, with the three values below
+			int keepIdleSec; // TCP_KEEPIDLE
+			int keepCnt; // TCP_KEEPCNT
+			int keepIntvlSec; // TCP_KEEPINTVL
+			bool bNoDelay; // TCP_NODELAY
+			int userTimeoutMs; // TCP_USER_TIMEOUT; 0 keeps the kernel default
+			int recvBufSize; // SO_RCVBUF; 0 keeps the kernel default and its autotuning
+			int sendBufSize; // SO_SNDBUF; 0 keeps the kernel default and its autotuning
+			bool bSetPerConnection; // set them again on every socket given to clientAdd(), for sockets that did not come from listen()
+
+			SocketOptions()
+				: recvTimeoutMs(10000)
+				, sendTimeoutMs(10000)
+				, bKeepAlive(true)
+				, keepIdleSec(600)
+				, keepCnt(6)
+				, keepIntvlSec(5)
+				, bNoDelay(false)
+				, userTimeoutMs(0)
+				, recvBufSize(0)
+				, sendBufSize(0)
+				, bSetPerConnection(false)
+			{
+			}
+		};
+
+		class Options {
+		public:
+			WorkerTopology topology;
+			int numOfShards; // TOPOLOGY_SHARDED_REUSEPORT: number of event loops created by listen()
+			bool bEdgeTriggered; // EPOLLET: drain each readable connection until EAGAIN instead of re-arming after every read
+			int acceptBatchSize; // maximum connections accepted per listener wakeup
+			int epollBatchSize; // events requested per epoll_wait, the lower bound in adaptive mode
+			bool bAdaptiveBatch; // grow the batch while epoll_wait fills it, shrink it back when it does not
+			int epollBatchMax; // adaptive mode: upper bound of the batch
+			int busyPollUs; // keep polling with a zero timeout this long after the last event before blocking; 0 blocks at once
+			int sockBusyPollUs; // SO_BUSY_POLL and SO_PREFER_BUSY_POLL on client sockets; above net.core.busy_read it needs CAP_NET_ADMIN
+			int workerSchedPriority; // run the workers SCHED_FIFO at this priority; 0 keeps the default policy
+			int numOfAcceptors; // TOPOLOGY_ACCEPTOR: number of acceptor threads started by startWorkers()
+			AcceptorBalance acceptorBalance; // TOPOLOGY_ACCEPTOR: how an acceptor picks the worker for a connection
+			int handoffQueueSize; // TOPOLOGY_ACCEPTOR: capacity of each acceptor-to-worker queue
+			EventBackend backend;
+			int uringEntries; // BACKEND_IO_URING: submission queue size of each worker ring
+			int uringRecvBuffers; // BACKEND_IO_URING: provided receive buffers per worker, recvdatabufsize bytes each
+			bool bUringMultishotRecv; // BACKEND_IO_URING: keep one recv armed per connection; only for handlers that never read the socket themselves
+			int numOfClientShards; // lock stripes of the client registry, rounded up to a power of two; 0: one per online CPU
+			OverloadPolicy overloadPolicy; // BACKEND_IO_URING always rejects, its multishot accept cannot be paused
+			int idleTimeoutMs; // close a client that has received nothing for this long; 0 never does
+			int timerTickMs; // resolution of the timers set with timerSchedule()
+			JsCPPUtils::Common::ClockSource clockSource; // clock the loops read once per wakeup for receive stamps, idle checks, timers and log lines; process-wide, see init()
+			SocketOptions socketOptions; // applied by listen() to the listening sockets
+			int clientPoolSize; // client contexts each worker constructs at start and reuses after closing them; 0 allocates one per connection
+			int outputQueueLimit; // bytes ClientContext::sendAsync() may hold per connection before failing with -ENOBUFS; 0 for no limit
+			bool bCorkSends; // sends made on a worker thread are queued and written when its batch is done, one sendmsg() per connection
+			int zeroCopyThreshold; // ClientContext::sendZeroCopy() sends buffers of at least this many bytes with MSG_ZEROCOPY; 0 copies them all
+
+			Options()
+				: topology(TOPOLOGY_SHARED)
+				, numOfShards(1)
+				, bEdgeTriggered(false)
+				, acceptBatchSize(32)
+				, epollBatchSize(16)
+				, bAdaptiveBatch(false)
+				, epollBatchMax(256)
+				, busyPollUs(0)
+				, sockBusyPollUs(0)
+				, workerSchedPriority(0)
+				, numOfAcceptors(1)
+				, acceptorBalance(BALANCE_ROUND_ROBIN)
+				, handoffQueueSize(1024)
+				, backend(BACKEND_EPOLL)
+				, uringEntries(256)
+				, uringRecvBuffers(256)
+				, bUringMultishotRecv(false)
+				, numOfClientShards(0)
+				, overloadPolicy(OVERLOAD_REJECT)
+				, idleTimeoutMs(0)
+				, timerTickMs(10)
+				, clockSource(JsCPPUtils::Common::CLOCKSOURCE_MONOTONIC)
+				, socketOptions()
+				, clientPoolSize(64)
+				, outputQueueLimit(4 * 1024 * 1024)
+				, bCorkSends(false)
+				, zeroCopyThreshold(64 * 1024)
+			{
+			}
+		};
+
+		enum PlacementPolicy {
+			PLACEMENT_NONE = 0,  // workers float between all cores
+			PLACEMENT_CPUSET,    // worker i is pinned to cpus[i % cpus.size()]
+			PLACEMENT_COMPACT,   // one core per worker, filling a NUMA node before using the next
+			PLACEMENT_SPREAD,    // one core per worker, taking the nodes in turn
+			PLACEMENT_NUMA_NODE  // worker i may run on any core of node i % number of nodes
+		};
+
+		class WorkerPlacement {
+		public:
+			PlacementPolicy policy;
+			std::vector<int> cpus; // PLACEMENT_CPUSET
+
+			WorkerPlacement()
+				: policy(PLACEMENT_NONE)
+			{
+			}
+		};
+
+		class BatchStats {
+		public:
+			uint64_t numOfWaits; // waits that returned at least one event
+			uint64_t numOfEvents; // events returned in total
+			uint64_t numOfSaturated; // waits that filled the whole batch
+			int curBatchSize; // batch size of the next wait
+			int maxEvents; // most events returned by one wait
+
+			BatchStats()
+				: numOfWaits(0)
+				, numOfEvents(0)
+				, numOfSaturated(0)
+				, curBatchSize(0)
+				, maxEvents(0)
+			{
+			}
+		};
 
 	private:
+		enum DrainPhase {
+			DRAIN_NONE = 0,
+			DRAIN_FLUSH,    // not accepting, waiting for the clients' output to be acknowledged
+			DRAIN_TEARDOWN  // the workers close their loop's clients a batch at a time
+		};
+
+		struct AcceptedClient {
+			int sock;
+			struct sockaddr_in addr;
+		};
+
+		class EventLoop {
+		public:
+			int index;
+			int epoll_fd;
+			int listen_fd;
+			int accept_fd; // BACKEND_IO_URING: listening socket this loop accepts from, its own or a shard's
+			int wakeup_fd; // eventfd that interrupts epoll_wait for shutdown or cross-thread work
+			int numofworkers;
+
+			volatile int numofclients;
+			volatile int numofqueued; // handed off by an acceptor but not yet added
+			volatile int listenpaused; // OVERLOAD_PAUSE_ACCEPT: listener left disarmed until resumeAccept()
+			volatile int drainaccept; // drain(): 1 while the connections queued on accept_fd are still to be accepted, 2 while a worker accepts them
+
+			// TOPOLOGY_ACCEPTOR: one queue per acceptor thread, the loop's worker consumes them
+			std::vector< JsCPPUtils::SPSCQueue<AcceptedClient>* > handoffqueues;
+
+			// BACKEND_IO_URING: owned by the loop's only worker
+			IoUring *puring;
+			uint64_t wakeupvalue;
+			// BACKEND_IO_URING: receives and polls for clients of other threads, armed by the worker
+			JsCPPUtils::Lockable pendinglock;
+			std::vector<uint64_t> pendingrecv;
+
+			// idleTimeoutMs: the loop's clients by last receive, checked on every tick of timer_fd
+			int timer_fd;
+			uint64_t timervalue;
+			JsCPPUtils::Lockable idlelock;
+			TimerWheel idlewheel;
+
+			// timerSchedule(): the timers of the loop's clients; usertimer_fd ticks only while there are any
+			int usertimer_fd;
+			uint64_t usertimervalue;
+			bool busertimerarmed;
+			JsCPPUtils::Lockable timerlock;
+			HierarchicalTimerWheel timerwheel;
+
+			// drain(): the loop's clients still to be closed, shared by the loop's workers
+			JsCPPUtils::Lockable drainlock;
+			std::vector< JsCPPUtils::SmartPointer<ClientContext> > drainlist;
+
+			// Sockets of closed clients whose MSG_ZEROCOPY buffers the kernel still holds, by descriptor,
+			// with the queues that release them. zclinger_fd is an epoll instance they are in, edge-triggered
+			// for the error queue; the loop waits on it and closes each socket once its last completion is in.
+			int zclinger_fd;
+			JsCPPUtils::Lockable zclingerlock;
+			std::map<int, OutputQueue*> zclinger;
+
+			EventLoop(int _index)
+				: index(_index)
+				, epoll_fd(-1)
+				, listen_fd(-1)
+				, accept_fd(-1)
+				, wakeup_fd(-1)
+				, numofworkers(0)
+				, numofclients(0)
+				, numofqueued(0)
+				, listenpaused(0)
+				, drainaccept(0)
+				, puring(NULL)
+				, wakeupvalue(0)
+				, timer_fd(-1)
+				, timervalue(0)
+				, usertimer_fd(-1)
+				, usertimervalue(0)
+				, busertimerarmed(false)
+				, zclinger_fd(-1)
+			{
+			}
+
+			~EventLoop()
+			{
+				for (std::vector< JsCPPUtils::SPSCQueue<AcceptedClient>* >::iterator iter = handoffqueues.begin(); iter != handoffqueues.end(); iter++)
+					delete *iter;
+			}
+		};
+
 		class WorkerThreadInternalContext {
 		public:
 			ServerContext *pServerCtx;
@@ -60,6 +323,16 @@ namespace JsServerSocket
 			void *pthreaduserctx;
 			
 			char *precvbuf;
+			AcceptedClient *paccepted;
+			struct epoll_event *pepevents;
+			EventLoop *ploop;
+			BatchStats *pbatchstats;
+			std::vector<int> idleexpired;
+			std::vector<ClientTimer*> timersfired;
+			std::vector< JsCPPUtils::SmartPointer<ClientContext> > clientpool; // ready for the next accept
+			std::vector< JsCPPUtils::SmartPointer<ClientContext> > clientreleased; // deleted since the batch began
+			ClientContext *pactiveclient; // whose event is being handled; it is re-armed for output afterwards
+			std::vector<int> corkedclients; // bCorkSends: indexes of the clients holding output until the batch is done
 
 			WorkerThreadInternalContext(ServerContext *_pServerCtx, int _threadidx, void *_pthreaduserctx)
 				: pServerCtx(_pServerCtx)
@@ -67,6 +340,11 @@ namespace JsServerSocket
 				, threadidx(_threadidx)
 				, pthreaduserctx(_pthreaduserctx)
 				, precvbuf(NULL)
+				, paccepted(NULL)
+				, pepevents(NULL)
+				, ploop(NULL)
+				, pbatchstats(NULL)
+				, pactiveclient(NULL)
 			{
 			}
 		};
@@ -80,8 +358,8 @@ namespace JsServerSocket
 		
 		bool m_bUseSSL;
 
-		int m_sock_fd;
-		int m_epoll_fd;
+		Options m_options;
+		std::vector<EventLoop*> m_loops;
 		
 #ifdef USE_OPENSSL
 		SSL_CTX *m_sslCtx;
@@ -94,8 +372,24 @@ namespace JsServerSocket
 		std::list< JsCPPUtils::SmartPointer<JsCPPUtils::JsThread::ThreadContext> > m_worker_threads;
 		int          m_worker_stateofstartthread;
 
-		JsCPPUtils::Lockable      m_random_lock;
-		JsCPPUtils::RandomWell512 m_random;
+		// One per worker, each on its own cache line and written only by its worker
+		struct PaddedBatchStats {
+			BatchStats stats;
+			char pad[64 - (sizeof(BatchStats) % 64)];
+		};
+		std::vector<PaddedBatchStats> m_worker_batchstats;
+		std::vector< std::vector<int> > m_worker_cpus; // empty: not pinned
+
+		std::list< JsCPPUtils::SmartPointer<JsCPPUtils::JsThread::ThreadContext> > m_acceptor_threads;
+		int          m_acceptor_wakeup_fd;
+
+		ClientRegistry m_clients;
+		volatile int   m_numofclients; // admitted by clientAdd, checked against m_conf_numOfMaxClients without a lock
+		volatile int   m_acceptpaused; // some listener is paused by OVERLOAD_PAUSE_ACCEPT
+		volatile int   m_drainphase; // DrainPhase
+		volatile int   m_drainacceptors; // drain(): acceptor threads that have not yet taken the listener off
+		volatile int   m_listenexported; // the listeners are shared with another process, which serves their backlog after drain()
+		volatile int   m_timerseq;
 
 		void *m_userptr;
 
@@ -108,13 +402,63 @@ namespace JsServerSocket
 		Client_RecvHandler_t   m_recvhandler;
 		Client_DelHandler_t    m_delhandler;
 
+		EventLoop *getCurrentLoop();
+		uint32_t getClientEpollEvents(EventLoop *ploop);
+		int getAcceptFlags();
+		bool isOverloaded();
+		bool pauseAccept(EventLoop *ploop);
+		void resumeAccept();
+		void releaseAdmission();
+		void idleTrack(EventLoop *ploop, ClientContext *pclientctx);
+		void idleUntrack(ClientContext *pclientctx);
+		int workerCheckIdle(WorkerThreadInternalContext *pmyctx);
+		int workerRunTimers(WorkerThreadInternalContext *pmyctx);
+		int workerDrainBatch(WorkerThreadInternalContext *pmyctx);
+		int workerFillClientPool(WorkerThreadInternalContext *pmyctx);
+		void workerRecycleClients(WorkerThreadInternalContext *pmyctx);
+		void workerFlushCorked(WorkerThreadInternalContext *pmyctx);
+		void armUserTimer(EventLoop *ploop, bool barm);
+		void timerCancelAll(ClientContext *pclientctx);
+		static void rejectSocket(int sock);
+		int planWorkerPlacement(int numOfthreads, const WorkerPlacement *pplacement);
+		int workerAcceptBatch(WorkerThreadInternalContext *pmyctx);
+		int workerAcceptClient(WorkerThreadInternalContext *pmyctx, AcceptedClient *pclient);
+		int workerAcceptBacklog(WorkerThreadInternalContext *pmyctx);
+		int workerProcessHandoff(WorkerThreadInternalContext *pmyctx);
+		EventLoop *handoffClient(int acceptoridx, const AcceptedClient *pclient, unsigned int *prrcounter);
+		void stopThreads(std::list< JsCPPUtils::SmartPointer<JsCPPUtils::JsThread::ThreadContext> > &threads);
+		int workerProcessClient(WorkerThreadInternalContext *pmyctx, ClientContext *pclientctx, uint32_t readyevents);
+		int workerRunUring(WorkerThreadInternalContext *pmyctx, JsCPPUtils::JsThread::ThreadContext *pThreadCtx);
+		int workerUringRecv(WorkerThreadInternalContext *pmyctx, const struct io_uring_cqe *pcqe);
+		int uringArmRecv(EventLoop *ploop, ClientContext *pclientctx);
+		int workerUringWritable(WorkerThreadInternalContext *pmyctx, const struct io_uring_cqe *pcqe);
+		int workerUringErrQueue(WorkerThreadInternalContext *pmyctx, const struct io_uring_cqe *pcqe);
+		// tag: URING_TAG_WRITABLE or URING_TAG_ERRQUEUE
+		int uringArmPoll(EventLoop *ploop, ClientContext *pclientctx, int tag);
+		// Has the client's loop report when its socket becomes writable, for ClientContext::sendAsync()
+		int clientArmOutput(ClientContext *pclientctx);
+		// Has the client's loop read the MSG_ZEROCOPY completions of ClientContext::sendZeroCopy()
+		int clientArmZeroCopy(ClientContext *pclientctx);
+		// From ClientContext::close(): the loop takes over the socket and its queue until the kernel
+		// is done with the queue's buffers. 1, or <=0 if the caller is to release them now.
+		int lingerZeroCopy(ClientContext *pclientctx);
+		int workerReapLinger(EventLoop *ploop);
+		void closeLinger(EventLoop *ploop);
+		int openLoop(EventLoop *ploop, bool bListener);
+		int applySocketOptions(int sock);
+		int wakeupLoop(EventLoop *ploop);
+		int listenShard(EventLoop *ploop, const struct sockaddr *psockaddr, int sockaddrlen, int sizeOfListenQueue);
+		int armListener(EventLoop *ploop);
+		int clientAddOnLoop(EventLoop *ploop, int clientsock, struct sockaddr_in *client_paddr, JsCPPUtils::SmartPointer< ClientContext > *pout_spclientctx, void *userptr);
+
+		static __thread WorkerThreadInternalContext *s_pcurrentworker;
+
 		static void workerThreadProc_CleanUp(void *param);
 		static int workerThreadProc(JsCPPUtils::JsThread::ThreadContext *pThreadCtx, int threadindex, void *threadparam);
+		static void acceptorThreadProc_CleanUp(void *param);
+		static int acceptorThreadProc(JsCPPUtils::JsThread::ThreadContext *pThreadCtx, int acceptoridx, void *threadparam);
 
 	public:
-		std::map< int, JsCPPUtils::SmartPointer<ClientContext> > m_clients;
-		JsCPPUtils::Lockable                                     m_clients_lock;
-		
 		ServerContext(void *userptr = NULL, JsCPPUtils::Logger *logger = NULL);
 		~ServerContext();
 		int init(
@@ -133,17 +477,47 @@ namespace JsServerSocket
 			StopWorkerHandler_t stopworkerhandler,
 			Client_AcceptHandler_t accepthandler,
 			Client_RecvHandler_t recvhandler,
-			Client_DelHandler_t delhandler);
+			Client_DelHandler_t delhandler,
+			const Options *poptions = NULL);
+		// Graceful shutdown, before close(). Stops accepting: the listeners are taken off the loops
+		// and the connections already queued on them are accepted once and served like the others
+		// (unless the listeners were exported; the new process serves them). Connections queued
+		// after that are reset by close(). Waits up to timeoutMs for handlers in progress to
+		// return and for the clients' output to be acknowledged, then has every worker close its
+		// loop's clients in batches between its other events. Returns 1 when no client is left,
+		// -ETIMEDOUT when some are; close() closes those.
+		int drain(int timeoutMs);
+
+		/**
+		 * Restart without dropping connections. unixsock is a connected AF_UNIX SOCK_SEQPACKET
+		 * socket to the new process. The old process calls exportSockets() and then drain() and
+		 * close(). The new process calls init(), importListeners() instead of listen(),
+		 * startWorkers() and then importClients().
+		 * With bIdleClients, exportSockets() also moves the clients that have no unread input and
+		 * no unacknowledged output. Those clients are deleted here without a FIN; the delete handler
+		 * still runs. TLS clients and io_uring clients, whose ring may hold a pending receive, stay.
+		 * Returns the number of clients moved, or -errno.
+		 */
+		int exportSockets(int unixsock, bool bIdleClients, Client_ExportHandler_t exporthandler = NULL);
+		int importListeners(int unixsock);
+		int importClients(int unixsock, Client_ImportHandler_t importhandler = NULL);
 		int close();
 		int listen(const struct sockaddr *psockaddr, int sockaddrlen, int sizeOfListenQueue);
 		int sslLoadCertificates(const char* szCertFile, const char* szKeyFile);
-		int startWorkers(int numOfthreads);
+		int startWorkers(int numOfthreads, const WorkerPlacement *pplacement = NULL);
 
 		int clientAdd(int clientsock, struct sockaddr_in *client_paddr, JsCPPUtils::SmartPointer< ClientContext > *pout_spclientctx, void *userptr);
+		// Called with the client locked or not. A lock the calling thread holds is released.
 		int clientDel(JsCPPUtils::SmartPointer<ClientContext> spClientCtx);
 		int clientDel(ClientContext *pClientCtx);
 		int clientDel(int clientidx);
-		int clientDel(std::map<int, JsCPPUtils::SmartPointer<ClientContext> >::iterator iter);
+
+		// Calls handler on a worker of the client's loop, holding the client's lock, after delayMs
+		// and then every periodMs if that is above 0. Like the recv handler, it returns 1 or more
+		// to keep the client and anything else to delete it. Returns the timer id.
+		int timerSchedule(ClientContext *pClientCtx, int delayMs, int periodMs, Client_TimerHandler_t handler, void *param);
+		// Returns 1 if the timer was pending. A timer cancelled while its handler runs does not repeat.
+		int timerCancel(ClientContext *pClientCtx, int timerid);
 
 		JsCPPUtils::Logger *getLogger();
 		
@@ -151,6 +525,10 @@ namespace JsServerSocket
 		void *getUserPtr();
 
 		int getConnections();
+		// The registry is walked one shard at a time; each call holds only that shard's lock while copying
+		int getNumOfClientShards();
+		int getShardClients(int shardidx, std::vector< JsCPPUtils::SmartPointer<ClientContext> > *plist);
+		int getBatchStats(int threadidx, BatchStats *pstats);
 		bool getUseSSL();
 		
 #ifdef USE_OPENSSL
@@ -0,0 +1,267 @@
+/**
+ * @file	JsServerSocket/TimerWheel.cpp
+ * @class	TimerWheel
+ * @brief	TimerWheel
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "TimerWheel.h"
+
+namespace JsServerSocket
+{
+	TimerWheel::TimerWheel() :
+		m_mask(0),
+		m_tickms(1),
+		m_curtick(0)
+	{
+	}
+
+	TimerWheel::~TimerWheel()
+	{
+	}
+
+	void TimerWheel::init(int numOfSlots, int64_t tickms, int64_t nowms)
+	{
+		int realslots = 1;
+		int i;
+
+		while (realslots < numOfSlots)
+			realslots <<= 1;
+		m_slots.resize(realslots);
+		for (i = 0; i < realslots; i++)
+		{
+			m_slots[i].prev = &m_slots[i];
+			m_slots[i].next = &m_slots[i];
+		}
+		m_mask = realslots - 1;
+		m_tickms = (tickms > 0) ? tickms : 1;
+		m_curtick = nowms / m_tickms;
+	}
+
+	void TimerWheel::add(TimerWheelNode *pnode, int64_t expirems)
+	{
+		TimerWheelNode *phead;
+		int64_t tick = expirems / m_tickms;
+
+		// The current slot has already been visited
+		if (tick <= m_curtick)
+			tick = m_curtick + 1;
+		pnode->expiretick = tick;
+
+		phead = &m_slots[(int)(tick & m_mask)];
+		pnode->next = phead;
+		pnode->prev = phead->prev;
+		phead->prev->next = pnode;
+		phead->prev = pnode;
+	}
+
+	void TimerWheel::remove(TimerWheelNode *pnode)
+	{
+		if (!pnode->isLinked())
+			return;
+		pnode->prev->next = pnode->next;
+		pnode->next->prev = pnode->prev;
+		pnode->prev = NULL;
+		pnode->next = NULL;
+	}
+
+	TimerWheelNode *TimerWheel::advance(int64_t nowms)
+	{
+		TimerWheelNode *pexpired = NULL;
+		int64_t target = nowms / m_tickms;
+		int64_t steps = target - m_curtick;
+		int64_t tick;
+
+		// After a long stall one pass over the wheel sees every timer
+		if (steps > (int64_t)m_slots.size())
+			steps = (int64_t)m_slots.size();
+
+		for (tick = target - steps + 1; tick <= target; tick++)
+		{
+			TimerWheelNode *phead = &m_slots[(int)(tick & m_mask)];
+			TimerWheelNode *pnode = phead->next;
+			while (pnode != phead)
+			{
+				TimerWheelNode *pnext = pnode->next;
+				if (pnode->expiretick <= target)
+				{
+					remove(pnode);
+					pnode->next = pexpired;
+					pexpired = pnode;
+				}
+				pnode = pnext;
+			}
+		}
+		if (target > m_curtick)
+			m_curtick = target;
+
+		return pexpired;
+	}
+
+	int64_t TimerWheel::getTickMs() const
+	{
+		return m_tickms;
+	}
+
+	HierarchicalTimerWheel::HierarchicalTimerWheel() :
+		m_tickms(1),
+		m_curtick(0),
+		m_count(0)
+	{
+		int level, i;
+		for (level = 0; level < NUM_LEVELS; level++)
+		{
+			for (i = 0; i < LEVEL_SLOTS; i++)
+			{
+				m_slots[level][i].prev = &m_slots[level][i];
+				m_slots[level][i].next = &m_slots[level][i];
+			}
+		}
+	}
+
+	HierarchicalTimerWheel::~HierarchicalTimerWheel()
+	{
+	}
+
+	void HierarchicalTimerWheel::init(int64_t tickms, int64_t nowms)
+	{
+		m_tickms = (tickms > 0) ? tickms : 1;
+		m_curtick = nowms / m_tickms;
+	}
+
+	void HierarchicalTimerWheel::place(TimerWheelNode *pnode)
+	{
+		TimerWheelNode *phead;
+		int64_t delta = pnode->expiretick - m_curtick;
+		int64_t tick = pnode->expiretick;
+		int level;
+
+		for (level = 0; level < NUM_LEVELS - 1; level++)
+		{
+			if (delta < ((int64_t)1 << (LEVEL_BITS * (level + 1))))
+				break;
+		}
+		// Beyond the top level: park in its farthest slot, the cascade files it again
+		if (delta >= ((int64_t)1 << (LEVEL_BITS * NUM_LEVELS)))
+			tick = m_curtick + ((int64_t)1 << (LEVEL_BITS * NUM_LEVELS)) - 1;
+
+		phead = &m_slots[level][(int)((tick >> (LEVEL_BITS * level)) & (LEVEL_SLOTS - 1))];
+		pnode->next = phead;
+		pnode->prev = phead->prev;
+		phead->prev->next = pnode;
+		phead->prev = pnode;
+	}
+
+	void HierarchicalTimerWheel::cascade(int level)
+	{
+		TimerWheelNode *phead = &m_slots[level][(int)((m_curtick >> (LEVEL_BITS * level)) & (LEVEL_SLOTS - 1))];
+		TimerWheelNode *pnode = phead->next;
+
+		if (pnode == phead)
+			return;
+		// Detach the whole slot first, place() may put nodes back into it
+		phead->prev->next = NULL;
+		phead->prev = phead;
+		phead->next = phead;
+		while (pnode != NULL)
+		{
+			TimerWheelNode *pnext = pnode->next;
+			place(pnode);
+			pnode = pnext;
+		}
+	}
+
+	void HierarchicalTimerWheel::add(TimerWheelNode *pnode, int64_t expirems)
+	{
+		int64_t tick = expirems / m_tickms;
+
+		if (tick <= m_curtick)
+			tick = m_curtick + 1;
+		pnode->expiretick = tick;
+		place(pnode);
+		m_count++;
+	}
+
+	void HierarchicalTimerWheel::remove(TimerWheelNode *pnode)
+	{
+		if (!pnode->isLinked())
+			return;
+		pnode->prev->next = pnode->next;
+		pnode->next->prev = pnode->prev;
+		pnode->prev = NULL;
+		pnode->next = NULL;
+		m_count--;
+	}
+
+	TimerWheelNode *HierarchicalTimerWheel::advance(int64_t nowms)
+	{
+		TimerWheelNode *pexpired = NULL;
+		int64_t target = nowms / m_tickms;
+
+		while (m_curtick < target)
+		{
+			TimerWheelNode *phead;
+			int level;
+
+			if (m_count == 0)
+			{
+				m_curtick = target;
+				break;
+			}
+
+			m_curtick++;
+			// Each level that wraps refills the one below it
+			for (level = 1; level < NUM_LEVELS; level++)
+			{
+				if ((m_curtick & (((int64_t)1 << (LEVEL_BITS * level)) - 1)) != 0)
+					break;
+				cascade(level);
+			}
+
+			phead = &m_slots[0][(int)(m_curtick & (LEVEL_SLOTS - 1))];
+			while (phead->next != phead)
+			{
+				TimerWheelNode *pnode = phead->next;
+				remove(pnode);
+				pnode->next = pexpired;
+				pexpired = pnode;
+			}
+		}
+
+		return pexpired;
+	}
+
+	TimerWheelNode *HierarchicalTimerWheel::removeAll()
+	{
+		TimerWheelNode *pall = NULL;
+		int level, i;
+
+		for (level = 0; level < NUM_LEVELS; level++)
+		{
+			for (i = 0; i < LEVEL_SLOTS; i++)
+			{
+				TimerWheelNode *phead = &m_slots[level][i];
+				while (phead->next != phead)
+				{
+					TimerWheelNode *pnode = phead->next;
+					remove(pnode);
+					pnode->next = pall;
+					pall = pnode;
+				}
+			}
+		}
+
+		return pall;
+	}
+
+	int HierarchicalTimerWheel::size() const
+	{
+		return m_count;
+	}
+
+	int64_t HierarchicalTimerWheel::getTickMs() const
+	{
+		return m_tickms;
+	}
+}
@@ -0,0 +1,122 @@
+/**
+ * @file	JsServerSocket/TimerWheel.h
+ * @class	TimerWheel
+ * @brief	Hashed and hierarchical timer wheels with intrusive nodes
+ * @copyright This software may be modified and distributed under the terms
+ *            of the MIT license.  See the LICENSE file for details.
+ */
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1200)
+#pragma once
+#endif
+
+#ifndef __JSSERVERSOCKET_TIMERWHEEL_H__
+#define __JSSERVERSOCKET_TIMERWHEEL_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace JsServerSocket
+{
+	// Embedded in the object it times; the wheel never allocates per timer
+	struct TimerWheelNode {
+		TimerWheelNode *prev;
+		TimerWheelNode *next;
+		int64_t expiretick;
+		void *pdata;
+
+		TimerWheelNode()
+			: prev(NULL)
+			, next(NULL)
+			, expiretick(0)
+			, pdata(NULL)
+		{
+		}
+
+		bool isLinked() const
+		{
+			return prev != NULL;
+		}
+	};
+
+	/**
+	 * A timer goes into slot (expire / tick) % slots and waits there for as many rounds as
+	 * it needs, so add and remove are O(1) and advance() only looks at the slots it passes.
+	 * Not thread-safe: the owner locks around every call.
+	 */
+	class TimerWheel
+	{
+	private:
+		std::vector<TimerWheelNode> m_slots; // list heads, each a circular list through itself
+		int m_mask;
+		int64_t m_tickms;
+		int64_t m_curtick; // every slot up to this tick has been visited
+
+		TimerWheel(const TimerWheel&);
+		TimerWheel& operator=(const TimerWheel&);
+
+	public:
+		TimerWheel();
+		~TimerWheel();
+
+		// numOfSlots is rounded up to a power of two. std::bad_alloc
+		void init(int numOfSlots, int64_t tickms, int64_t nowms);
+
+		void add(TimerWheelNode *pnode, int64_t expirems);
+		void remove(TimerWheelNode *pnode);
+
+		// Unlinks every timer due at nowms and returns them chained through next, NULL-terminated
+		TimerWheelNode *advance(int64_t nowms);
+
+		int64_t getTickMs() const;
+	};
+
+	/**
+	 * Four levels of 64 slots. A timer is filed in the level that covers its distance and
+	 * moves down a level each time the one below wraps, so every level-0 slot holds exactly
+	 * the timers of one tick. Far deadlines cost nothing until they come close.
+	 * Not thread-safe: the owner locks around every call.
+	 */
+	class HierarchicalTimerWheel
+	{
+	public:
+		enum {
+			LEVEL_BITS = 6,
+			LEVEL_SLOTS = (1 << LEVEL_BITS),
+			NUM_LEVELS = 4
+		};
+
+	private:
+		TimerWheelNode m_slots[NUM_LEVELS][LEVEL_SLOTS];
+		int64_t m_tickms;
+		int64_t m_curtick;
+		int m_count;
+
+		HierarchicalTimerWheel(const HierarchicalTimerWheel&);
+		HierarchicalTimerWheel& operator=(const HierarchicalTimerWheel&);
+
+		void place(TimerWheelNode *pnode);
+		void cascade(int level);
+
+	public:
+		HierarchicalTimerWheel();
+		~HierarchicalTimerWheel();
+
+		void init(int64_t tickms, int64_t nowms);
+
+		void add(TimerWheelNode *pnode, int64_t expirems);
+		void remove(TimerWheelNode *pnode);
+
+		// Unlinks every timer due at nowms and returns them chained through next, NULL-terminated
+		TimerWheelNode *advance(int64_t nowms);
+		// Unlinks every timer, due or not, the same way
+		TimerWheelNode *removeAll();
+
+		int size() const;
+		int64_t getTickMs() const;
+	};
+}
+
+#endif /* __JSSERVERSOCKET_TIMERWHEEL_H__ */
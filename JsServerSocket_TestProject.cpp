@@ -3,6 +3,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
 
 #include <openssl/ssl.h>
 #include <openssl/ssl3.h>
@@ -41,16 +45,22 @@ int Client_AcceptHandler(JsServerSocket::ServerContext *pServerCtx, void *pthrea
 int Client_RecvHandler(JsServerSocket::ServerContext *pServerCtx, void *pthreaduserctx, JsServerSocket::ClientContext *pClientCtx, int recv_len, char *recv_pbuf)
 {
 	int32_t datasize;
-	char databuf[4100];
+	char databuf[4096];
+	struct iovec iov[2];
 	
 	if (recv_len != 4)
 		return 0;
 	
 	memcpy(&datasize, recv_pbuf, 4);
-	memcpy(databuf, &datasize, 4);
 	
-	pClientCtx->recvfixedsize(&databuf[4], datasize - 4, 0, NULL);
-	pClientCtx->sendfixedsize(databuf, datasize, 0);
+	pClientCtx->recvfixedsize(databuf, datasize - 4, 0, NULL);
+	
+	// Header and body go out in one sendmsg(), without copying them together
+	iov[0].iov_base = &datasize;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = databuf;
+	iov[1].iov_len = datasize - 4;
+	pClientCtx->sendv(iov, 2);
 	
 	//printf("RecvHandler: %d: %d\n", pClientCtx->getIndex(), recv_len);
 	return 1;
@@ -61,10 +71,405 @@ void Client_DelHandler(JsServerSocket::ServerContext *pServerCtx, JsServerSocket
 	printf("DelHandler: %d\n", pClientCtx->getIndex());
 }
 
+// statmfd stays open: with the descriptors all taken there is none left to open it again
+static long GetRssKb(int statmfd)
+{
+	char buf[128];
+	long pages = 0;
+	long rsspages = 0;
+	ssize_t len = pread(statmfd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	if (sscanf(buf, "%ld %ld", &pages, &rsspages) != 2)
+		return -1;
+	return rsspages * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// Opens numofconns idle loopback connections from a child process and reports the resident
+// memory they add to this one. A million needs fs.nr_open and RLIMIT_NOFILE above 1M and
+// net.ipv4.ip_local_port_range wide enough; the source address changes every 25000 ports.
+static int RunRssBenchmark(JsServerSocket::ServerContext *pserverctx, int numofconns)
+{
+	int readypipe[2];
+	int holdpipe[2];
+	int statmfd;
+	int numofopened = 0;
+	long rssbefore;
+	long rssafter;
+	pid_t pid;
+	int i;
+
+	statmfd = open("/proc/self/statm", O_RDONLY);
+	if ((statmfd < 0) || (pipe(readypipe) < 0) || (pipe(holdpipe) < 0))
+		return -1;
+
+	// Measured once the workers have started and filled their pools
+	usleep(200000);
+	rssbefore = GetRssKb(statmfd);
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+	{
+		char c;
+		int one = 1;
+		close(readypipe[0]);
+		close(holdpipe[1]);
+		for (i = 0; i < numofconns; i++)
+		{
+			struct sockaddr_in srcaddr;
+			struct sockaddr_in dstaddr;
+			int sock = socket(AF_INET, SOCK_STREAM, 0);
+			if (sock < 0)
+				break;
+			// The port is then picked per destination at connect() rather than per address at bind()
+			setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+			memset(&srcaddr, 0, sizeof(srcaddr));
+			srcaddr.sin_family = AF_INET;
+			srcaddr.sin_addr.s_addr = htonl(0x7F000101 + (i / 25000));
+			memset(&dstaddr, 0, sizeof(dstaddr));
+			dstaddr.sin_family = AF_INET;
+			dstaddr.sin_port = htons(12345);
+			dstaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			if ((bind(sock, (struct sockaddr*)&srcaddr, sizeof(srcaddr)) < 0) || (connect(sock, (struct sockaddr*)&dstaddr, sizeof(dstaddr)) < 0))
+			{
+				close(sock);
+				break;
+			}
+			numofopened++;
+		}
+		if (write(readypipe[1], &numofopened, sizeof(numofopened)) != sizeof(numofopened))
+			_exit(1);
+		// Held until the parent has measured and closes its end
+		while (read(holdpipe[0], &c, 1) > 0);
+		_exit(0);
+	}
+
+	close(readypipe[1]);
+	close(holdpipe[0]);
+	if (read(readypipe[0], &numofopened, sizeof(numofopened)) != sizeof(numofopened))
+		numofopened = 0;
+	for (i = 0; (i < 600) && (pserverctx->getConnections() < numofopened); i++)
+		usleep(100000);
+	rssafter = GetRssKb(statmfd);
+
+	printf("connections: %d opened, %d accepted\n", numofopened, pserverctx->getConnections());
+	printf("rss: %ld kB before, %ld kB after, %ld bytes per connection\n", rssbefore, rssafter,
+		(numofopened > 0) ? ((rssafter - rssbefore) * 1024 / numofopened) : 0);
+
+	close(holdpipe[1]);
+	close(readypipe[0]);
+	close(statmfd);
+	waitpid(pid, NULL, 0);
+	return 1;
+}
+
+// "bench": one thread per connection, each sending BENCH_MSG_SIZE bytes and waiting for their echo.
+// Round trips are counted by the microsecond up to BENCH_HIST_US, the last count is for longer ones.
+#define BENCH_MSG_SIZE 64
+#define BENCH_HIST_US  10000
+#define BENCH_PORT     12346
+
+struct BenchClient {
+	pthread_t thread;
+	int sock;
+	volatile int *pstop;
+	int64_t numofrequests;
+	bool bfailed;
+	uint32_t hist[BENCH_HIST_US + 1];
+};
+
+// Echoes whatever came in, so a request read in two pieces is answered in two
+static int Bench_RecvHandler(JsServerSocket::ServerContext *pServerCtx, void *pthreaduserctx, JsServerSocket::ClientContext *pClientCtx, int recv_len, char *recv_pbuf)
+{
+	return (pClientCtx->sendfixedsize(recv_pbuf, recv_len, 0) > 0) ? 1 : -1;
+}
+
+static void *BenchClientProc(void *param)
+{
+	BenchClient *pclient = (BenchClient*)param;
+	char buf[BENCH_MSG_SIZE];
+	int64_t starttime;
+	int64_t elapsed;
+	int len;
+	int nrst;
+
+	memset(buf, 'b', sizeof(buf));
+	while (!*pclient->pstop)
+	{
+		starttime = JsCPPUtils::Common::getMicroTickCount();
+		if (send(pclient->sock, buf, sizeof(buf), 0) != (ssize_t)sizeof(buf))
+		{
+			pclient->bfailed = true;
+			break;
+		}
+		for (len = 0; len < (int)sizeof(buf); len += nrst)
+		{
+			if ((nrst = recv(pclient->sock, &buf[len], sizeof(buf) - len, 0)) <= 0)
+			{
+				pclient->bfailed = true;
+				return NULL;
+			}
+		}
+		elapsed = JsCPPUtils::Common::getMicroTickCount() - starttime;
+		pclient->hist[(elapsed < BENCH_HIST_US) ? elapsed : BENCH_HIST_US]++;
+		pclient->numofrequests++;
+	}
+	return NULL;
+}
+
+// Round trip in microseconds below which the given share of them came back
+static int BenchPercentile(const uint64_t *phist, uint64_t total, double share)
+{
+	uint64_t sum = 0;
+	int us;
+	for (us = 0; us < BENCH_HIST_US; us++)
+	{
+		sum += phist[us];
+		if (sum >= (uint64_t)(total * share))
+			break;
+	}
+	return us;
+}
+
+// Runs the same echo load against one server per backend, one after the other, and reports both
+static int RunBackendBenchmark(int numofconns, int seconds)
+{
+	static const JsServerSocket::ServerContext::EventBackend backends[] = {
+		JsServerSocket::ServerContext::BACKEND_EPOLL,
+		JsServerSocket::ServerContext::BACKEND_IO_URING
+	};
+	static const char *backendnames[] = { "epoll", "io_uring" };
+	struct sockaddr_in server_addr;
+	int bi;
+	int i;
+	int nrst;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family      = AF_INET;
+	server_addr.sin_port        = htons(BENCH_PORT);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (bi = 0; bi < (int)(sizeof(backends) / sizeof(backends[0])); bi++)
+	{
+		JsServerSocket::ServerContext *pserverctx = new JsServerSocket::ServerContext(NULL);
+		JsServerSocket::ServerContext::Options options;
+		BenchClient *pclients = new BenchClient[numofconns];
+		uint64_t hist[BENCH_HIST_US + 1];
+		uint64_t total = 0;
+		volatile int stop = 0;
+		int numofstarted = 0;
+		int numoffailed = 0;
+		int maxus;
+		int64_t starttime;
+		int64_t elapsed;
+
+		options.backend = backends[bi];
+		if ((nrst = pserverctx->init(AF_INET, SOCK_STREAM, IPPROTO_TCP, false, NULL, numofconns + 16, BENCH_MSG_SIZE, NULL, NULL, NULL, Bench_RecvHandler, NULL, &options)) <= 0)
+		{
+			printf("%s: init failed: %d\n", backendnames[bi], nrst);
+			delete[] pclients;
+			delete pserverctx;
+			continue;
+		}
+		pserverctx->listen((sockaddr*)&server_addr, sizeof(server_addr), (numofconns > 128) ? numofconns : 128);
+		pserverctx->startWorkers(2);
+
+		for (i = 0; i < numofconns; i++)
+		{
+			BenchClient *pclient = &pclients[i];
+			struct timeval tvtimeout = { 5, 0 };
+			int one = 1;
+			memset(pclient, 0, sizeof(*pclient));
+			pclient->pstop = &stop;
+			pclient->sock = socket(AF_INET, SOCK_STREAM, 0);
+			if (pclient->sock < 0)
+				break;
+			setsockopt(pclient->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			setsockopt(pclient->sock, SOL_SOCKET, SO_RCVTIMEO, &tvtimeout, sizeof(tvtimeout));
+			if ((connect(pclient->sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) ||
+				(pthread_create(&pclient->thread, NULL, BenchClientProc, pclient) != 0))
+			{
+				close(pclient->sock);
+				break;
+			}
+			numofstarted++;
+		}
+
+		starttime = JsCPPUtils::Common::getMicroTickCount();
+		sleep(seconds);
+		stop = 1;
+		for (i = 0; i < numofstarted; i++)
+			pthread_join(pclients[i].thread, NULL);
+		elapsed = JsCPPUtils::Common::getMicroTickCount() - starttime;
+
+		memset(hist, 0, sizeof(hist));
+		for (i = 0; i < numofstarted; i++)
+		{
+			int us;
+			for (us = 0; us <= BENCH_HIST_US; us++)
+				hist[us] += pclients[i].hist[us];
+			total += pclients[i].numofrequests;
+			if (pclients[i].bfailed)
+				numoffailed++;
+			close(pclients[i].sock);
+		}
+		for (maxus = BENCH_HIST_US; (maxus > 0) && (hist[maxus] == 0); maxus--);
+
+		printf("%s: %d connections (%d failed), %lld requests/s, round trip p50 %d us, p99 %d us, max %s%d us\n",
+			backendnames[bi], numofstarted, numoffailed, (long long)((elapsed > 0) ? (int64_t)total * 1000000 / elapsed : 0),
+			BenchPercentile(hist, total, 0.5), BenchPercentile(hist, total, 0.99), (maxus == BENCH_HIST_US) ? ">" : "", maxus);
+
+		pserverctx->close();
+		delete[] pclients;
+		delete pserverctx;
+	}
+
+	return 1;
+}
+
+// "tlsstall": a TLS client asks for TLSSTALL_SIZE bytes once per way of sending, reads nothing
+// for a second so the server's socket fills up and its writes are retried from the output queue,
+// then checks every byte. SO_RCVBUF is set before connect() so that the window stays small.
+#define TLSSTALL_SIZE 3000000
+#define TLSSTALL_PORT 12347
+
+static char *s_tlsstallpat = NULL;
+static int s_tlsstallfd = -1;
+
+// 'a': three sendAsync() calls, 'v': one sendv(), 'f': sendAsync(), sendFile(), sendAsync()
+static int TlsStall_RecvHandler(JsServerSocket::ServerContext *pServerCtx, void *pthreaduserctx, JsServerSocket::ClientContext *pClientCtx, int recv_len, char *recv_pbuf)
+{
+	struct iovec iov[3];
+	int third = TLSSTALL_SIZE / 3;
+	int nrst = -1;
+
+	switch (recv_pbuf[0])
+	{
+	case 'a':
+		if (((nrst = pClientCtx->sendAsync(s_tlsstallpat, third)) > 0) && ((nrst = pClientCtx->sendAsync(&s_tlsstallpat[third], third)) > 0))
+			nrst = pClientCtx->sendAsync(&s_tlsstallpat[2 * third], TLSSTALL_SIZE - 2 * third);
+		break;
+	case 'v':
+		iov[0].iov_base = s_tlsstallpat; iov[0].iov_len = third;
+		iov[1].iov_base = &s_tlsstallpat[third]; iov[1].iov_len = 0;
+		iov[2].iov_base = &s_tlsstallpat[third]; iov[2].iov_len = TLSSTALL_SIZE - third;
+		nrst = pClientCtx->sendv(iov, 3);
+		break;
+	case 'f':
+		if (((nrst = pClientCtx->sendAsync(s_tlsstallpat, 1000)) > 0) && ((nrst = pClientCtx->sendFile(s_tlsstallfd, 1000, TLSSTALL_SIZE - 2000)) > 0))
+			nrst = pClientCtx->sendAsync(&s_tlsstallpat[TLSSTALL_SIZE - 1000], 1000);
+		break;
+	}
+	return (nrst > 0) ? 1 : -1;
+}
+
+// Returns the number of bytes that arrived intact, up to the first one that did not
+static int TlsStallClient(SSL_CTX *psslctx, const struct sockaddr_in *pserver_addr, char request)
+{
+	char buf[16384];
+	struct timeval tvtimeout = { 10, 0 };
+	int rcvbuf = 4096;
+	int sock;
+	SSL *pssl;
+	int received = 0;
+	int nrst;
+	int i;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tvtimeout, sizeof(tvtimeout));
+	if (connect(sock, (const struct sockaddr*)pserver_addr, sizeof(*pserver_addr)) < 0)
+	{
+		close(sock);
+		return 0;
+	}
+	pssl = SSL_new(psslctx);
+	SSL_set_fd(pssl, sock);
+	if ((SSL_connect(pssl) == 1) && (SSL_write(pssl, &request, 1) == 1))
+	{
+		sleep(1);
+		while (received < TLSSTALL_SIZE)
+		{
+			if ((nrst = SSL_read(pssl, buf, sizeof(buf))) <= 0)
+				break;
+			for (i = 0; (i < nrst) && (received + i < TLSSTALL_SIZE); i++)
+			{
+				if (buf[i] != s_tlsstallpat[received + i])
+					break;
+			}
+			received += i;
+			if (i < nrst)
+				break;
+		}
+	}
+	SSL_free(pssl);
+	close(sock);
+	return received;
+}
+
+static int RunTlsStallTest(const char *certfile, const char *keyfile)
+{
+	static const char requests[] = { 'a', 'v', 'f' };
+	static const char *requestnames[] = { "sendAsync", "sendv", "sendFile" };
+	JsServerSocket::ServerContext serverCtx(NULL);
+	JsServerSocket::ServerContext::Options options;
+	struct sockaddr_in server_addr;
+	char filename[] = "/tmp/tlsstallXXXXXX";
+	SSL_CTX *pclientsslctx;
+	int numoffailed = 0;
+	int received;
+	int i;
+
+	s_tlsstallpat = (char*)malloc(TLSSTALL_SIZE);
+	for (i = 0; i < TLSSTALL_SIZE; i++)
+		s_tlsstallpat[i] = (char)(i % 251);
+	if ((s_tlsstallfd = mkstemp(filename)) < 0)
+		return -1;
+	unlink(filename);
+	if (write(s_tlsstallfd, s_tlsstallpat, TLSSTALL_SIZE) != TLSSTALL_SIZE)
+		return -1;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family      = AF_INET;
+	server_addr.sin_port        = htons(TLSSTALL_PORT);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// A small send buffer makes the first SSL_write() of a reply block
+	options.socketOptions.sendBufSize = 16384;
+	if (serverCtx.init(AF_INET, SOCK_STREAM, IPPROTO_TCP, true, SSLv23_server_method(), 16, 4, NULL, NULL, NULL, TlsStall_RecvHandler, NULL, &options) <= 0)
+		return -1;
+	if (serverCtx.sslLoadCertificates(certfile, keyfile) <= 0)
+	{
+		printf("cannot load %s and %s\n", certfile, keyfile);
+		return -1;
+	}
+	serverCtx.listen((sockaddr*)&server_addr, sizeof(server_addr), 16);
+	serverCtx.startWorkers(2);
+
+	pclientsslctx = SSL_CTX_new(SSLv23_client_method());
+	for (i = 0; i < (int)sizeof(requests); i++)
+	{
+		received = TlsStallClient(pclientsslctx, &server_addr, requests[i]);
+		printf("%s: %d of %d bytes %s\n", requestnames[i], received, TLSSTALL_SIZE, (received == TLSSTALL_SIZE) ? "ok" : "FAILED");
+		if (received != TLSSTALL_SIZE)
+			numoffailed++;
+	}
+	SSL_CTX_free(pclientsslctx);
+
+	serverCtx.close();
+	close(s_tlsstallfd);
+	free(s_tlsstallpat);
+	return (numoffailed == 0) ? 1 : 0;
+}
 
 int main(int argc, char *argv [])
 {
 	JsServerSocket::ServerContext serverCtx(NULL);
+	JsServerSocket::ServerContext::Options options;
 
 	struct sockaddr_in server_addr;
 	memset(&server_addr, 0, sizeof(server_addr));
@@ -82,16 +487,35 @@ int main(int argc, char *argv [])
 	
 	signal(SIGPIPE, SIG_IGN);
 	
+	// "uring" runs the same server on the io_uring backend, for a load from outside
+	if ((argc > 1) && (strcmp(argv[1], "uring") == 0))
+		options.backend = JsServerSocket::ServerContext::BACKEND_IO_URING;
+	// "rss N" reports the memory cost of N idle connections instead of serving
+	bool brss = (argc > 2) && (strcmp(argv[1], "rss") == 0);
+	
 	SSL_library_init();
+
+	// "bench [connections] [seconds]" puts the same echo load on the epoll and io_uring backends
+	if ((argc > 1) && (strcmp(argv[1], "bench") == 0))
+		return (RunBackendBenchmark((argc > 2) ? atoi(argv[2]) : 64, (argc > 3) ? atoi(argv[3]) : 5) > 0) ? 0 : 1;
+	// "tlsstall cert.pem key.pem" checks that TLS replies survive a reader that falls behind
+	if ((argc > 3) && (strcmp(argv[1], "tlsstall") == 0))
+		return (RunTlsStallTest(argv[2], argv[3]) > 0) ? 0 : 1;
 	
 	//serverCtx.init(AF_INET, SOCK_STREAM, IPPROTO_TCP, true, TLSv1_2_server_method(), 128, 4, StartWorkerPostHandler, StopWorkerHandler, Client_AcceptHandler, Client_RecvHandler, Client_DelHandler);
 	//serverCtx.sslLoadCertificates("/tmp/cert.pem", "/tmp/key.pem");
-	serverCtx.init(AF_INET, SOCK_STREAM, IPPROTO_TCP, false, NULL, 128, 4, StartWorkerPostHandler, StopWorkerHandler, Client_AcceptHandler, Client_RecvHandler, Client_DelHandler);
+	serverCtx.init(AF_INET, SOCK_STREAM, IPPROTO_TCP, false, NULL, brss ? 0 : 128, 4, StartWorkerPostHandler, StopWorkerHandler, Client_AcceptHandler, Client_RecvHandler, Client_DelHandler, &options);
 	
-	serverCtx.listen((sockaddr*)&server_addr, sizeof(server_addr), 128);
+	serverCtx.listen((sockaddr*)&server_addr, sizeof(server_addr), brss ? 4096 : 128);
 
 	serverCtx.startWorkers(2);
 
+	if (brss)
+	{
+		RunRssBenchmark(&serverCtx, atoi(argv[2]));
+		a = 0;
+	}
+
 	while (a)
 	{
 		usleep(1000000);